@@ -0,0 +1,209 @@
+#include "Compression.h"
+#include <string.h>
+
+/*
+ * This file contains an implementation of the LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+ * Every sequence is a token (4 bits literals length, 4 bits match length), the literals and a 2 byte offset back to the match.
+ * Speed matters more than ratio here - a single hash table probe per position, and the search speeds up on incompressible data.
+ */
+
+/*
+ * Defines:
+*/
+#define MIN_MATCH 4             // shortest match that can be encoded
+#define LAST_LITERALS 5         // the last 5 bytes are always literals
+#define MATCH_FIND_LIMIT 12     // the last match must start at least 12 bytes before the end
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+#define SKIP_TRIGGER 6          // after 2^6 failed attempts, skip 2 bytes at a time, etc.
+
+/*
+ * Helper Functions:
+*/
+static uint32_t read32(const uint8_t *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static uint32_t hash4(uint32_t value){
+    return (value * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// writes the rest of a length that didn't fit into 4 bits of the token
+static uint8_t* write_length(uint8_t *op, int length){
+    while (length >= 255){
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+/*
+ * Functions:
+*/
+int compress_block(const void *src, int src_size, void *dst, int dst_capacity){
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *ip = base, *anchor = base;
+    const uint8_t *iend = base + src_size;
+    const uint8_t *match_limit = iend - LAST_LITERALS;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + dst_capacity;
+    uint32_t table[1 << HASH_LOG];      // last position of every hashed 4 bytes sequence
+
+    if (src_size <= 0){
+        return 0;
+    }
+
+    if (src_size > MATCH_FIND_LIMIT){
+        const uint8_t *find_limit = iend - MATCH_FIND_LIMIT;
+        unsigned int attempts = 1 << SKIP_TRIGGER;
+
+        memset(table, 0, sizeof table);
+        ip++;
+        while (ip < find_limit){
+            uint32_t hash = hash4(read32(ip));
+            const uint8_t *ref = base + table[hash];
+            table[hash] = ip - base;
+
+            if (ip - ref > MAX_OFFSET || read32(ref) != read32(ip)){
+                ip += attempts++ >> SKIP_TRIGGER;
+                continue;
+            }
+            attempts = 1 << SKIP_TRIGGER;
+
+            // the match may start earlier than where we found it
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_start = ip;
+            int offset = ip - ref;
+
+            ip += MIN_MATCH;
+            ref += MIN_MATCH;
+            while (ip < match_limit && *ip == *ref){
+                ip++;
+                ref++;
+            }
+
+            int literals = match_start - anchor;
+            int match_length = ip - match_start - MIN_MATCH;
+            if (op + 1 + literals/255 + 1 + literals + 2 + match_length/255 + 1 > oend){
+                return 0;       // doesn't fit
+            }
+
+            uint8_t *token = op++;
+            if (literals >= 15){
+                *token = 15 << 4;
+                op = write_length(op, literals - 15);
+            }
+            else {
+                *token = literals << 4;
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            if (match_length >= 15){
+                *token |= 15;
+                op = write_length(op, match_length - 15);
+            }
+            else {
+                *token |= match_length;
+            }
+            anchor = ip;
+
+            // index a position inside the match, helps with long repeating data
+            if (ip < find_limit){
+                table[hash4(read32(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+
+    // last literals
+    int literals = iend - anchor;
+    if (op + 1 + literals/255 + 1 + literals > oend){
+        return 0;
+    }
+    if (literals >= 15){
+        *op++ = 15 << 4;
+        op = write_length(op, literals - 15);
+    }
+    else {
+        *op++ = literals << 4;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    int compressed_size = op - (uint8_t *) dst;
+    return compressed_size < src_size ? compressed_size : 0;
+}
+
+int decompress_block(const void *src, int src_size, void *dst, int dst_capacity){
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *iend = ip + src_size;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + dst_capacity;
+
+    while (ip < iend){
+        unsigned int token = *ip++;
+        unsigned int length, extra;
+
+        // literals
+        length = token >> 4;
+        if (length == 15){
+            do {
+                if (ip >= iend){
+                    return -1;
+                }
+                extra = *ip++;
+                length += extra;
+            } while (extra == 255);
+        }
+        if (length > (unsigned int)(iend - ip) || length > (unsigned int)(oend - op)){
+            return -1;
+        }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+
+        if (ip >= iend){
+            break;      // the last sequence has literals only
+        }
+
+        // match
+        if (iend - ip < 2){
+            return -1;
+        }
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned int)(op - (uint8_t *) dst)){
+            return -1;
+        }
+        length = token & 15;
+        if (length == 15){
+            do {
+                if (ip >= iend){
+                    return -1;
+                }
+                extra = *ip++;
+                length += extra;
+            } while (extra == 255);
+        }
+        length += MIN_MATCH;
+        if (length > (unsigned int)(oend - op)){
+            return -1;
+        }
+        // byte by byte - the match may overlap the bytes being written
+        const uint8_t *match = op - offset;
+        while (length--){
+            *op++ = *match++;
+        }
+    }
+
+    return op - (uint8_t *) dst;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * A small LZ4-compatible block compressor, shared by the TCP and RUDP programs.
+ * Compression is optional and is negotiated by the peers before any data is sent.
+*/
+
+/*
+ * Defines:
+*/
+#define COMPRESS_CHUNK_SIZE 65536                       // raw bytes compressed at once by the TCP sender
+#define COMPRESS_BOUND(size) ((size) + (size)/255 + 16)  // worst case size of a compressed block
+#define COMPRESS_FLAG_COMPRESSED 0x80000000u            // set in compress_chunk_header.wire_size if the chunk is compressed
+
+/*
+ * Structs:
+*/
+// Sent (in network byte order) before every chunk of a compressed TCP stream
+typedef struct _compress_chunk_header {
+    uint32_t raw_size;      // size of the chunk after decompression
+    uint32_t wire_size;     // bytes following this header (and COMPRESS_FLAG_COMPRESSED if they are compressed)
+} compress_chunk_header;
+
+/* 
+ * @brief Compresses a block of data.
+ * @param src The data to compress, src_size bytes long.
+ * @param dst Buffer for the compressed data, dst_capacity bytes long.
+ * @return The size of the compressed data, or 0 if it doesn't fit into dst or doesn't shrink (send it raw instead).
+*/
+int compress_block(const void *src, int src_size, void *dst, int dst_capacity);
+
+/* 
+ * @brief Decompresses a block created by compress_block().
+ * @param src The compressed data, src_size bytes long.
+ * @param dst Buffer for the original data, dst_capacity bytes long.
+ * @return The size of the original data, or -1 if the block is corrupted or doesn't fit into dst.
+*/
+int decompress_block(const void *src, int src_size, void *dst, int dst_capacity);
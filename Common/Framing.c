@@ -0,0 +1,25 @@
+#include "Framing.h"
+#include <endian.h>
+
+/*
+ * Functions:
+*/
+void frame_encode(transfer_frame *frame, uint64_t length, uint32_t transfer_id, uint32_t flags){
+    frame->length = htobe64(length);
+    frame->transfer_id = htobe32(transfer_id);
+    frame->flags = htobe32(flags);
+}
+
+void frame_decode(transfer_frame *frame){
+    frame->length = be64toh(frame->length);
+    frame->transfer_id = be32toh(frame->transfer_id);
+    frame->flags = be32toh(frame->flags);
+}
+
+void trailer_encode(frame_trailer *trailer, uint64_t hash){
+    trailer->hash = htobe64(hash);
+}
+
+uint64_t trailer_decode(const frame_trailer *trailer){
+    return be64toh(trailer->hash);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * The transfer frame, shared by the TCP and RUDP programs.
+ * Every file is sent as a frame header followed by exactly `length` payload bytes - any bytes, zeros included.
+ * The header is sent together with the first payload bytes (same segment / same packet), so it costs no extra round trip.
+*/
+
+/*
+ * Defines:
+*/
+#define FRAME_FLAG_EXIT 0x01        // the sender is done, no payload follows
+#define FRAME_FLAG_HASH 0x02        // the payload is followed by a frame_trailer with its XXH64 (see Hash.h)
+#define FRAME_FLAG_BULK 0x04        // RUDP: the frame has a packet of its own, the payload follows as a bulk transfer (rudp_send_bulk())
+#define FRAME_FLAG_STREAMS 0x08     // RUDP: the frame has a packet of its own, the payload follows split into equal parts, stream 1
+                                    // carrying the first (rudp_send_streams()) - as many as the top byte of the flags says
+#define FRAME_STREAMS_SHIFT 24
+#define FRAME_STREAMS(flags) (((flags) >> FRAME_STREAMS_SHIFT) & 0xFF)
+
+/*
+ * Structs:
+*/
+// On the wire in network byte order, see frame_encode() / frame_decode()
+typedef struct _transfer_frame {
+    uint64_t length;        // payload bytes following the header
+    uint32_t transfer_id;   // counts the files sent over the connection
+    uint32_t flags;         // FRAME_FLAG_*
+} transfer_frame;
+
+// Sent right after the payload of a frame flagged FRAME_FLAG_HASH, in network byte order
+typedef struct _frame_trailer {
+    uint64_t hash;          // XXH64 of the payload, seeded with HASH_SEED
+} frame_trailer;
+
+/* 
+ * @brief Fills a frame header, ready to be sent.
+*/
+void frame_encode(transfer_frame *frame, uint64_t length, uint32_t transfer_id, uint32_t flags);
+
+/* 
+ * @brief Converts a received frame header to host byte order (in place).
+*/
+void frame_decode(transfer_frame *frame);
+
+/* 
+ * @brief Fills a trailer, ready to be sent.
+*/
+void trailer_encode(frame_trailer *trailer, uint64_t hash);
+
+/* 
+ * @brief The hash in a received trailer.
+*/
+uint64_t trailer_decode(const frame_trailer *trailer);
@@ -0,0 +1,169 @@
+#include "Hash.h"
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Defines:
+*/
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+/*
+ * Functions:
+*/
+static inline uint64_t xxh64_rotl(uint64_t x, int bits){
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t *p){
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return le64toh(value);
+}
+
+static inline uint32_t xxh64_read32(const uint8_t *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return le32toh(value);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input){
+    acc += input * PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value){
+    acc ^= xxh64_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// hashes whole 32 byte stripes, returns the bytes consumed
+static size_t xxh64_stripes(uint64_t *acc, const uint8_t *p, size_t size){
+    const uint8_t *start = p;
+    uint64_t v1 = acc[0], v2 = acc[1], v3 = acc[2], v4 = acc[3];
+    while (size >= 32){
+        v1 = xxh64_round(v1, xxh64_read64(p));
+        v2 = xxh64_round(v2, xxh64_read64(p + 8));
+        v3 = xxh64_round(v3, xxh64_read64(p + 16));
+        v4 = xxh64_round(v4, xxh64_read64(p + 24));
+        p += 32;
+        size -= 32;
+    }
+    acc[0] = v1;
+    acc[1] = v2;
+    acc[2] = v3;
+    acc[3] = v4;
+    return p - start;
+}
+
+void xxh64_reset(xxh64_state *state, uint64_t seed){
+    memset(state, 0, sizeof *state);
+    state->seed = seed;
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+}
+
+void xxh64_update(xxh64_state *state, const void *data, size_t size){
+    const uint8_t *p = (const uint8_t *)data;
+    state->total += size;
+
+    if (state->buffered + size < 32){
+        memcpy(state->buffer + state->buffered, p, size);
+        state->buffered += size;
+        return;
+    }
+    if (state->buffered > 0){
+        // complete the buffered stripe first
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, p, fill);
+        xxh64_stripes(state->acc, state->buffer, 32);
+        p += fill;
+        size -= fill;
+        state->buffered = 0;
+    }
+    size_t consumed = xxh64_stripes(state->acc, p, size);
+    memcpy(state->buffer, p + consumed, size - consumed);
+    state->buffered = size - consumed;
+}
+
+uint64_t xxh64_digest(const xxh64_state *state){
+    uint64_t h;
+    if (state->total >= 32){
+        const uint64_t *acc = state->acc;
+        h = xxh64_rotl(acc[0], 1) + xxh64_rotl(acc[1], 7) + xxh64_rotl(acc[2], 12) + xxh64_rotl(acc[3], 18);
+        h = xxh64_merge_round(h, acc[0]);
+        h = xxh64_merge_round(h, acc[1]);
+        h = xxh64_merge_round(h, acc[2]);
+        h = xxh64_merge_round(h, acc[3]);
+    }
+    else {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->total;
+
+    // the tail - less than a stripe
+    const uint8_t *p = state->buffer;
+    size_t left = state->buffered;
+    while (left >= 8){
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        left -= 8;
+    }
+    if (left >= 4){
+        h ^= (uint64_t)xxh64_read32(p) * PRIME64_1;
+        h = xxh64_rotl(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    while (left > 0){
+        h ^= *p * PRIME64_5;
+        h = xxh64_rotl(h, 11) * PRIME64_1;
+        p++;
+        left--;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed){
+    xxh64_state state;
+    xxh64_reset(&state, seed);
+    xxh64_update(&state, data, size);
+    return xxh64_digest(&state);
+}
+
+static void* hash_thread(void *arg){
+    hash_job *job = (hash_job *)arg;
+    job->hash = xxh64(job->data, job->size, HASH_SEED);
+    return NULL;
+}
+
+void hash_start(hash_job *job, const void *data, size_t size){
+    job->data = data;
+    job->size = size;
+    job->running = pthread_create(&job->thread, NULL, hash_thread, job) == 0;
+    if (!job->running){
+        hash_thread(job);
+    }
+}
+
+uint64_t hash_wait(hash_job *job){
+    if (job->running){
+        pthread_join(job->thread, NULL);
+        job->running = 0;
+    }
+    return job->hash;
+}
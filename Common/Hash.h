@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * XXH64 (https://github.com/Cyan4973/xxHash), the end-to-end integrity check of a transfer.
+ * The receiver hashes the payload a piece at a time as it arrives and compares the result with the sender's
+ * trailer (see FRAME_FLAG_HASH in Framing.h). The sender hashes its payload once, on a thread of its own,
+ * while the first transfer is on the wire.
+*/
+
+/*
+ * Defines:
+*/
+#define HASH_SEED 0
+
+/*
+ * Structs:
+*/
+// A hash in progress, see xxh64_update()
+typedef struct _xxh64_state {
+    uint64_t total;             // bytes hashed
+    uint64_t acc[4];            // the four lanes
+    uint8_t buffer[32];         // bytes not hashed yet (less than a stripe)
+    uint32_t buffered;
+    uint64_t seed;
+} xxh64_state;
+
+// A whole buffer hashed on a background thread, see hash_start()
+typedef struct _hash_job {
+    const void *data;
+    size_t size;
+    uint64_t hash;
+    pthread_t thread;
+    int running;                // the thread wasn't joined yet
+} hash_job;
+
+/*
+ * @brief Starts a new hash.
+*/
+void xxh64_reset(xxh64_state *state, uint64_t seed);
+
+/*
+ * @brief Adds the next bytes to the hash.
+*/
+void xxh64_update(xxh64_state *state, const void *data, size_t size);
+
+/*
+ * @brief The hash of everything added so far (the state can still be updated).
+*/
+uint64_t xxh64_digest(const xxh64_state *state);
+
+/*
+ * @brief The hash of a whole buffer.
+*/
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+/*
+ * @brief Starts hashing a buffer (with HASH_SEED) on another thread, or hashes it right away if a thread can't be started.
+ * @note The buffer must not change until hash_wait().
+*/
+void hash_start(hash_job *job, const void *data, size_t size);
+
+/*
+ * @brief Waits for hash_start()'s hash. Can be called any number of times.
+*/
+uint64_t hash_wait(hash_job *job);
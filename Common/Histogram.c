@@ -0,0 +1,82 @@
+#include "Histogram.h"
+#include <stdio.h>
+
+/*
+ * Defines:
+*/
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/*
+ * Functions:
+*/
+// values below SUB_BUCKETS map to themselves, above it the top HISTOGRAM_SUB_BUCKET_BITS+1 bits pick the bucket
+static int bucket_index(uint64_t value){
+    if (value < SUB_BUCKETS){
+        return value;
+    }
+    if (value >= (uint64_t)1 << HISTOGRAM_MAX_BITS){
+        value = ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift << HISTOGRAM_SUB_BUCKET_BITS) + (value >> shift);
+}
+
+// the highest value that falls into a bucket
+static uint64_t bucket_highest(int index){
+    if (index < 2 * SUB_BUCKETS){
+        return index;
+    }
+    int shift = (index >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    uint64_t lowest = (uint64_t)((index & (SUB_BUCKETS - 1)) + SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(histogram *hist, uint64_t value){
+    if (hist->count == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[bucket_index(value)]++;
+}
+
+uint64_t histogram_percentile(const histogram *hist, double percentile){
+    if (hist->count == 0){
+        return 0;
+    }
+    // the rank of the wanted value, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > hist->count)
+        rank = hist->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if (seen >= rank){
+            // the bucket's top, but never above what was actually recorded
+            uint64_t value = bucket_highest(i);
+            if (value > hist->max)
+                value = hist->max;
+            if (value < hist->min)
+                value = hist->min;
+            return value;
+        }
+    }
+    return hist->max;
+}
+
+void histogram_print(const histogram *hist, const char *name, const char *unit){
+    if (hist->count == 0){
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s (%s): count=%llu min=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu\n",
+           name, unit, (unsigned long long)hist->count, (unsigned long long)hist->min,
+           (double)hist->sum / hist->count,
+           (unsigned long long)histogram_percentile(hist, 50), (unsigned long long)histogram_percentile(hist, 90),
+           (unsigned long long)histogram_percentile(hist, 99), (unsigned long long)histogram_percentile(hist, 99.9),
+           (unsigned long long)hist->max);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * A latency histogram in the spirit of HdrHistogram: log-linear buckets with a fixed relative error,
+ * a fixed size and no allocations - recording a value is a few instructions, so it can always stay on.
+ * Values below 2^HISTOGRAM_SUB_BUCKET_BITS get a bucket each, bigger values share a bucket with values
+ * less than 1/2^HISTOGRAM_SUB_BUCKET_BITS (~3%) away from them.
+*/
+
+/*
+ * Defines:
+*/
+#define HISTOGRAM_SUB_BUCKET_BITS 5         // 32 buckets for every power of two
+#define HISTOGRAM_MAX_BITS 36               // values up to 2^36 (~19 hours in microseconds), bigger ones are clamped
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS)
+
+/*
+ * Structs:
+*/
+typedef struct _histogram {
+    uint64_t count;         // values recorded
+    uint64_t sum;           // for the mean
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+/*
+ * @brief Adds a value to the histogram. A zeroed histogram is an empty one.
+*/
+void histogram_record(histogram *hist, uint64_t value);
+
+/*
+ * @brief The value below which the given percent of the recorded values fall (within the bucket's precision).
+ * @param percentile 0 - 100.
+ * @return The value, 0 if the histogram is empty.
+*/
+uint64_t histogram_percentile(const histogram *hist, double percentile);
+
+/*
+ * @brief Prints one line: count, min, mean, p50, p90, p99, p99.9 and max, all in the given unit.
+*/
+void histogram_print(const histogram *hist, const char *name, const char *unit);
@@ -0,0 +1,314 @@
+#include "Impair.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * This file contains the impairment simulator, see Impair.h.
+ */
+
+/*
+ * Declaring Functions:
+*/
+static void* impair_thread(void *arg);
+
+/*
+ * Helper Functions:
+*/
+uint64_t impair_now_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// xorshift64* - small, fast and reproducible across platforms (unlike rand())
+static uint64_t next_random(impair_state *state){
+    state->rng ^= state->rng >> 12;
+    state->rng ^= state->rng << 25;
+    state->rng ^= state->rng >> 27;
+    return state->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// uniform in [0, 100)
+static double random_percent(impair_state *state){
+    return (next_random(state) >> 11) * (100.0 / 9007199254740992.0);
+}
+
+static uint64_t ms_to_usec(double ms){
+    return (uint64_t)(ms * 1000.0);
+}
+
+/*
+ * Functions:
+*/
+int impair_parse(impair_config *config, const char *spec){
+    memset(config, 0, sizeof(*config));
+    config->seed = 1;
+
+    if (spec == NULL){
+        return 0;
+    }
+
+    char *copy = strdup(spec);
+    if (copy == NULL){
+        return -1;
+    }
+
+    int result = 0;
+    char *saveptr = NULL;
+    for (char *pair = strtok_r(copy, ",", &saveptr); pair != NULL; pair = strtok_r(NULL, ",", &saveptr)){
+        char *value = strchr(pair, '=');
+        if (value == NULL){
+            fprintf(stderr, "impair: missing value for \"%s\"\n", pair);
+            result = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        char *end = NULL;
+        if (!strcmp(pair, "seed")){
+            config->seed = strtoull(value, &end, 0);
+        }
+        else if (!strcmp(pair, "loss")){
+            config->loss = strtod(value, &end);
+        }
+        else if (!strcmp(pair, "burst")){
+            config->burst_p = strtod(value, &end);
+            if (*end == ':'){
+                config->burst_r = strtod(end + 1, &end);
+            }
+            else {
+                end = value;    // r is required
+            }
+        }
+        else if (!strcmp(pair, "delay")){
+            config->delay_ms = strtod(value, &end);
+        }
+        else if (!strcmp(pair, "jitter")){
+            config->jitter_ms = strtod(value, &end);
+        }
+        else if (!strcmp(pair, "reorder")){
+            config->reorder = strtod(value, &end);
+        }
+        else if (!strcmp(pair, "dup")){
+            config->duplicate = strtod(value, &end);
+        }
+        else if (!strcmp(pair, "rate")){
+            config->rate_mbit = strtod(value, &end);
+        }
+        else {
+            fprintf(stderr, "impair: unknown impairment \"%s\"\n", pair);
+            result = -1;
+            break;
+        }
+
+        if (end == value || *end != '\0'){
+            fprintf(stderr, "impair: bad value \"%s\" for %s\n", value, pair);
+            result = -1;
+            break;
+        }
+    }
+
+    free(copy);
+    return result;
+}
+
+impair_state* impair_create(const char *spec, impair_send_fn send_fn){
+    impair_state *state = (impair_state *) calloc (1, sizeof(impair_state));
+    if (state == NULL){
+        return NULL;
+    }
+    if (impair_parse(&state->config, spec) == -1){
+        free(state);
+        return NULL;
+    }
+
+    // splitmix64 to spread the seed into a good (never zero) xorshift state
+    uint64_t z = state->config.seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    state->rng = (z ^ (z >> 31)) | 1;
+
+    state->send_fn = send_fn;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->wakeup, NULL);
+    return state;
+}
+
+int impair_decide(impair_state *state, size_t bytes, uint64_t now_usec, uint64_t release_usec[2]){
+    impair_config *config = &state->config;
+
+    state->packets++;
+
+    // Every random number is drawn for every packet (even if unused), so a decision never shifts the ones after it
+    double loss_roll = random_percent(state);
+    double burst_roll = random_percent(state);
+    double jitter_roll = random_percent(state);
+    double reorder_roll = random_percent(state);
+    double duplicate_roll = random_percent(state);
+    double duplicate_jitter_roll = random_percent(state);
+
+    // Gilbert-Elliott burst loss
+    if (config->burst_p > 0){
+        if (state->bad_state)
+            state->bad_state = !(burst_roll < config->burst_r);
+        else
+            state->bad_state = burst_roll < config->burst_p;
+    }
+    if (state->bad_state || loss_roll < config->loss){
+        state->dropped++;
+        return 0;
+    }
+
+    // the packet occupies the emulated link for bytes/rate
+    uint64_t departure = now_usec;
+    if (config->rate_mbit > 0){
+        if (state->link_free_usec > departure)
+            departure = state->link_free_usec;
+        state->link_free_usec = departure + (uint64_t)(bytes * 8 / config->rate_mbit);
+    }
+
+    uint64_t delay = ms_to_usec(config->delay_ms) + ms_to_usec(config->jitter_ms * jitter_roll / 100.0);
+    if (reorder_roll < config->reorder){
+        // hold it back long enough for the next packets to overtake it
+        uint64_t extra = ms_to_usec(config->delay_ms + config->jitter_ms);
+        delay += extra > 1000 ? extra : 1000;
+    }
+    release_usec[0] = departure + delay;
+    if (delay > 0 || departure > now_usec){
+        state->delayed++;
+    }
+
+    if (duplicate_roll < config->duplicate){
+        state->duplicated++;
+        release_usec[1] = release_usec[0] + ms_to_usec(config->jitter_ms * duplicate_jitter_roll / 100.0);
+        return 2;
+    }
+    return 1;
+}
+
+ssize_t impair_sendto(impair_state *state, int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len){
+    uint64_t release[2];
+    uint64_t now = impair_now_usec();
+
+    pthread_mutex_lock(&state->lock);
+    int copies = impair_decide(state, len, now, release);
+
+    for (int i = 0; i < copies; i++){
+        if (release[i] <= now && state->queue == NULL){
+            // nothing to wait for - send right away
+            pthread_mutex_unlock(&state->lock);
+            ssize_t sent = state->send_fn(sock, buf, len, flags, to, to_len);
+            pthread_mutex_lock(&state->lock);
+            if (sent == -1){
+                pthread_mutex_unlock(&state->lock);
+                return -1;
+            }
+            continue;
+        }
+
+        // delay line - keep a copy until its release time
+        impair_packet *packet = (impair_packet *) malloc (sizeof(impair_packet) + len);
+        if (packet == NULL){
+            continue;       // behaves like a lost packet
+        }
+        packet->release_usec = release[i];
+        packet->sock = sock;
+        packet->flags = flags;
+        packet->length = len;
+        packet->to_len = to == NULL ? 0 : to_len;
+        if (to != NULL){
+            memcpy(&packet->to, to, to_len);
+        }
+        memcpy(packet->data, buf, len);
+
+        // keep the queue sorted by release time (stable - equal times keep their order)
+        impair_packet **position = &state->queue;
+        while (*position != NULL && (*position)->release_usec <= packet->release_usec){
+            position = &(*position)->next;
+        }
+        packet->next = *position;
+        *position = packet;
+
+        if (!state->thread_running){
+            if (pthread_create(&state->thread, NULL, impair_thread, state) == 0)
+                state->thread_running = 1;
+        }
+        pthread_cond_signal(&state->wakeup);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return len;
+}
+
+// Sends delayed packets when their time comes
+static void* impair_thread(void *arg){
+    impair_state *state = (impair_state *) arg;
+
+    pthread_mutex_lock(&state->lock);
+    while (state->thread_running){
+        if (state->queue == NULL){
+            pthread_cond_wait(&state->wakeup, &state->lock);
+            continue;
+        }
+
+        uint64_t now = impair_now_usec();
+        impair_packet *packet = state->queue;
+        if (packet->release_usec > now){
+            // CLOCK_REALTIME is what pthread_cond_timedwait uses by default
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t wait = packet->release_usec - now;
+            until.tv_sec += wait / 1000000;
+            until.tv_nsec += (wait % 1000000) * 1000;
+            if (until.tv_nsec >= 1000000000){
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&state->wakeup, &state->lock, &until);
+            continue;
+        }
+
+        state->queue = packet->next;
+        pthread_mutex_unlock(&state->lock);
+        state->send_fn(packet->sock, packet->data, packet->length, packet->flags,
+            packet->to_len ? (struct sockaddr *)&packet->to : NULL, packet->to_len);
+        free(packet);
+        pthread_mutex_lock(&state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return NULL;
+}
+
+void impair_report(impair_state *state){
+    fprintf(stderr, "impair: %llu packets, %llu dropped, %llu delayed, %llu duplicated\n",
+        (unsigned long long) state->packets, (unsigned long long) state->dropped,
+        (unsigned long long) state->delayed, (unsigned long long) state->duplicated);
+}
+
+void impair_destroy(impair_state *state){
+    if (state == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    int running = state->thread_running;
+    state->thread_running = 0;
+    pthread_cond_signal(&state->wakeup);
+    pthread_mutex_unlock(&state->lock);
+    if (running){
+        pthread_join(state->thread, NULL);
+    }
+
+    while (state->queue != NULL){
+        impair_packet *next = state->queue->next;
+        free(state->queue);
+        state->queue = next;
+    }
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->wakeup);
+    free(state);
+}
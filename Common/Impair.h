@@ -0,0 +1,113 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * A deterministic network impairment simulator (a userspace "tc netem").
+ * Every outgoing packet goes through impair_sendto(), which decides - with a seeded PRNG, so the same seed
+ * always makes the same decisions for the same packets - whether to drop, delay, duplicate or hold it back
+ * to respect a bandwidth limit. Delayed packets are sent later by a background thread.
+ *
+ * Impairments are described by a string of comma separated key=value pairs, for example:
+ *      "seed=7,loss=2,burst=1:25,delay=20,jitter=5,reorder=1,dup=0.5,rate=100"
+ * seed     PRNG seed (default 1)
+ * loss     random loss, percent
+ * burst    Gilbert-Elliott burst loss "p:r" - percent chance to move from the good state to the bad
+ *          state (where every packet is lost) and back, checked every packet
+ * delay    one way delay, ms
+ * jitter   random extra delay, up to this many ms (may reorder packets)
+ * reorder  percent of packets held back by an extra delay+jitter (at least 1ms), so later packets pass them
+ * dup      percent of packets sent twice
+ * rate     bandwidth limit, Mbit/s (0 - unlimited)
+*/
+
+/*
+ * Defines:
+*/
+#define IMPAIR_ENV "IMPAIR"             // spec used by the LD_PRELOAD shim (libimpair.so)
+
+/*
+ * Structs:
+*/
+typedef ssize_t (*impair_send_fn)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+
+typedef struct _impair_config {
+    uint64_t seed;
+    double loss;                // percent
+    double burst_p, burst_r;    // percent, Gilbert-Elliott transition chances (good->bad, bad->good)
+    double delay_ms;
+    double jitter_ms;
+    double reorder;             // percent
+    double duplicate;           // percent
+    double rate_mbit;           // 0 - unlimited
+} impair_config;
+
+typedef struct _impair_packet {
+    uint64_t release_usec;      // when to send it
+    int sock;
+    int flags;
+    struct sockaddr_storage to;
+    socklen_t to_len;
+    size_t length;
+    struct _impair_packet *next;
+    char data[];
+} impair_packet;
+
+typedef struct _impair_state {
+    impair_config config;
+    uint64_t rng;               // PRNG state
+    int bad_state;              // Gilbert-Elliott state
+    uint64_t link_free_usec;    // the emulated link is busy (rate limit) until this time
+    impair_send_fn send_fn;     // the real send function
+
+    // delay line - packets waiting for their release time, sorted by it
+    impair_packet *queue;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t thread;
+    int thread_running;
+
+    // counters
+    uint64_t packets, dropped, duplicated, delayed;
+} impair_state;
+
+/* 
+ * @brief Parses an impairment spec (see above) into config.
+ * @return 0 on success, -1 if the spec is invalid.
+*/
+int impair_parse(impair_config *config, const char *spec);
+
+/* 
+ * @brief Creates an impairment simulator.
+ * @param spec The impairments (see above).
+ * @param send_fn The function that actually sends packets (sendto, or the real sendto when interposing it).
+ * @return The simulator, or NULL if the spec is invalid or memory allocation failed.
+*/
+impair_state* impair_create(const char *spec, impair_send_fn send_fn);
+
+/* 
+ * @brief Decides the fate of a packet of the given size, leaving now_usec.
+ * @param release_usec Filled with the time each copy should be sent at.
+ * @return The number of copies to send (0 - the packet is lost, 1, or 2 if duplicated).
+*/
+int impair_decide(impair_state *state, size_t bytes, uint64_t now_usec, uint64_t release_usec[2]);
+
+/* 
+ * @brief sendto() through the simulator. Returns as sendto() would have (lost packets count as sent).
+*/
+ssize_t impair_sendto(impair_state *state, int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len);
+
+/* 
+ * @brief Prints what the simulator did to stderr.
+*/
+void impair_report(impair_state *state);
+
+/* 
+ * @brief Stops the simulator, packets that are still delayed are dropped.
+*/
+void impair_destroy(impair_state *state);
+
+// CLOCK_MONOTONIC in microseconds
+uint64_t impair_now_usec();
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "Impair.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * LD_PRELOAD shim that runs a program's sockets through the impairment simulator, without root or tc netem:
+ *      IMPAIR="seed=1,loss=5,delay=10" LD_PRELOAD=./libimpair.so ./TCP_Sender ...
+ *
+ * Datagram sockets are impaired packet by packet, exactly like RUDP's built in layer.
+ * A TCP stream can't lose bytes, so for stream sockets every send is cut into MSS sized segments that go through
+ * the same decisions, and their effect is emulated on the sender:
+ *      delay/jitter - the send is held until the first segment's release time
+ *      rate - every segment waits for the emulated link to be free
+ *      loss - a lost segment costs the sender a retransmission: one emulated round trip (2 * delay, at least 1ms).
+ *             After MAX_RETRANSMITS in a row the send fails with ETIMEDOUT, like a TCP connection that gives up
+ *      dup/reorder - no effect, the receiving kernel hides them from the application anyway
+ * sendfile() and splice() to a TCP socket can't be cut into segments in the kernel, so their data is read into a buffer
+ * here and sent like send() does - the zero-copy is lost, the impairments are not.
+ * MSG_ZEROCOPY is dropped for the same reason: the kernel would report every segment as a send of its own, so
+ * SO_ZEROCOPY fails with EOPNOTSUPP on an impaired TCP socket and the program falls back to plain sends.
+*/
+
+/*
+ * Defines:
+*/
+#define SEGMENT_SIZE 1448       // typical MSS on ethernet
+#define MAX_RETRANSMITS 15      // of a single segment, Linux's default net.ipv4.tcp_retries2
+#define COPY_SIZE 65536         // bytes sendfile() / splice() read at once
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/*
+ * Static Vars:
+*/
+static impair_send_fn real_sendto = NULL;
+static ssize_t (*real_send)(int, const void *, size_t, int) = NULL;
+static ssize_t (*real_writev)(int, const struct iovec *, int) = NULL;
+static ssize_t (*real_sendfile)(int, int, off_t *, size_t) = NULL;
+static ssize_t (*real_splice)(int, loff_t *, int, loff_t *, size_t, unsigned int) = NULL;
+static int (*real_setsockopt)(int, int, int, const void *, socklen_t) = NULL;
+static impair_state *state = NULL;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/*
+ * Helper Functions:
+*/
+static void shim_report(){
+    impair_report(state);
+}
+
+static void shim_init(){
+    real_sendto = (impair_send_fn) dlsym(RTLD_NEXT, "sendto");
+    real_send = dlsym(RTLD_NEXT, "send");
+    real_writev = dlsym(RTLD_NEXT, "writev");
+    real_sendfile = dlsym(RTLD_NEXT, "sendfile");
+    real_splice = dlsym(RTLD_NEXT, "splice");
+    real_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+
+    const char *spec = getenv(IMPAIR_ENV);
+    if (spec == NULL){
+        return;
+    }
+    state = impair_create(spec, real_sendto);
+    if (state == NULL){
+        fprintf(stderr, "impair: invalid %s=\"%s\", running without impairments\n", IMPAIR_ENV, spec);
+        return;
+    }
+    atexit(shim_report);
+}
+
+static int is_stream(int sock){
+    int type = 0;
+    socklen_t len = sizeof type;
+    return getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+static void sleep_until(uint64_t when_usec){
+    uint64_t now = impair_now_usec();
+    if (when_usec > now){
+        usleep(when_usec - now);
+    }
+}
+
+// Emulates the link for a send() on a TCP socket, see above
+static ssize_t stream_send(int sock, const void *buf, size_t len, int flags){
+    double rtt_ms = 2 * state->config.delay_ms;
+    uint64_t penalty = (uint64_t)((rtt_ms > 1 ? rtt_ms : 1) * 1000);
+    uint64_t start = impair_now_usec();     // every segment is timed from the send() call, so delays don't add up
+    uint64_t penalties = 0;                 // time lost to retransmissions so far
+    size_t total = 0;
+
+    flags &= ~MSG_ZEROCOPY;     // the segments are sent one by one, see above
+    while (total < len){
+        size_t segment = len - total < SEGMENT_SIZE ? len - total : SEGMENT_SIZE;
+        uint64_t release[2];
+        int retransmits = 0;
+
+        pthread_mutex_lock(&state->lock);
+        while (impair_decide(state, segment, start, release) == 0 && retransmits <= MAX_RETRANSMITS){
+            // lost - the segment is sent again after a round trip
+            penalties += penalty;
+            retransmits++;
+        }
+        pthread_mutex_unlock(&state->lock);
+        if (retransmits > MAX_RETRANSMITS){
+            errno = ETIMEDOUT;
+            return total > 0 ? (ssize_t) total : -1;
+        }
+
+        sleep_until(release[0] + penalties);
+
+        ssize_t sent = real_send(sock, (const char *)buf + total, segment, flags);
+        if (sent <= 0){
+            return total > 0 ? (ssize_t) total : sent;
+        }
+        total += sent;
+    }
+    return total;
+}
+
+// Reads up to len bytes of fd (at *offset if it's not NULL, advancing it) and sends them with stream_send()
+static ssize_t stream_copy(int sock, int fd, off_t *offset, size_t len, int flags){
+    char buffer[COPY_SIZE];
+    size_t chunk = len < sizeof buffer ? len : sizeof buffer;
+    ssize_t got = offset != NULL ? pread(fd, buffer, chunk, *offset) : read(fd, buffer, chunk);
+    if (got <= 0){
+        return got;
+    }
+    ssize_t sent = stream_send(sock, buffer, got, flags);
+    if (sent > 0 && offset != NULL){
+        *offset += sent;
+    }
+    else if (sent > 0 && sent < got){
+        // give back what wasn't sent - a pipe can't, but a send only stops short when the connection failed
+        lseek(fd, sent - got, SEEK_CUR);
+    }
+    return sent;
+}
+
+/*
+ * Interposed Functions:
+*/
+ssize_t sendto(int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len){
+    pthread_once(&once, shim_init);
+    if (state == NULL){
+        return real_sendto(sock, buf, len, flags, to, to_len);
+    }
+    if (is_stream(sock)){
+        return stream_send(sock, buf, len, flags);
+    }
+    return impair_sendto(state, sock, buf, len, flags, to, to_len);
+}
+
+ssize_t send(int sock, const void *buf, size_t len, int flags){
+    pthread_once(&once, shim_init);
+    if (state == NULL){
+        return real_send(sock, buf, len, flags);
+    }
+    if (is_stream(sock)){
+        return stream_send(sock, buf, len, flags);
+    }
+    return impair_sendto(state, sock, buf, len, flags, NULL, 0);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt){
+    pthread_once(&once, shim_init);
+    if (state == NULL || !is_stream(fd)){
+        return real_writev(fd, iov, iovcnt);
+    }
+    // one piece at a time, MSG_MORE keeps them in the same segments like writev() would
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++){
+        ssize_t sent = stream_send(fd, iov[i].iov_base, iov[i].iov_len, i < iovcnt - 1 ? MSG_MORE : 0);
+        if (sent < 0){
+            return total > 0 ? total : sent;
+        }
+        total += sent;
+        if ((size_t) sent < iov[i].iov_len){
+            break;
+        }
+    }
+    return total;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count){
+    pthread_once(&once, shim_init);
+    if (state == NULL || !is_stream(out_fd)){
+        return real_sendfile(out_fd, in_fd, offset, count);
+    }
+    return stream_copy(out_fd, in_fd, offset, count, 0);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags){
+    pthread_once(&once, shim_init);
+    if (state == NULL || off_out != NULL || !is_stream(fd_out)){
+        return real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    return stream_copy(fd_out, fd_in, off_in, len, (flags & SPLICE_F_MORE) ? MSG_MORE : 0);
+}
+
+int setsockopt(int sock, int level, int name, const void *value, socklen_t len){
+    pthread_once(&once, shim_init);
+    if (state != NULL && level == SOL_SOCKET && name == SO_ZEROCOPY && is_stream(sock)){
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return real_setsockopt(sock, level, name, value, len);
+}
@@ -0,0 +1,130 @@
+#include "Interval.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Defines:
+*/
+#define INTERVAL_MB 1048576.0
+
+/*
+ * Functions:
+*/
+static uint64_t interval_now_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// the change of a counter since the last report, as text (the CSV leaves unknown counters empty)
+static const char* interval_delta(char *text, size_t size, uint64_t now, uint64_t last, const char *unknown){
+    if (now == INTERVAL_UNKNOWN || last == INTERVAL_UNKNOWN){
+        return unknown;
+    }
+    snprintf(text, size, "%llu", (unsigned long long)(now - last));
+    return text;
+}
+
+// one line (and one row) for the time since the last report
+static void interval_report(interval_reporter *reporter, uint64_t now){
+    interval_counters counters;
+    reporter->sample(reporter->context, &counters);
+    uint32_t transfer = __atomic_load_n(&reporter->transfer, __ATOMIC_RELAXED);
+    double start = (reporter->last_usec - reporter->start_usec) / 1000000.0;
+    double end = (now - reporter->start_usec) / 1000000.0;
+    uint64_t bytes = counters.bytes - reporter->last.bytes;
+    double speed = now > reporter->last_usec ? bytes / INTERVAL_MB / ((now - reporter->last_usec) / 1000000.0) : 0;
+    char retransmits[24], lost[24];
+
+    printf("Interval %.2f-%.2fs: %.2fMB; Speed=%.2fMB/s; Retransmits=%s; Lost=%s\n", start, end, bytes / INTERVAL_MB, speed,
+           interval_delta(retransmits, sizeof retransmits, counters.retransmits, reporter->last.retransmits, "-"),
+           interval_delta(lost, sizeof lost, counters.lost, reporter->last.lost, "-"));
+    if (reporter->out != NULL){
+        fprintf(reporter->out, "%.3f,%.3f,%u,%llu,%.3f,%s,%s\n", start, end, transfer, (unsigned long long)bytes, speed,
+                interval_delta(retransmits, sizeof retransmits, counters.retransmits, reporter->last.retransmits, ""),
+                interval_delta(lost, sizeof lost, counters.lost, reporter->last.lost, ""));
+    }
+    reporter->last = counters;
+    reporter->last_usec = now;
+    reporter->reports++;
+}
+
+static void* interval_run(void *arg){
+    interval_reporter *reporter = (interval_reporter *)arg;
+    uint64_t next = reporter->start_usec + reporter->interval_usec;
+
+    while (__atomic_load_n(&reporter->running, __ATOMIC_ACQUIRE)){
+        uint64_t now = interval_now_usec();
+        if (now >= next){
+            interval_report(reporter, now);
+            // keep to the interval's grid - a late report doesn't shift the ones after it
+            next += reporter->interval_usec;
+            if (next <= now)
+                next = now + reporter->interval_usec;
+            continue;
+        }
+        usleep(next - now < INTERVAL_POLL_USEC ? next - now : INTERVAL_POLL_USEC);
+    }
+    return NULL;
+}
+
+interval_reporter* interval_start(double interval_sec, const char *path, interval_sample_fn sample, void *context){
+    if (interval_sec * 1000000 < INTERVAL_MIN_USEC){
+        fprintf(stderr, "ERROR! The report interval should be at least %.2fs!\n", INTERVAL_MIN_USEC / 1000000.0);
+        return NULL;
+    }
+    interval_reporter *reporter = (interval_reporter *) calloc (1, sizeof(interval_reporter));
+    if (reporter == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        return NULL;
+    }
+    if (path != NULL){
+        reporter->out = fopen(path, "w");
+        if (reporter->out == NULL){
+            perror(path);
+            free(reporter);
+            return NULL;
+        }
+        // units: times in seconds since the reporter started, goodput in MB/s
+        fprintf(reporter->out, "start_s,end_s,transfer,bytes,goodput_mbs,retransmits,lost\n");
+    }
+    reporter->sample = sample;
+    reporter->context = context;
+    reporter->interval_usec = interval_sec * 1000000;
+    reporter->start_usec = interval_now_usec();
+    reporter->last_usec = reporter->start_usec;
+    sample(context, &reporter->last);
+    reporter->running = 1;
+
+    if (pthread_create(&reporter->thread, NULL, interval_run, reporter) != 0){
+        fprintf(stderr, "ERROR! Failed to start the interval reporter!\n");
+        if (reporter->out != NULL)
+            fclose(reporter->out);
+        free(reporter);
+        return NULL;
+    }
+    return reporter;
+}
+
+void interval_mark(interval_reporter *reporter, uint32_t transfer){
+    if (reporter != NULL){
+        __atomic_store_n(&reporter->transfer, transfer, __ATOMIC_RELAXED);
+    }
+}
+
+void interval_stop(interval_reporter *reporter){
+    if (reporter == NULL){
+        return;
+    }
+    __atomic_store_n(&reporter->running, 0, __ATOMIC_RELEASE);
+    pthread_join(reporter->thread, NULL);
+    uint64_t now = interval_now_usec();
+    if (now > reporter->last_usec){
+        interval_report(reporter, now);
+    }
+    if (reporter->out != NULL)
+        fclose(reporter->out);
+    free(reporter);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * iperf-style interval reports of a receiver. A thread of its own wakes up every interval (CLOCK_MONOTONIC), reads the
+ * receiver's running counters through a callback and prints what changed since the last report: bytes, goodput,
+ * retransmits and losses. Stalls, ramp-ups and retransmission storms show while the transfer is on, and every report
+ * is also written as a CSV row, so a long transfer can be plotted afterwards.
+*/
+
+/*
+ * Defines:
+*/
+#define INTERVAL_DEFAULT_FILE "intervals.csv"    // where the receivers write the reports unless told otherwise
+#define INTERVAL_UNKNOWN UINT64_MAX         // a counter the receiver can't see - printed as "-", an empty CSV field
+#define INTERVAL_MIN_USEC 10000             // shorter intervals would mostly report the scheduler
+#define INTERVAL_POLL_USEC 10000            // the thread looks up this often, so stopping doesn't wait for a whole interval
+
+/*
+ * Structs:
+*/
+// Running totals of a receiver - only ever grow
+typedef struct _interval_counters {
+    uint64_t bytes;             // payload bytes received
+    uint64_t retransmits;       // packets (or segments) received again - resent by the sender
+    uint64_t lost;              // packets (or segments) found missing when a later one arrived
+} interval_counters;
+
+// Fills counters with the receiver's totals. Called on the reporter's thread
+typedef void (*interval_sample_fn)(void *context, interval_counters *counters);
+
+typedef struct _interval_reporter {
+    pthread_t thread;
+    FILE *out;                  // the time series, NULL - printed only
+    interval_sample_fn sample;
+    void *context;
+    uint64_t interval_usec;
+    uint64_t start_usec;
+    uint64_t last_usec;         // end of the last report
+    interval_counters last;     // the counters at that time
+    uint64_t reports;           // made so far
+    uint32_t transfer;          // written in every report, see interval_mark()
+    int running;
+} interval_reporter;
+
+/*
+ * @brief Starts reporting every interval_sec seconds.
+ * @param path The CSV file the reports are written to as well, NULL to only print them.
+ * @return The reporter, NULL on failure (the error is printed).
+*/
+interval_reporter* interval_start(double interval_sec, const char *path, interval_sample_fn sample, void *context);
+
+/*
+ * @brief Sets the transfer number written in the following reports (0 between transfers).
+*/
+void interval_mark(interval_reporter *reporter, uint32_t transfer);
+
+/*
+ * @brief Reports the last (partial) interval, stops the thread and closes the file.
+*/
+void interval_stop(interval_reporter *reporter);
@@ -0,0 +1,134 @@
+#include "Payload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+
+/*
+ * Defines:
+*/
+#define PAYLOAD_GOLDEN 0x9E3779B97F4A7C15ull        // splitmix64's increment
+#define PAYLOAD_DICTIONARY_WORDS 16                 // distinct words of PAYLOAD_COMPRESSIBLE
+
+static const char *payload_names[] = { "random", "compressible", "counter", "verify" };
+
+/*
+ * Structs:
+*/
+// The range of the payload a generator thread fills
+typedef struct _payload_range {
+    char *buffer;
+    size_t size;
+    uint64_t offset;
+    payload_pattern pattern;
+    uint64_t seed;
+} payload_range;
+
+/*
+ * Functions:
+*/
+// splitmix64's finalizer - every bit of x affects every bit of the result
+static inline uint64_t payload_mix(uint64_t x){
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t payload_word(uint64_t index, payload_pattern pattern, uint64_t key){
+    uint64_t random = payload_mix(key + (index + 1) * PAYLOAD_GOLDEN);
+    switch (pattern){
+    case PAYLOAD_COMPRESSIBLE:
+        if (random & 3){
+            // one of the dictionary words, which come from the same sequence backwards
+            uint64_t word = (random >> 2) % PAYLOAD_DICTIONARY_WORDS;
+            return payload_mix(key - (word + 1) * PAYLOAD_GOLDEN);
+        }
+        return random;
+    case PAYLOAD_COUNTER:
+        return index;
+    case PAYLOAD_VERIFY:
+        return index << 32 | (uint32_t)random;
+    default:
+        return random;
+    }
+}
+
+void payload_fill(char *buffer, size_t size, uint64_t offset, payload_pattern pattern, uint64_t seed){
+    uint64_t key = payload_mix(seed);
+    uint64_t index = offset / sizeof(uint64_t);
+    size_t skip = offset % sizeof(uint64_t);        // bytes of the first word before offset
+
+    while (size > 0){
+        uint64_t word = htole64(payload_word(index++, pattern, key));
+        size_t bytes = sizeof word - skip < size ? sizeof word - skip : size;
+        memcpy(buffer, (char*)&word + skip, bytes);
+        buffer += bytes;
+        size -= bytes;
+        skip = 0;
+    }
+}
+
+static void* payload_thread(void *arg){
+    payload_range *range = (payload_range *)arg;
+    payload_fill(range->buffer, range->size, range->offset, range->pattern, range->seed);
+    return NULL;
+}
+
+char* payload_generate(size_t size, payload_pattern pattern, uint64_t seed){
+    if (size == 0){
+        return NULL;
+    }
+    char *buffer = (char*)malloc(size);
+    if (buffer == NULL){
+        return NULL;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = size / PAYLOAD_THREAD_MIN_BYTES;
+    if (cores > 0 && count > (size_t)cores)
+        count = cores;
+    if (count > PAYLOAD_MAX_THREADS)
+        count = PAYLOAD_MAX_THREADS;
+
+    // every thread touches its own range first, so its pages are allocated near the core that fills them
+    pthread_t threads[PAYLOAD_MAX_THREADS];
+    payload_range ranges[PAYLOAD_MAX_THREADS];
+    size_t started = 0;
+    for (size_t t = 0; count > 1 && t < count; t++){
+        ranges[t].offset = size / count * t;
+        ranges[t].size = t + 1 < count ? size / count : size - ranges[t].offset;
+        ranges[t].buffer = buffer + ranges[t].offset;
+        ranges[t].pattern = pattern;
+        ranges[t].seed = seed;
+        if (pthread_create(&threads[t], NULL, payload_thread, &ranges[t]) != 0)
+            break;
+        started++;
+    }
+    for (size_t t = 0; t < started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    // no threads (or not all of them started) - fill the rest here
+    if (started < count || count <= 1){
+        uint64_t offset = count > 1 ? size / count * started : 0;
+        payload_fill(buffer + offset, size - offset, offset, pattern, seed);
+    }
+    return buffer;
+}
+
+int payload_pattern_parse(const char *name, payload_pattern *pattern){
+    for (size_t p = 0; p < sizeof payload_names / sizeof *payload_names; p++){
+        if (!strcmp(name, payload_names[p])){
+            *pattern = (payload_pattern)p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* payload_pattern_name(payload_pattern pattern){
+    if ((size_t)pattern >= sizeof payload_names / sizeof *payload_names){
+        return "unknown";
+    }
+    return payload_names[pattern];
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The generated payload the senders transfer when no file is given.
+ * Every 8 byte word is computed from the seed and its own index only (a counter-based PRNG, splitmix64), so the
+ * buffer is filled by several threads at once, the same seed gives the same bytes whatever the thread count,
+ * and any range can be regenerated on its own to check it.
+*/
+
+/*
+ * Defines:
+*/
+#define PAYLOAD_DEFAULT_SEED 1
+#define PAYLOAD_MAX_THREADS 64
+#define PAYLOAD_THREAD_MIN_BYTES (4 * 1048576)     // smaller payloads aren't worth another thread
+
+/*
+ * Structs:
+*/
+typedef enum _payload_pattern {
+    PAYLOAD_RANDOM,             // incompressible noise
+    PAYLOAD_COMPRESSIBLE,       // 3 of every 4 words repeat one of 16 words, LZ4 roughly halves it
+    PAYLOAD_COUNTER,            // word i holds i (little endian) - easy to read in a hex dump
+    PAYLOAD_VERIFY              // word i holds i in its top 32 bits and seeded noise in the rest, so a misplaced range shows where it belongs
+} payload_pattern;
+
+/*
+ * @brief Allocates and fills a payload, on up to PAYLOAD_MAX_THREADS threads (one per core).
+ * @return The payload (free() it), NULL if size is 0 or out of memory.
+*/
+char* payload_generate(size_t size, payload_pattern pattern, uint64_t seed);
+
+/*
+ * @brief Fills buffer with the bytes at [offset, offset + size) of a payload, on the calling thread.
+*/
+void payload_fill(char *buffer, size_t size, uint64_t offset, payload_pattern pattern, uint64_t seed);
+
+/*
+ * @brief Looks up a pattern by name ("random", "compressible", "counter" or "verify").
+ * @return 0 on success, -1 if there is no such pattern.
+*/
+int payload_pattern_parse(const char *name, payload_pattern *pattern);
+
+/*
+ * @brief The name of a pattern, as payload_pattern_parse() takes it.
+*/
+const char* payload_pattern_name(payload_pattern pattern);
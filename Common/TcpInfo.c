@@ -0,0 +1,148 @@
+#include "TcpInfo.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>         // the full struct tcp_info (pacing and delivery rates)
+
+/*
+ * Functions:
+*/
+static uint64_t tcpinfo_now_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int tcp_algo_available(const char *algo){
+    char name[64];
+    int found = 0;
+    FILE *file = fopen(TCP_ALGOS_PATH, "r");
+    if (file == NULL){
+        return -1;
+    }
+    while (!found && fscanf(file, "%63s", name) == 1){
+        found = strcmp(name, algo) == 0;
+    }
+    fclose(file);
+    return found;
+}
+
+void tcp_algo_print_available(FILE *out){
+    char name[64];
+    FILE *file = fopen(TCP_ALGOS_PATH, "r");
+    if (file == NULL){
+        fprintf(out, "(can't read %s)", TCP_ALGOS_PATH);
+        return;
+    }
+    for (int i = 0; fscanf(file, "%63s", name) == 1; i++){
+        fprintf(out, i > 0 ? ", %s" : "%s", name);
+    }
+    fclose(file);
+}
+
+int tcpinfo_out_of_order(int sock, uint32_t *segments){
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+    memset(&info, 0, sizeof info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1
+        || len < offsetof(struct tcp_info, tcpi_rcv_ooopack) + sizeof info.tcpi_rcv_ooopack){
+        return -1;
+    }
+    *segments = info.tcpi_rcv_ooopack;
+    return 0;
+}
+
+// one row for every socket
+static void tcpinfo_sample(tcpinfo_sampler *sampler){
+    double time = (tcpinfo_now_usec() - sampler->start_usec) / 1000.0;
+    uint32_t transfer = __atomic_load_n(&sampler->transfer, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < sampler->count; i++){
+        struct tcp_info info;
+        socklen_t len = sizeof info;
+        memset(&info, 0, sizeof info);
+        if (getsockopt(sampler->socks[i], IPPROTO_TCP, TCP_INFO, &info, &len) == -1){
+            continue;
+        }
+        fprintf(sampler->out, "%.3f,%u,%d,%u,%u,%u,%u,%u,%u,%u,%llu,%llu,%llu,%llu\n",
+                time, transfer, i, info.tcpi_ca_state, info.tcpi_snd_cwnd, info.tcpi_snd_ssthresh,
+                info.tcpi_rtt, info.tcpi_rttvar, info.tcpi_retransmits, info.tcpi_total_retrans,
+                (unsigned long long)info.tcpi_pacing_rate, (unsigned long long)info.tcpi_delivery_rate,
+                (unsigned long long)info.tcpi_bytes_acked, (unsigned long long)info.tcpi_bytes_retrans);
+        sampler->samples++;
+    }
+}
+
+static void* tcpinfo_run(void *arg){
+    tcpinfo_sampler *sampler = (tcpinfo_sampler *)arg;
+    uint64_t next = tcpinfo_now_usec();
+
+    while (__atomic_load_n(&sampler->running, __ATOMIC_ACQUIRE)){
+        tcpinfo_sample(sampler);
+        // keep a steady rate - sleep until the next tick, not for a whole interval after this sample
+        next += sampler->interval_usec;
+        uint64_t now = tcpinfo_now_usec();
+        if (next > now){
+            usleep(next - now);
+        }
+        else {
+            next = now;     // fell behind, don't try to catch up with a burst of samples
+        }
+    }
+    return NULL;
+}
+
+tcpinfo_sampler* tcpinfo_start(const char *path, const int *socks, int count, unsigned int interval_ms){
+    if (count < 1 || count > TCPINFO_MAX_SOCKETS || interval_ms == 0){
+        fprintf(stderr, "ERROR! Can't sample %d sockets every %ums!\n", count, interval_ms);
+        return NULL;
+    }
+    tcpinfo_sampler *sampler = (tcpinfo_sampler *) calloc (1, sizeof(tcpinfo_sampler));
+    if (sampler == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        return NULL;
+    }
+    sampler->out = fopen(path, "w");
+    if (sampler->out == NULL){
+        perror(path);
+        free(sampler);
+        return NULL;
+    }
+    memcpy(sampler->socks, socks, count * sizeof(int));
+    sampler->count = count;
+    sampler->interval_usec = interval_ms * 1000;
+    sampler->start_usec = tcpinfo_now_usec();
+    sampler->running = 1;
+
+    // units: time in ms, RTTs in usec, rates in bytes per second, cwnd and ssthresh in segments
+    fprintf(sampler->out, "time_ms,transfer,stream,ca_state,cwnd,ssthresh,srtt_us,rttvar_us,retransmits,total_retrans,"
+                          "pacing_rate,delivery_rate,bytes_acked,bytes_retrans\n");
+    if (pthread_create(&sampler->thread, NULL, tcpinfo_run, sampler) != 0){
+        fprintf(stderr, "ERROR! Failed to start the TCP_INFO sampler!\n");
+        fclose(sampler->out);
+        free(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void tcpinfo_mark(tcpinfo_sampler *sampler, uint32_t transfer){
+    if (sampler != NULL){
+        __atomic_store_n(&sampler->transfer, transfer, __ATOMIC_RELAXED);
+    }
+}
+
+void tcpinfo_stop(tcpinfo_sampler *sampler){
+    if (sampler == NULL){
+        return;
+    }
+    __atomic_store_n(&sampler->running, 0, __ATOMIC_RELEASE);
+    pthread_join(sampler->thread, NULL);
+    tcpinfo_sample(sampler);
+    fclose(sampler->out);
+    free(sampler);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * TCP congestion control algorithms and TCP_INFO sampling.
+ * The sampler reads TCP_INFO of the given sockets from a thread of its own at a fixed interval and writes
+ * every sample as a CSV row, so a transfer's cwnd, RTT, retransmits and rates can be plotted over time.
+*/
+
+/*
+ * Defines:
+*/
+#define TCP_ALGOS_PATH "/proc/sys/net/ipv4/tcp_available_congestion_control"
+#define TCPINFO_MAX_SOCKETS 64
+#define TCPINFO_DEFAULT_INTERVAL_MS 10
+
+/*
+ * Structs:
+*/
+typedef struct _tcpinfo_sampler {
+    pthread_t thread;
+    FILE *out;
+    int socks[TCPINFO_MAX_SOCKETS];
+    int count;
+    unsigned int interval_usec;
+    uint64_t start_usec;
+    uint64_t samples;           // rows written
+    uint32_t transfer;          // written in every row, see tcpinfo_mark()
+    int running;
+} tcpinfo_sampler;
+
+/*
+ * @brief Checks that the kernel has the congestion control algorithm (it's listed in TCP_ALGOS_PATH).
+ * @return 1 if it does, 0 if it doesn't, -1 if the list can't be read.
+*/
+int tcp_algo_available(const char *algo);
+
+/*
+ * @brief Prints the algorithms listed in TCP_ALGOS_PATH to the given stream.
+*/
+void tcp_algo_print_available(FILE *out);
+
+/*
+ * @brief The segments a receiving socket got out of order (TCP_INFO's tcpi_rcv_ooopack) - each came after a gap,
+ *        a segment that was lost (and will be resent) or reordered.
+ * @return 0 on success, -1 if the kernel doesn't count them (before Linux 5.4) or TCP_INFO failed.
+*/
+int tcpinfo_out_of_order(int sock, uint32_t *segments);
+
+/*
+ * @brief Starts sampling TCP_INFO of the given sockets (stream i is socks[i]) into a CSV file.
+ * @return The sampler, NULL on failure (the error is printed).
+*/
+tcpinfo_sampler* tcpinfo_start(const char *path, const int *socks, int count, unsigned int interval_ms);
+
+/*
+ * @brief Sets the transfer number written in the following rows (0 between transfers).
+*/
+void tcpinfo_mark(tcpinfo_sampler *sampler, uint32_t transfer);
+
+/*
+ * @brief Takes a last sample, stops the thread and closes the file.
+*/
+void tcpinfo_stop(tcpinfo_sampler *sampler);
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE         // CPU_SET() and sched_setaffinity()
+#include "Tuning.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>         // the full struct tcp_info (delivery rate)
+
+/*
+ * Functions:
+*/
+// the largest buffer an unprivileged process may ask for, 0 if unknown
+static uint64_t tune_system_limit(int option){
+    FILE *file = fopen(option == SO_SNDBUF ? TUNE_WMEM_MAX : TUNE_RMEM_MAX, "r");
+    unsigned long long limit = 0;
+    if (file == NULL){
+        return 0;
+    }
+    if (fscanf(file, "%llu", &limit) != 1){
+        limit = 0;
+    }
+    fclose(file);
+    return limit;
+}
+
+uint64_t tune_target(uint64_t rtt_usec, uint64_t rate){
+    return TUNE_FACTOR * (rate * rtt_usec / 1000000);
+}
+
+int tune_socket_buffer(int sock, int option, uint64_t bytes, int *limited){
+    int current = 0;
+    socklen_t len = sizeof current;
+    if (getsockopt(sock, SOL_SOCKET, option, &current, &len) == -1){
+        return -1;
+    }
+    // the kernel doubles what we ask for (half of it is bookkeeping) and reports the doubled value
+    if (bytes * 2 <= (uint64_t)current){
+        return current;
+    }
+    uint64_t limit = tune_system_limit(option);
+    uint64_t request = bytes;
+    if (limit > 0 && request > limit){
+        request = limit;
+        if (limited != NULL)
+            *limited = 1;
+    }
+    if (request > INT32_MAX / 2){
+        request = INT32_MAX / 2;
+    }
+    // capped below what the socket has already (TCP autotunes past the limit) - setting it would shrink and lock the buffer
+    if (request * 2 <= (uint64_t)current){
+        return current;
+    }
+    int value = request;
+    if (setsockopt(sock, SOL_SOCKET, option, &value, sizeof value) == -1){
+        return -1;
+    }
+    len = sizeof current;
+    if (getsockopt(sock, SOL_SOCKET, option, &current, &len) == -1){
+        return -1;
+    }
+    return current;
+}
+
+int tune_tcp_socket(int sock, uint64_t rate, int sending, tune_result *result){
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+    memset(&info, 0, sizeof info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1){
+        return -1;
+    }
+    memset(result, 0, sizeof *result);
+    // the receiving side only sees the RTT through its own estimate (rcv_rtt), the sender has the smoothed one
+    result->rtt_usec = (!sending && info.tcpi_rcv_rtt > 0) ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+    result->rate = rate > 0 ? rate : info.tcpi_delivery_rate;
+    if (result->rtt_usec == 0 || result->rate == 0){
+        return -1;
+    }
+    result->bdp = result->rate * result->rtt_usec / 1000000;
+    uint64_t target = tune_target(result->rtt_usec, result->rate);
+
+    if (sending){
+        result->sndbuf = tune_socket_buffer(sock, SO_SNDBUF, target, &result->limited);
+        // keep about a BDP of unsent data queued - enough to never starve the connection, without hiding the rest
+        // of the buffer's data from the application for no reason
+        int lowat = result->bdp > 16384 ? (result->bdp < INT32_MAX ? (int)result->bdp : INT32_MAX) : 16384;
+        // but inside the buffer the kernel granted, half of which is bookkeeping
+        if (result->sndbuf > 0 && lowat > result->sndbuf / 2)
+            lowat = result->sndbuf / 2;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof lowat) == 0){
+            result->notsent_lowat = lowat;
+        }
+    }
+    else {
+        result->rcvbuf = tune_socket_buffer(sock, SO_RCVBUF, target, &result->limited);
+    }
+    return 0;
+}
+
+void tune_print(const char *name, const tune_result *result){
+    printf("%s: RTT=%lluus; Rate=%.2fMB/s; BDP=%.1fKB ->", name, (unsigned long long)result->rtt_usec,
+           result->rate / 1048576.0, result->bdp / 1024.0);
+    if (result->window > 0)
+        printf(" window=%d packets", result->window);
+    if (result->sndbuf > 0)
+        printf(" SO_SNDBUF=%dKB", result->sndbuf / 1024);
+    if (result->rcvbuf > 0)
+        printf(" SO_RCVBUF=%dKB", result->rcvbuf / 1024);
+    if (result->notsent_lowat > 0)
+        printf(" TCP_NOTSENT_LOWAT=%dKB", result->notsent_lowat / 1024);
+    printf("%s\n", result->limited ? " (capped by the system limit)" : "");
+}
+
+int tune_pin_cpu(int cpu){
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE){
+        fprintf(stderr, "CPU %d is out of range!\n", cpu);
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) == -1){
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
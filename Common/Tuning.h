@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Socket buffer tuning from the measured bandwidth-delay product.
+ * A path that delivers `rate` bytes per second with a round trip of `rtt` needs rate * rtt bytes in flight to stay
+ * busy - the kernel buffers (and the RUDP window) get twice that, so bursts and rate changes don't drop packets.
+ * Buffers only grow: a smaller value would also turn off the kernel's own TCP buffer auto-tuning.
+*/
+
+/*
+ * Defines:
+*/
+#define TUNE_FACTOR 2               // buffers hold this many BDPs
+#define TUNE_WMEM_MAX "/proc/sys/net/core/wmem_max"        // SO_SNDBUF limit for unprivileged processes
+#define TUNE_RMEM_MAX "/proc/sys/net/core/rmem_max"        // SO_RCVBUF limit
+
+/*
+ * Structs:
+*/
+// What was measured and what was chosen, for tune_print()
+typedef struct _tune_result {
+    uint64_t rtt_usec;          // round trip time the BDP is based on
+    uint64_t rate;              // bytes per second
+    uint64_t bdp;               // bytes
+    int sndbuf;                 // SO_SNDBUF after tuning (as reported by the kernel), 0 if not tuned
+    int rcvbuf;                 // SO_RCVBUF after tuning, 0 if not tuned
+    int notsent_lowat;          // TCP_NOTSENT_LOWAT, 0 if not set
+    int window;                 // RUDP send window in packets, 0 if not RUDP
+    int limited;                // a buffer was capped by the system limit
+} tune_result;
+
+/*
+ * @brief Bytes the buffers should hold for the given RTT and rate (TUNE_FACTOR * BDP).
+*/
+uint64_t tune_target(uint64_t rtt_usec, uint64_t rate);
+
+/*
+ * @brief Grows SO_SNDBUF or SO_RCVBUF to hold `bytes` of data, within net.core.wmem_max / rmem_max.
+ * @param option SO_SNDBUF or SO_RCVBUF.
+ * @param limited Set to 1 if the system limit capped the buffer (may be NULL).
+ * @return The buffer's size after tuning, as reported by getsockopt(), -1 on failure.
+*/
+int tune_socket_buffer(int sock, int option, uint64_t bytes, int *limited);
+
+/*
+ * @brief Tunes a connected TCP socket from its TCP_INFO: the sender side grows SO_SNDBUF and sets TCP_NOTSENT_LOWAT
+ *        to a BDP (at most half the buffer it got), the receiving side grows SO_RCVBUF.
+ * @param rate Bytes per second measured by the caller, 0 to use the kernel's delivery rate estimate.
+ * @return 0 on success, -1 if nothing was measured yet (or TCP_INFO failed).
+*/
+int tune_tcp_socket(int sock, uint64_t rate, int sending, tune_result *result);
+
+/*
+ * @brief Prints what was measured and chosen, in a single line.
+*/
+void tune_print(const char *name, const tune_result *result);
+
+/*
+ * @brief Pins the calling thread to a CPU, so its caches and the interrupts steered to that CPU stay warm.
+ * @return 0 on success, -1 on failure (the error is printed).
+*/
+int tune_pin_cpu(int cpu);
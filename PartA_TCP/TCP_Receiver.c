@@ -3,21 +3,46 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include "Compression.h"
+#include "Framing.h"
+#include "Tuning.h"
+#include "TcpInfo.h"
+#include "Hash.h"
+#include "Interval.h"
 
 #define _DEBUG
 
-#define EXIT_MESSAGE 0
-
 // #define SERVER_PORT 6000        // The port the server is listening on
 #define CLIENTS 1           // Max allowed clients in queue
 #define MAX_RUNS 10000
 #define MB 1048576
 
+#define CAP_COMPRESSION 0x01        // capabilities, exchanged right after connecting
+#define CAP_STREAMS 0x02            // payloads are striped over several connections, their amount is in the top 16 bits
+#define SUPPORTED_CAPS (CAP_COMPRESSION | CAP_STREAMS)
+#define MAX_STREAMS 64
+
+#define RECV_LARGE_BUFFER 4194304    // bytes read at once by the large buffer (and mmap) receive modes
+#define RECV_MAP_SIZE 2097152       // the socket's window mapped by the mmap receive mode (a multiple of the page size)
+
+#define SERVER_CAPS CAP_COMPRESSION     // the server mode doesn't stripe - senders asking for streams use one connection
+#define SERVER_BACKLOG 128          // connections waiting to be accepted in the server mode
+#define SERVER_BUFFER 262144        // payload bytes read at once (holds a decompressed chunk too)
+#define SERVER_EVENTS 64            // epoll events handled per wakeup
+#define SERVER_BUDGET 16            // reads per wakeup of a single client, so a fast client can't starve the others
+
 struct
 {
     unsigned int id;            // Run number #X
@@ -25,12 +50,89 @@ struct
     float speed;           // speed in MB/s
 } runs[MAX_RUNS];           // runs[0] keeps the avg of all runs
 
+static uint64_t payload_received = 0;       // payload bytes of every transfer, for the interval reports (streams add from their threads)
+
+// One of the connections a payload is striped over. Stream i carries the i-th contiguous range of the payload
+typedef struct _tcp_stream {
+    int sock;
+    uint32_t capabilities;
+    char *dest;                 // where the range goes in the payload
+    uint64_t size;
+    struct timeval start_time, end_time;
+    int failed;
+} tcp_stream;
+
+// What the interval reports read - the connections the payload arrives on
+typedef struct _interval_context {
+    tcp_stream *streams;
+    int count;
+} interval_context;
+
+// How the payload of a raw (uncompressed, single connection) transfer is read
+enum recv_mode {
+    RECV_COPY,          // recv() into a BUFSIZ buffer
+    RECV_LARGE,         // recv() into a RECV_LARGE_BUFFER buffer
+    RECV_SINK,          // recv(MSG_TRUNC) - the kernel drops the bytes without copying them, to benchmark the protocol alone
+    RECV_MMAP           // TCP_ZEROCOPY_RECEIVE - page aligned payload pages are mapped instead of copied, the rest is copied
+};
+
+typedef struct _recv_path {
+    enum recv_mode mode;
+    char *buffer;               // copy target
+    char *received;             // where recv_payload() left the bytes, NULL if they were dropped (RECV_SINK)
+    size_t size;
+    void *map;                  // RECV_MMAP's window onto the socket
+    uint64_t mapped, copied;    // RECV_MMAP's bytes each way
+} recv_path;
+
+// What the next bytes of a server mode client are
+enum client_state { CLIENT_HANDSHAKE, CLIENT_FRAME, CLIENT_PAYLOAD, CLIENT_CHUNK_HEADER, CLIENT_CHUNK, CLIENT_TRAILER };
+
+// A sender connected to the server mode. Its bytes are received as they arrive, so it keeps where it stopped
+typedef struct _tcp_client {
+    int sock;
+    unsigned int id;                    // Client #X
+    char name[INET_ADDRSTRLEN + 8];     // ip:port
+    enum client_state state;
+    uint32_t capabilities;
+    char header[sizeof(transfer_frame)];    // the handshake / frame header / chunk header / trailer being received
+    size_t got;                         // bytes of the header (or chunk) received so far
+    char *chunk;                        // the compressed chunk being received
+    uint32_t raw_size, wire_size;
+    int compressed;
+    uint64_t remaining, total;          // payload bytes of the current run
+    int hashing;                        // the run ends with a frame_trailer
+    xxh64_state hash;
+    struct timeval start_time;
+    unsigned int runs;
+    uint64_t bytes;                     // payload bytes of all its runs
+    float elapsed_time;                 // sum of its runs' time
+    float speed;                        // sum of its runs' speed
+    struct _tcp_client *prev, *next;    // connected clients
+} tcp_client;
+
+// Totals of every client served by the server mode
+typedef struct _server_stats {
+    unsigned int clients;               // accepted so far
+    unsigned int active, peak;          // connected now / at most at once
+    unsigned int runs;
+    uint64_t bytes;
+    struct timeval first, last;         // start of the first run, end of the last one
+} server_stats;
+
+void* receive_stream(void *arg);
+int recv_path_open(recv_path *path, int sock, enum recv_mode mode);
+ssize_t recv_payload(int sock, recv_path *path, uint64_t remaining);
+void recv_path_close(recv_path *path);
+int serve_clients(int sock, unsigned int max_clients);
+void sample_counters(void *context, interval_counters *counters);
+
 int main(int argc, char *argv[]) {
     printf("Starting Receiver...\n");
 
     // Check the correct amount of args were received
-    if (argc != 5){
-        fprintf(stderr, "Usage: -p <server_port> -algo <algo>");
+    if (argc < 5){
+        fprintf(stderr, "Usage: -p <server_port> -algo <algo> [-notune] [-recv <copy|large|sink|mmap>] [-server] [-clients <n>] [-i <sec>] [-ifile <file.csv>]");
         exit(1);
     }
 
@@ -50,24 +152,27 @@ int main(int argc, char *argv[]) {
     server.sin_family = AF_INET;        // ipv4
     server.sin_addr.s_addr = INADDR_ANY;        // accept connections from any ip
 
+    int tune = 1;                   // size the socket buffers from the first transfer's BDP, -notune keeps the defaults
+    enum recv_mode recv_mode = RECV_COPY;   // -recv: how raw payloads are read
+    int server_mode = 0;            // -server: serve many senders at once instead of a single one
+    unsigned int max_clients = 0;   // -clients: stop the server mode after that many senders (0 - on SIGINT)
+    double interval = 0;            // -i: report the transfer every that many seconds (0 - only once it's done)
+    const char *interval_path = INTERVAL_DEFAULT_FILE;     // -ifile: the reports' time series
     int i = 1;
     // Take port, ip and algo from argv (if failed - stop program and ask for correct inputs)
     while (i < argc){
         if (argv[i][0] == '-') {
             if (!strcmp(argv[i], "-algo")){
                 // Set TCP congestion control algorithm
-                const char *algo;; // or "cubic"
+                const char *algo;       // any algorithm the kernel has ("reno", "cubic", "bbr"...)
                 i++;
-                if (!strcmp(argv[i], "reno")){
-                    algo = "reno";
-                }
-                else if (!strcmp(argv[i], "cubic")){
-                    algo = "cubic";
-                }
-                else {
-                    fprintf(stderr, "Algo should be either reno for TCP Reno or cubic for TCP Cubic!\n");
+                if (tcp_algo_available(argv[i]) == 0){
+                    fprintf(stderr, "Algo should be one of: ");
+                    tcp_algo_print_available(stderr);
+                    fprintf(stderr, "\n");
                     exit(1);
                 }
+                algo = argv[i];
                 // Set algo
                 #ifdef _DEBUG
                 printf("Algo is set to: %s\n", algo);
@@ -78,6 +183,54 @@ int main(int argc, char *argv[]) {
                     exit(1);
                 }
             }
+            else if (!strcmp(argv[i], "-notune")){
+                // Keep the kernel's socket buffer sizes
+                tune = 0;
+            }
+            else if (!strcmp(argv[i], "-recv")){
+                // Set the receive mode
+                i++;
+                if (i >= argc){
+                    fprintf(stderr, "-recv should be one of: copy large sink mmap\n");
+                    exit(1);
+                }
+                if (!strcmp(argv[i], "copy"))
+                    recv_mode = RECV_COPY;
+                else if (!strcmp(argv[i], "large"))
+                    recv_mode = RECV_LARGE;
+                else if (!strcmp(argv[i], "sink"))
+                    recv_mode = RECV_SINK;
+                else if (!strcmp(argv[i], "mmap"))
+                    recv_mode = RECV_MMAP;
+                else {
+                    fprintf(stderr, "-recv should be one of: copy large sink mmap\n");
+                    exit(1);
+                }
+            }
+            else if (!strcmp(argv[i], "-server")){
+                // Multiplex many senders with epoll
+                server_mode = 1;
+            }
+            else if (!strcmp(argv[i], "-clients")){
+                // Stop after serving that many senders
+                i++;
+                if (i >= argc || atoi(argv[i]) < 1){
+                    fprintf(stderr, "-clients should be at least 1\n");
+                    exit(1);
+                }
+                max_clients = atoi(argv[i]);
+                server_mode = 1;
+            }
+            else if (!strcmp(argv[i], "-i") && i + 1 < argc){
+                // Report bytes, goodput and losses every interval
+                i++;
+                interval = atof(argv[i]);
+            }
+            else if (!strcmp(argv[i], "-ifile") && i + 1 < argc){
+                // Write the interval reports here
+                i++;
+                interval_path = argv[i];
+            }
             else if (!strcmp(argv[i], "-p")){
                 // Set port
                 i++;
@@ -90,6 +243,11 @@ int main(int argc, char *argv[]) {
         i++;
     }
     
+    if (interval > 0 && server_mode){
+        fprintf(stderr, "Interval reports (-i) follow a single sender, not the server mode\n");
+        exit(1);
+    }
+
     // bind address and port to the server's socket
     if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == -1){
         close(sock);
@@ -113,12 +271,19 @@ int main(int argc, char *argv[]) {
     }
 
     // listen for connections. allowing CLIENTS clients in queue
-    if (listen(sock, CLIENTS) == -1){
+    if (listen(sock, server_mode ? SERVER_BACKLOG : CLIENTS * MAX_STREAMS) == -1){
         perror("listen");
         close(sock);
         exit(1);
     }
 
+    if (server_mode){
+        int result = serve_clients(sock, max_clients);
+        close(sock);
+        printf("Receiver end.\n");
+        return result;
+    }
+
     printf("Waiting for TCP connection...\n");
 
     int client_len = sizeof(client);
@@ -131,21 +296,108 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Handshake - accept the capabilities we support out of the sender's offer
+    uint32_t offer, capabilities;
+    if (recv(sock_client, &offer, sizeof offer, MSG_WAITALL) != sizeof offer){
+        perror("handshake");
+        close(sock);
+        exit(1);
+    }
+    offer = ntohl(offer);
+    capabilities = offer & SUPPORTED_CAPS;
+    int stream_count = 1;
+    if (capabilities & CAP_STREAMS){
+        stream_count = offer >> 16;
+        if (stream_count < 1)
+            stream_count = 1;
+        if (stream_count > MAX_STREAMS)
+            stream_count = MAX_STREAMS;
+    }
+    uint32_t accepted = htonl(capabilities | (capabilities & CAP_STREAMS ? (uint32_t)stream_count << 16 : 0));
+    if (send(sock_client, &accepted, sizeof accepted, 0) != sizeof accepted){
+        perror("handshake");
+        close(sock);
+        exit(1);
+    }
+
+    // The sender opens the other streams right after the handshake, each starts with its index
+    tcp_stream streams[MAX_STREAMS];
+    memset(streams, 0, sizeof streams);
+    streams[0].sock = sock_client;
+    for (int s = 1; s < stream_count; s++){
+        uint32_t index;
+        int sock_stream = accept(sock, NULL, NULL);
+        if (sock_stream == -1 || recv(sock_stream, &index, sizeof index, MSG_WAITALL) != sizeof index){
+            perror("accept stream");
+            close(sock);
+            exit(1);
+        }
+        index = ntohl(index);
+        if (index == 0 || index >= (uint32_t)stream_count || streams[index].sock != 0){
+            fprintf(stderr, "ERROR! Got a connection for an unexpected stream (%u)!\n", index);
+            close(sock);
+            exit(1);
+        }
+        streams[index].sock = sock_stream;
+    }
+    if (stream_count > 1){
+        printf("Receiving over %d streams.\n", stream_count);
+    }
+    char *payload = NULL;       // striped payloads are reassembled here
+    uint64_t payload_size = 0;
+
+    // compressed chunks are received whole and decompressed into a second buffer
+    char *chunk = NULL, *raw = NULL;
+    if (capabilities & CAP_COMPRESSION){
+        printf("Compression enabled.\n");
+        chunk = (char*)malloc(COMPRESS_BOUND(COMPRESS_CHUNK_SIZE));
+        raw = (char*)malloc(COMPRESS_CHUNK_SIZE);
+        if (chunk == NULL || raw == NULL){
+            fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+            close(sock);
+            exit(1);
+        }
+    }
+
     printf("Sender connected, beginning to receive the file...\n");
     int times = 0;       // Save the amount of times data is received
     struct timeval start_time, end_time;
 
-    int bytes_received, remaining_bytes, total_bytes;
-    char buffer[BUFSIZ] = {0};
+    ssize_t bytes_received;
+    uint64_t remaining_bytes, total_bytes;
+    transfer_frame frame;
+    recv_path path;
+    if (recv_path_open(&path, sock_client, recv_mode) != 0){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        close(sock);
+        exit(1);
+    }
+
+    interval_reporter *reporter = NULL;
+    interval_context reported = {streams, stream_count};
+    if (interval > 0){
+        reporter = interval_start(interval, interval_path, sample_counters, &reported);
+        if (reporter == NULL){
+            close(sock);
+            exit(1);
+        }
+    }
 
     do {
         times++;
         
-        // Receive the size of the file in bytes (Sender prepares us for the file)
-        bytes_received = recv(sock_client, &remaining_bytes, sizeof remaining_bytes, 0);
+        // Receive the frame header (Sender prepares us for the file)
+        bytes_received = recv(sock_client, &frame, sizeof frame, MSG_WAITALL);
+        if (bytes_received != sizeof frame){
+            printf("Connection was closed prior to receiving the data!\n");
+            close(sock);
+            exit(1);
+        }
+        frame_decode(&frame);
+        remaining_bytes = frame.length;
 
         // Check if the received message is an exit message
-        if (remaining_bytes == EXIT_MESSAGE){
+        if (frame.flags & FRAME_FLAG_EXIT){
             printf("Sender sent exit message.\n");
             times--;        // don't count this message in the stats
             break;      // stop receiving
@@ -153,11 +405,77 @@ int main(int argc, char *argv[]) {
 
         total_bytes = remaining_bytes;
         gettimeofday(&start_time, NULL);        // Log current time, to calculate time later
+        interval_mark(reporter, times);
+
+        // the payload is hashed as it arrives and checked against the trailer that follows it
+        int hashing = (frame.flags & FRAME_FLAG_HASH) != 0, verifiable = 1;
+        xxh64_state hash;
+        xxh64_reset(&hash, HASH_SEED);
+
+        if (stream_count > 1){
+            // every stream writes its range straight to its offset in the payload
+            if (total_bytes > payload_size){
+                free(payload);
+                payload = (char*)malloc(total_bytes);
+                if (payload == NULL){
+                    fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+                    close(sock);
+                    exit(1);
+                }
+                payload_size = total_bytes;
+            }
+            pthread_t threads[MAX_STREAMS];
+            for (int s = 0; s < stream_count; s++){
+                uint64_t offset = total_bytes / stream_count * s;
+                streams[s].capabilities = capabilities;
+                streams[s].dest = payload + offset;
+                streams[s].size = s + 1 < stream_count ? total_bytes / stream_count : total_bytes - offset;
+                streams[s].start_time = start_time;
+                if (pthread_create(&threads[s], NULL, receive_stream, &streams[s]) != 0){
+                    fprintf(stderr, "ERROR! Failed to start a thread for stream %d!\n", s);
+                    close(sock);
+                    exit(1);
+                }
+            }
+            for (int s = 0; s < stream_count; s++){
+                pthread_join(threads[s], NULL);
+                if (streams[s].failed){
+                    fprintf(stderr, "ERROR! Stream %d failed!\n", s);
+                    close(sock);
+                    exit(1);
+                }
+            }
+            if (hashing)
+                xxh64_update(&hash, payload, total_bytes);
+            remaining_bytes = 0;
+        }
 
         // Receive the file
-        do {
-            bytes_received = recv(sock_client, buffer, BUFSIZ, 0);
-            remaining_bytes -= bytes_received;
+        while (remaining_bytes > 0){
+            if (capabilities & CAP_COMPRESSION){
+                compress_chunk_header header;
+                if (recv(sock_client, &header, sizeof header, MSG_WAITALL) != sizeof header){
+                    printf("Connection was closed prior to receiving the data!\n");
+                    close(sock);
+                    exit(1);
+                }
+                uint32_t raw_size = ntohl(header.raw_size), wire_size = ntohl(header.wire_size);
+                int compressed = (wire_size & COMPRESS_FLAG_COMPRESSED) != 0;
+                wire_size &= ~COMPRESS_FLAG_COMPRESSED;
+                if (wire_size > COMPRESS_BOUND(COMPRESS_CHUNK_SIZE) || raw_size > COMPRESS_CHUNK_SIZE || raw_size > remaining_bytes
+                    || recv(sock_client, chunk, wire_size, MSG_WAITALL) != wire_size
+                    || (compressed && decompress_block(chunk, wire_size, raw, COMPRESS_CHUNK_SIZE) != raw_size)){
+                    fprintf(stderr, "ERROR! Received a corrupted chunk!\n");
+                    close(sock);
+                    exit(1);
+                }
+                if (hashing)
+                    xxh64_update(&hash, compressed ? raw : chunk, raw_size);
+                remaining_bytes -= raw_size;
+                __atomic_add_fetch(&payload_received, raw_size, __ATOMIC_RELAXED);
+                continue;
+            }
+            bytes_received = recv_payload(sock_client, &path, remaining_bytes);
             if (bytes_received <= -1){
                 perror("recv");
                 close(sock);
@@ -168,53 +486,111 @@ int main(int argc, char *argv[]) {
                 close(sock);
                 exit(1);
             }
-            // Makes sure a '\0' exists at the end of the data to not accidently access forbidden memory - if we print the buffer
-            // if (buffer[BUFSIZ - 1] != '\0'){
-            //     buffer[BUFSIZ - 1] = '\0';
-            // }
-            // printf("%s.\n", buffer);
+            remaining_bytes -= bytes_received;
+            __atomic_add_fetch(&payload_received, bytes_received, __ATOMIC_RELAXED);
+            if (hashing && path.received != NULL)
+                xxh64_update(&hash, path.received, bytes_received);
+            verifiable = path.received != NULL;
 
             // keep receiving until the amount of expected bytes is reached
-        } while (remaining_bytes > 0);
-
-        gettimeofday(&end_time, NULL);      // log end time
+        }
 
-        // Makes sure a '\0' exists at the end of the data to not accidently access forbidden memory - if we print the buffer
-        if (buffer[BUFSIZ - 1] != '\0'){
-            buffer[BUFSIZ - 1] = '\0';
+        if (hashing){
+            frame_trailer trailer;
+            if (recv(sock_client, &trailer, sizeof trailer, MSG_WAITALL) != sizeof trailer){
+                printf("Connection was closed prior to receiving the data!\n");
+                close(sock);
+                exit(1);
+            }
+            if (verifiable && trailer_decode(&trailer) != xxh64_digest(&hash)){
+                fprintf(stderr, "ERROR! Integrity check failed: the sender's XXH64 is %016llx, the payload's is %016llx!\n",
+                        (unsigned long long)trailer_decode(&trailer), (unsigned long long)xxh64_digest(&hash));
+                close(sock);
+                exit(1);
+            }
+            #ifdef _DEBUG
+            if (verifiable)
+                printf("Integrity verified (XXH64 %016llx).\n", (unsigned long long)trailer_decode(&trailer));
+            else
+                printf("Integrity not verified - the sink mode drops the payload.\n");
+            #endif
         }
 
-        // Add stats
+        gettimeofday(&end_time, NULL);      // log end time
+        interval_mark(reporter, 0);
+
+        // Add stats - the sender decides how many runs there are, only the first MAX_RUNS - 1 are kept
         struct timeval elapsed;
         timersub(&end_time, &start_time, &elapsed);
-        runs[times].id = times;
-        runs[times].elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
-        runs[times].speed = (total_bytes / (float)MB) / (runs[times].elapsed_time / 1000.0);
+        if (times < MAX_RUNS){
+            runs[times].id = times;
+            runs[times].elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
+            runs[times].speed = (total_bytes / (float)MB) / (runs[times].elapsed_time / 1000.0);
 
-        // runs[0] keeps the avg of all runs. add data to avg:
-        runs[0].elapsed_time += runs[times].elapsed_time;
-        runs[0].speed += runs[times].speed;
+            // runs[0] keeps the avg of all runs. add data to avg:
+            runs[0].elapsed_time += runs[times].elapsed_time;
+            runs[0].speed += runs[times].speed;
+        }
+        else if (times == MAX_RUNS){
+            printf("Only the first %d runs are kept in the stats.\n", MAX_RUNS - 1);
+        }
+
+        if (times == 1 && tune && runs[times].elapsed_time > 0){
+            // the first transfer measured the path - size the buffers for the next ones
+            uint64_t rate = total_bytes / (runs[times].elapsed_time / 1000.0) / stream_count;
+            for (int s = 0; s < stream_count; s++){
+                tune_result tuning;
+                char name[32];
+                snprintf(name, sizeof name, stream_count > 1 ? "Tuning stream #%d" : "Tuning", s);
+                if (tune_tcp_socket(streams[s].sock, rate, 0, &tuning) == 0)
+                    tune_print(name, &tuning);
+            }
+        }
 
         #ifdef _DEBUG
-        printf("Received data size: %d bytes.\n", total_bytes);
+        printf("Received data size: %llu bytes.\n", (unsigned long long)total_bytes);
         #endif
 
+        for (int s = 0; stream_count > 1 && s < stream_count; s++){
+            struct timeval stream_elapsed;
+            timersub(&streams[s].end_time, &streams[s].start_time, &stream_elapsed);
+            float stream_time = stream_elapsed.tv_sec * 1000.0 + stream_elapsed.tv_usec / 1000.0;
+            printf("Stream #%d: %.2fMB in %.2fms; Speed=%.2fMB/s\n", s, streams[s].size / (float)MB, stream_time,
+                   (streams[s].size / (float)MB) / (stream_time / 1000.0));
+        }
+
         printf("Data transfer completed.\n");
 
         printf("Waiting for sender's response...\n");
-
-        // Reset buffer before more data is received
-        memset(buffer, 0, BUFSIZ);
     } while (1);
 
+    if (reporter != NULL){
+        interval_stop(reporter);
+        printf("Interval reports written to %s.\n", interval_path);
+    }
+    if (path.mode == RECV_MMAP){
+        printf("Zero-copy receive: %.2fMB mapped, %.2fMB copied\n", path.mapped / (float)MB, path.copied / (float)MB);
+    }
+    recv_path_close(&path);
+
     // Close connection
+    for (int s = 0; s < stream_count; s++){
+        close(streams[s].sock);
+    }
     close(sock);
+    free(chunk);
+    free(raw);
+    free(payload);
 
     // PRINT STATS
 
     printf("----------------------------\n");
     printf("-      * Statistics *      -\n");
 
+    if (times >= MAX_RUNS){
+        times = MAX_RUNS - 1;
+    }
+
     for (int i = 1; i <= times; i++){
         printf("Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", runs[i].id, runs[i].elapsed_time, runs[i].speed);
     }
@@ -230,4 +606,513 @@ int main(int argc, char *argv[]) {
     printf("Receiver end.\n");
     
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * @brief   Receives a stream's range of a striped payload into its place (a thread of its own for every stream).
+ *          Compressed chunks are decompressed straight to their place.
+ */
+void* receive_stream(void *arg){
+    tcp_stream *stream = (tcp_stream *)arg;
+    uint64_t received = 0;
+    char *chunk = NULL;
+
+    stream->failed = 0;
+    if (stream->capabilities & CAP_COMPRESSION){
+        chunk = (char*)malloc(COMPRESS_BOUND(COMPRESS_CHUNK_SIZE));
+        if (chunk == NULL){
+            stream->failed = 1;
+            return NULL;
+        }
+    }
+    while (received < stream->size){
+        if (chunk != NULL){
+            compress_chunk_header header;
+            if (recv(stream->sock, &header, sizeof header, MSG_WAITALL) != sizeof header){
+                stream->failed = 1;
+                break;
+            }
+            uint32_t raw_size = ntohl(header.raw_size), wire_size = ntohl(header.wire_size);
+            int compressed = (wire_size & COMPRESS_FLAG_COMPRESSED) != 0;
+            wire_size &= ~COMPRESS_FLAG_COMPRESSED;
+            char *dest = stream->dest + received;
+            if (wire_size > COMPRESS_BOUND(COMPRESS_CHUNK_SIZE) || raw_size > COMPRESS_CHUNK_SIZE || raw_size > stream->size - received
+                || (!compressed && wire_size != raw_size)
+                || recv(stream->sock, compressed ? chunk : dest, wire_size, MSG_WAITALL) != wire_size
+                || (compressed && decompress_block(chunk, wire_size, dest, raw_size) != raw_size)){
+                stream->failed = 1;
+                break;
+            }
+            received += raw_size;
+            __atomic_add_fetch(&payload_received, raw_size, __ATOMIC_RELAXED);
+            continue;
+        }
+        ssize_t bytes_received = recv(stream->sock, stream->dest + received, stream->size - received, MSG_WAITALL);
+        if (bytes_received <= 0){
+            if (bytes_received == -1 && errno == EINTR)
+                continue;
+            stream->failed = 1;
+            break;
+        }
+        received += bytes_received;
+        __atomic_add_fetch(&payload_received, bytes_received, __ATOMIC_RELAXED);
+    }
+    gettimeofday(&stream->end_time, NULL);
+    free(chunk);
+    return NULL;
+}
+
+/*
+ * @brief   The interval reports' counters (on the reporter's thread): the payload received so far, and the segments
+ *          the connections got out of order as the losses. A TCP receiver can't tell resent segments apart -
+ *          the sender's TCP_INFO samples (-tcpinfo) count them.
+ */
+void sample_counters(void *context, interval_counters *counters){
+    interval_context *reported = (interval_context *)context;
+    counters->bytes = __atomic_load_n(&payload_received, __ATOMIC_RELAXED);
+    counters->retransmits = INTERVAL_UNKNOWN;
+    counters->lost = 0;
+    for (int s = 0; s < reported->count; s++){
+        uint32_t segments;
+        if (tcpinfo_out_of_order(reported->streams[s].sock, &segments) == -1){
+            counters->lost = INTERVAL_UNKNOWN;
+            return;
+        }
+        counters->lost += segments;
+    }
+}
+
+/*
+ * @brief   Prepares the buffers (and the mapping) of a receive mode. Falls back to RECV_LARGE if the socket
+ *          can't be mapped.
+ * @return  0 on success, -1 if out of memory.
+ */
+int recv_path_open(recv_path *path, int sock, enum recv_mode mode){
+    memset(path, 0, sizeof *path);
+    path->mode = mode;
+    path->map = MAP_FAILED;
+    if (mode == RECV_MMAP){
+        path->map = mmap(NULL, RECV_MAP_SIZE, PROT_READ, MAP_SHARED, sock, 0);
+        if (path->map == MAP_FAILED){
+            perror("mmap socket");
+            printf("Zero-copy receive isn't supported, using a large buffer instead.\n");
+            path->mode = RECV_LARGE;
+        }
+    }
+    // the sink copies nothing, the mmap mode copies what the kernel couldn't map
+    path->size = path->mode == RECV_COPY ? BUFSIZ : path->mode == RECV_SINK ? 0 : RECV_LARGE_BUFFER;
+    if (path->size > 0){
+        path->buffer = (char*)malloc(path->size);
+        if (path->buffer == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief   Receives up to remaining payload bytes the way the receive mode says.
+ *          Never reads past the payload - the next frame may already be waiting behind it.
+ * @return  The bytes received, 0 if the connection was closed, -1 on failure.
+ */
+ssize_t recv_payload(int sock, recv_path *path, uint64_t remaining){
+    size_t page = sysconf(_SC_PAGESIZE);
+    ssize_t bytes_received;
+
+    path->received = path->buffer;
+    switch (path->mode){
+    case RECV_SINK:
+        // with MSG_TRUNC a TCP socket drops the bytes instead of copying them, so no buffer is needed
+        return recv(sock, NULL, remaining < SSIZE_MAX ? remaining : SSIZE_MAX, MSG_TRUNC);
+    case RECV_MMAP:
+        while (remaining >= page){
+            struct tcp_zerocopy_receive zc;
+            socklen_t zc_len = sizeof zc;
+            struct pollfd readable = { .fd = sock, .events = POLLIN };
+            // the kernel doesn't wait for data to map
+            if (poll(&readable, 1, -1) == -1){
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            memset(&zc, 0, sizeof zc);
+            zc.address = (uint64_t)(uintptr_t)path->map;
+            zc.length = remaining < RECV_MAP_SIZE ? remaining & ~(uint64_t)(page - 1) : RECV_MAP_SIZE;
+            if (getsockopt(sock, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len) == -1)
+                return -1;
+            if (zc.length > 0){
+                path->mapped += zc.length;
+                path->received = (char*)path->map;
+                return zc.length;
+            }
+            if (zc.recv_skip_hint == 0){
+                if (readable.revents & (POLLHUP | POLLERR))
+                    break;      // let recv() report it
+                continue;
+            }
+            // the next bytes aren't in whole pages - copy them
+            bytes_received = recv(sock, path->buffer, zc.recv_skip_hint < remaining ? zc.recv_skip_hint : remaining, 0);
+            if (bytes_received > 0)
+                path->copied += bytes_received;
+            return bytes_received;
+        }
+        bytes_received = recv(sock, path->buffer, remaining < path->size ? remaining : path->size, 0);
+        if (bytes_received > 0)
+            path->copied += bytes_received;
+        return bytes_received;
+    default:
+        return recv(sock, path->buffer, remaining < path->size ? remaining : path->size, 0);
+    }
+}
+
+void recv_path_close(recv_path *path){
+    if (path->map != MAP_FAILED)
+        munmap(path->map, RECV_MAP_SIZE);
+    free(path->buffer);
+}
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void server_interrupt(int signum){
+    (void)signum;
+    server_stop = 1;
+}
+
+/*
+ * @brief   Receives the rest of size bytes into dest, as much as the socket has.
+ * @return  1 once all of them arrived, 0 if more are on the way, -1 if the connection failed or was closed.
+ */
+static int client_fill(tcp_client *client, char *dest, size_t size){
+    while (client->got < size){
+        ssize_t bytes_received = recv(client->sock, dest + client->got, size - client->got, 0);
+        if (bytes_received == 0)
+            return -1;
+        if (bytes_received == -1){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("recv");
+            return -1;
+        }
+        client->got += bytes_received;
+    }
+    client->got = 0;
+    return 1;
+}
+
+/*
+ * @brief   Adds a finished run to the client's and the server's stats.
+ */
+static void client_run_done(tcp_client *client, server_stats *stats){
+    struct timeval end_time, elapsed;
+    gettimeofday(&end_time, NULL);
+    timersub(&end_time, &client->start_time, &elapsed);
+    float elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
+    float speed = elapsed_time > 0 ? (client->total / (float)MB) / (elapsed_time / 1000.0) : 0;
+
+    client->runs++;
+    client->bytes += client->total;
+    client->elapsed_time += elapsed_time;
+    client->speed += speed;
+    stats->runs++;
+    stats->bytes += client->total;
+    stats->last = end_time;
+
+    #ifdef _DEBUG
+    printf("Client #%u Run #%u Data: Time=%.2fms; Speed=%.2fMB/s\n", client->id, client->runs, elapsed_time, speed);
+    #endif
+    client->state = CLIENT_FRAME;
+}
+
+/*
+ * @brief   The payload of a run arrived - the run is done unless its trailer is still to come.
+ */
+static void client_payload_done(tcp_client *client, server_stats *stats){
+    if (client->hashing)
+        client->state = CLIENT_TRAILER;
+    else
+        client_run_done(client, stats);
+}
+
+/*
+ * @brief   Receives whatever the client has sent, up to SERVER_BUDGET reads.
+ * @param   buffer  SERVER_BUFFER bytes, shared by all clients.
+ * @return  0 to keep waiting for the client, 1 if it sent the exit message, -1 if it failed.
+ */
+static int client_receive(tcp_client *client, char *buffer, server_stats *stats){
+    for (int budget = SERVER_BUDGET; budget > 0; budget--){
+        int done;
+        switch (client->state){
+        case CLIENT_HANDSHAKE: {
+            // accept the capabilities we support out of the sender's offer
+            uint32_t offer;
+            if ((done = client_fill(client, client->header, sizeof offer)) <= 0)
+                return done;
+            memcpy(&offer, client->header, sizeof offer);
+            client->capabilities = ntohl(offer) & SERVER_CAPS;
+            uint32_t accepted = htonl(client->capabilities);
+            // nothing was sent on this socket yet, so the reply fits in its buffer
+            if (send(client->sock, &accepted, sizeof accepted, 0) != sizeof accepted){
+                perror("handshake");
+                return -1;
+            }
+            if (client->capabilities & CAP_COMPRESSION){
+                client->chunk = (char*)malloc(COMPRESS_BOUND(COMPRESS_CHUNK_SIZE));
+                if (client->chunk == NULL){
+                    fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+                    return -1;
+                }
+            }
+            printf("Client #%u (%s) connected%s.\n", client->id, client->name,
+                   client->capabilities & CAP_COMPRESSION ? ", compression enabled" : "");
+            client->state = CLIENT_FRAME;
+            break;
+        }
+        case CLIENT_FRAME: {
+            transfer_frame frame;
+            if ((done = client_fill(client, client->header, sizeof frame)) <= 0)
+                return done;
+            memcpy(&frame, client->header, sizeof frame);
+            frame_decode(&frame);
+            if (frame.flags & FRAME_FLAG_EXIT)
+                return 1;
+            client->remaining = client->total = frame.length;
+            client->hashing = (frame.flags & FRAME_FLAG_HASH) != 0;
+            xxh64_reset(&client->hash, HASH_SEED);
+            gettimeofday(&client->start_time, NULL);
+            if (!timerisset(&stats->first))
+                stats->first = client->start_time;
+            if (client->remaining == 0)
+                client_payload_done(client, stats);
+            else
+                client->state = client->capabilities & CAP_COMPRESSION ? CLIENT_CHUNK_HEADER : CLIENT_PAYLOAD;
+            break;
+        }
+        case CLIENT_PAYLOAD: {
+            // never read past this file - the next frame may already be waiting behind it
+            ssize_t bytes_received = recv(client->sock, buffer, client->remaining < SERVER_BUFFER ? client->remaining : SERVER_BUFFER, 0);
+            if (bytes_received == 0)
+                return -1;
+            if (bytes_received == -1){
+                if (errno == EINTR)
+                    break;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                perror("recv");
+                return -1;
+            }
+            client->remaining -= bytes_received;
+            if (client->hashing)
+                xxh64_update(&client->hash, buffer, bytes_received);
+            if (client->remaining == 0)
+                client_payload_done(client, stats);
+            break;
+        }
+        case CLIENT_CHUNK_HEADER: {
+            compress_chunk_header header;
+            if ((done = client_fill(client, client->header, sizeof header)) <= 0)
+                return done;
+            memcpy(&header, client->header, sizeof header);
+            client->raw_size = ntohl(header.raw_size);
+            client->wire_size = ntohl(header.wire_size);
+            client->compressed = (client->wire_size & COMPRESS_FLAG_COMPRESSED) != 0;
+            client->wire_size &= ~COMPRESS_FLAG_COMPRESSED;
+            if (client->wire_size > COMPRESS_BOUND(COMPRESS_CHUNK_SIZE) || client->raw_size > COMPRESS_CHUNK_SIZE
+                || client->raw_size > client->remaining || (!client->compressed && client->wire_size != client->raw_size)){
+                fprintf(stderr, "ERROR! Client #%u sent a corrupted chunk!\n", client->id);
+                return -1;
+            }
+            client->state = CLIENT_CHUNK;
+            break;
+        }
+        case CLIENT_CHUNK:
+            if ((done = client_fill(client, client->chunk, client->wire_size)) <= 0)
+                return done;
+            if (client->compressed && decompress_block(client->chunk, client->wire_size, buffer, COMPRESS_CHUNK_SIZE) != client->raw_size){
+                fprintf(stderr, "ERROR! Client #%u sent a corrupted chunk!\n", client->id);
+                return -1;
+            }
+            if (client->hashing)
+                xxh64_update(&client->hash, client->compressed ? buffer : client->chunk, client->raw_size);
+            client->remaining -= client->raw_size;
+            if (client->remaining == 0)
+                client_payload_done(client, stats);
+            else
+                client->state = CLIENT_CHUNK_HEADER;
+            break;
+        case CLIENT_TRAILER: {
+            frame_trailer trailer;
+            if ((done = client_fill(client, client->header, sizeof trailer)) <= 0)
+                return done;
+            memcpy(&trailer, client->header, sizeof trailer);
+            if (trailer_decode(&trailer) != xxh64_digest(&client->hash)){
+                fprintf(stderr, "ERROR! Client #%u failed the integrity check: its XXH64 is %016llx, the payload's is %016llx!\n",
+                        client->id, (unsigned long long)trailer_decode(&trailer), (unsigned long long)xxh64_digest(&client->hash));
+                return -1;
+            }
+            client_run_done(client, stats);
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief   Disconnects a client and prints its stats.
+ */
+static void client_close(tcp_client *client, tcp_client **clients, server_stats *stats){
+    close(client->sock);        // also removes it from the epoll set
+    if (client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        *clients = client->next;
+    if (client->next != NULL)
+        client->next->prev = client->prev;
+    stats->active--;
+
+    printf("Client #%u (%s): %u runs, %.2fMB", client->id, client->name, client->runs, client->bytes / (float)MB);
+    if (client->runs > 0){
+        printf("; Average time: %.2fms; Average bandwidth: %.2fMB/s",
+               client->elapsed_time / client->runs, client->speed / client->runs);
+    }
+    printf("\n");
+    free(client->chunk);
+    free(client);
+}
+
+/*
+ * @brief   The server mode - accepts any number of senders and receives from all of them at once, on a single
+ *          thread, with epoll. Every client keeps its own run stats, the aggregate throughput of all of them is
+ *          printed at the end.
+ * @param   max_clients Returns after that many clients disconnected, 0 to keep serving until SIGINT.
+ * @return  0 on success, 1 on failure.
+ */
+int serve_clients(int sock, unsigned int max_clients){
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1){
+        perror("epoll_create1");
+        return 1;
+    }
+    char *buffer = (char*)malloc(SERVER_BUFFER);
+    if (buffer == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        close(epoll_fd);
+        return 1;
+    }
+
+    // the listening socket is the event without a client
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1){
+        perror("epoll_ctl");
+        free(buffer);
+        close(epoll_fd);
+        return 1;
+    }
+
+    // stop on SIGINT (without SA_RESTART, so epoll_wait is interrupted)
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = server_interrupt;
+    sigaction(SIGINT, &action, NULL);
+
+    if (max_clients > 0)
+        printf("Serving %u senders...\n", max_clients);
+    else
+        printf("Serving senders until interrupted (Ctrl+C)...\n");
+
+    server_stats stats;
+    memset(&stats, 0, sizeof stats);
+    tcp_client *clients = NULL;
+    struct epoll_event events[SERVER_EVENTS];
+    int result = 0;
+
+    while (!server_stop && (max_clients == 0 || stats.clients < max_clients || stats.active > 0)){
+        int ready = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+        if (ready == -1){
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            result = 1;
+            break;
+        }
+        for (int e = 0; e < ready; e++){
+            tcp_client *client = (tcp_client *)events[e].data.ptr;
+            if (client != NULL){
+                int done = client_receive(client, buffer, &stats);
+                if (done == 1)
+                    printf("Client #%u sent exit message.\n", client->id);
+                else if (done == -1)
+                    printf("Client #%u: Connection was closed prior to receiving the data!\n", client->id);
+                if (done != 0)
+                    client_close(client, &clients, &stats);
+                continue;
+            }
+
+            // accept everyone waiting
+            while (max_clients == 0 || stats.clients < max_clients){
+                struct sockaddr_in addr;
+                socklen_t addr_len = sizeof addr;
+                int sock_client = accept(sock, (struct sockaddr *)&addr, &addr_len);
+                if (sock_client == -1){
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        perror("accept");
+                    break;
+                }
+                client = (tcp_client *)calloc(1, sizeof(tcp_client));
+                if (client == NULL){
+                    fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+                    close(sock_client);
+                    break;
+                }
+                client->sock = sock_client;
+                client->id = ++stats.clients;
+                client->state = CLIENT_HANDSHAKE;
+                inet_ntop(AF_INET, &addr.sin_addr, client->name, INET_ADDRSTRLEN);
+                snprintf(client->name + strlen(client->name), sizeof client->name - strlen(client->name), ":%d", ntohs(addr.sin_port));
+                event.events = EPOLLIN;
+                event.data.ptr = client;
+                if (fcntl(sock_client, F_SETFL, fcntl(sock_client, F_GETFL) | O_NONBLOCK) == -1
+                    || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_client, &event) == -1){
+                    perror("epoll_ctl");
+                    close(sock_client);
+                    free(client);
+                    continue;
+                }
+                client->next = clients;
+                if (clients != NULL)
+                    clients->prev = client;
+                clients = client;
+                if (++stats.active > stats.peak)
+                    stats.peak = stats.active;
+            }
+            if (max_clients > 0 && stats.clients >= max_clients)
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);     // the rest wait in the backlog
+        }
+    }
+
+    while (clients != NULL){
+        printf("Client #%u: disconnected by the server.\n", clients->id);
+        client_close(clients, &clients, &stats);
+    }
+    free(buffer);
+    close(epoll_fd);
+
+    // PRINT STATS
+
+    struct timeval elapsed;
+    timersub(&stats.last, &stats.first, &elapsed);
+    float elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
+
+    printf("----------------------------\n");
+    printf("-      * Statistics *      -\n");
+    printf("Clients: %u (at most %u at once)\n", stats.clients, stats.peak);
+    printf("Runs: %u; Data: %.2fMB\n", stats.runs, stats.bytes / (float)MB);
+    if (stats.runs > 0 && elapsed_time > 0){
+        printf("Aggregate time: %.2fms\n", elapsed_time);
+        printf("Aggregate bandwidth: %.2fMB/s\n", (stats.bytes / (float)MB) / (elapsed_time / 1000.0));
+    }
+    printf("----------------------------\n");
+
+    return result;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE         // splice()
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h> 
@@ -7,26 +8,88 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>      // SIOCOUTQ
+#include "Compression.h"
+#include "Framing.h"
+#include "Tuning.h"
+#include "TcpInfo.h"
+#include "Payload.h"
+#include "Hash.h"
 
 #define _DEBUG
 
-#define EXIT_MESSAGE 0      // Exit message is sending 0 as of "we have 0 bytes to send"
-
 // #define SERVER_PORT 6000
 // #define SERVER_IP "127.0.0.1"
 
 #define MB 1048576
 #define MIN_FILE_SIZE 2*MB           // 2MB
 
-
-char* util_generate_random_data(unsigned int size);
+#define CAP_COMPRESSION 0x01        // capabilities, exchanged right after connecting
+#define CAP_STREAMS 0x02            // stripe payloads over several connections, their amount is in the top 16 bits
+#define MAX_STREAMS 64
+#define MAX_RUNS 10000              // the receiver keeps the stats of fewer runs than this
+#define ZEROCOPY_CHUNK (256*1024)   // bytes per MSG_ZEROCOPY send - every send pins its pages until completion
+#define SENDFILE_CHUNK (1 << 30)
+#define DRAIN_TIMEOUT_USEC 10000000 // the first transfer is timed until it's acknowledged, but not longer than this
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// MSG_ZEROCOPY bookkeeping - the kernel numbers every zero-copy send and reports completed ranges on the error queue
+typedef struct _zerocopy_state {
+    int enabled;
+    uint32_t sends;             // zero-copy sends issued
+    uint32_t completed;         // sends whose pages the kernel released
+    uint32_t copied;            // completed sends the kernel copied anyway (e.g. over loopback)
+} zerocopy_state;
+
+// One of the connections a payload is striped over (-streams). Stream 0 is the first connection, it also carries the frames
+typedef struct _tcp_stream {
+    int sock;
+    zerocopy_state zerocopy;
+    // the part of the current payload this stream sends (on its own thread), and how it went
+    char *data;
+    int fd;
+    size_t offset, size;
+    uint32_t capabilities;
+    ssize_t result;
+} tcp_stream;
+
+
+ssize_t send_compressed(int sock, char *data, size_t size);
+ssize_t send_frame(int sock, transfer_frame *frame, char *data, size_t size);
+ssize_t send_all(int sock, const void *data, size_t size, int flags);
+ssize_t send_zerocopy(int sock, char *data, size_t size, zerocopy_state *zc);
+int zerocopy_reap(int sock, zerocopy_state *zc, int timeout_ms);
+ssize_t send_file(int sock, int fd, off_t offset, size_t size);
+ssize_t send_range(tcp_stream *stream, char *data, int fd, size_t offset, size_t size, uint32_t capabilities);
+ssize_t send_striped(tcp_stream *streams, int count, char *data, int fd, size_t size, uint32_t capabilities);
+void* send_stream(void *arg);
+int connect_stream(struct sockaddr_in *server, const char *algo, uint32_t index);
+ssize_t splice_file(int sock, int fd, off_t offset, size_t size);
+void release_payload(char *data, int fd, size_t size, hash_job *hashing);
+int wait_acknowledged(tcp_stream *streams, int count);
 
 int main(int argc, char *argv[]){
     printf("Starting Sender...\n");
 
     // Check the correct amount of args were received
-    if (argc != 7){
-        fprintf(stderr, "Usage: -ip <server_ip> -p <server_port> -algo <algo>");
+    if (argc < 7){
+        fprintf(stderr, "Usage: -ip <server_ip> -p <server_port> -algo <algo> [-compress] [-runs <n>] [-size <bytes>] [-pattern <random|compressible|counter|verify>] [-seed <n>] [-f <file>] [-copy] [-streams <n>] [-notune] [-nohash] [-tcpinfo <file.csv>] [-sample <ms>]");
         exit(1);
     }
 
@@ -46,24 +109,35 @@ int main(int argc, char *argv[]){
 
     server.sin_family = AF_INET;        // ipv4
 
+    uint32_t capabilities = 0;      // what we ask the receiver for
+    int runs = 0;                   // how many times to send the file, 0 - ask the user after every run
+    size_t data_size = MIN_FILE_SIZE+BUFSIZ;      // Generate data bigger than 2MB by default
+    char *file_path = NULL;         // send this file (with sendfile()) instead of random data
+    int zerocopy = 1;               // -copy turns MSG_ZEROCOPY off
+    int stream_count = 1;           // connections to stripe the payload over
+    tcp_stream streams[MAX_STREAMS];
+    char *algo = NULL;              // any algorithm the kernel has ("reno", "cubic", "bbr"...)
+    char *tcpinfo_path = NULL;      // sample TCP_INFO into this CSV file
+    unsigned int sample_ms = TCPINFO_DEFAULT_INTERVAL_MS;
+    int tune = 1;                   // size the socket buffers from the first transfer's BDP, -notune keeps the defaults
+    payload_pattern pattern = PAYLOAD_RANDOM;       // what the generated data looks like
+    uint64_t seed = PAYLOAD_DEFAULT_SEED;           // the same seed generates the same data
+    int hash = 1;                   // follow every payload with its XXH64, -nohash sends the payload alone
+
     int i = 1;
     // Take port, ip and algo from argv (if failed - stop program and ask for correct inputs)
     while (i < argc){
         if (argv[i][0] == '-') {
             if (!strcmp(argv[i], "-algo")){
                 // Set TCP congestion control algorithm
-                char *algo;       // "reno" or "cubic"
                 i++;
-                if (!strcmp(argv[i], "reno")){
-                    algo = "reno";
-                }
-                else if (!strcmp(argv[i], "cubic")){
-                    algo = "cubic";
-                }
-                else {
-                    fprintf(stderr, "Algo should be \"reno\" or \"cubic\"!");
+                if (tcp_algo_available(argv[i]) == 0){
+                    fprintf(stderr, "Algo should be one of: ");
+                    tcp_algo_print_available(stderr);
+                    fprintf(stderr, "\n");
                     exit(1);
                 }
+                algo = argv[i];
                 // Set algo
                 #ifdef _DEBUG
                 printf("Algo is set to: %s\n", algo);
@@ -93,6 +167,77 @@ int main(int argc, char *argv[]){
                 printf("Server IP is set to: %s\n", argv[i]);
                 #endif
             }
+            else if (!strcmp(argv[i], "-compress")){
+                // Ask the receiver for compressed chunks
+                capabilities |= CAP_COMPRESSION;
+            }
+            else if (!strcmp(argv[i], "-runs") && i + 1 < argc){
+                // Send the file this many times without asking
+                i++;
+                runs = atoi(argv[i]);
+                if (runs < 1 || runs >= MAX_RUNS){
+                    fprintf(stderr, "Runs should be between 1 and %d!\n", MAX_RUNS - 1);
+                    exit(1);
+                }
+            }
+            else if (!strcmp(argv[i], "-size") && i + 1 < argc){
+                // Size of the generated file, in bytes
+                i++;
+                data_size = strtoul(argv[i], NULL, 10);
+                if (data_size < 2){
+                    fprintf(stderr, "Size should be at least 2 bytes!\n");
+                    exit(1);
+                }
+            }
+            else if (!strcmp(argv[i], "-pattern") && i + 1 < argc){
+                // Pattern of the generated data
+                i++;
+                if (payload_pattern_parse(argv[i], &pattern) != 0){
+                    fprintf(stderr, "Pattern should be one of: random compressible counter verify\n");
+                    exit(1);
+                }
+            }
+            else if (!strcmp(argv[i], "-seed") && i + 1 < argc){
+                // Seed of the generated data
+                i++;
+                seed = strtoull(argv[i], NULL, 10);
+            }
+            else if (!strcmp(argv[i], "-f") && i + 1 < argc){
+                // Send a file instead of random data
+                i++;
+                file_path = argv[i];
+            }
+            else if (!strcmp(argv[i], "-tcpinfo") && i + 1 < argc){
+                // Write a TCP_INFO time series of every stream
+                i++;
+                tcpinfo_path = argv[i];
+            }
+            else if (!strcmp(argv[i], "-sample") && i + 1 < argc){
+                // TCP_INFO sampling interval
+                i++;
+                sample_ms = atoi(argv[i]);
+            }
+            else if (!strcmp(argv[i], "-notune")){
+                // Keep the kernel's socket buffer sizes
+                tune = 0;
+            }
+            else if (!strcmp(argv[i], "-nohash")){
+                // No integrity trailer
+                hash = 0;
+            }
+            else if (!strcmp(argv[i], "-copy")){
+                // Plain send() of the generated data, for comparing with MSG_ZEROCOPY
+                zerocopy = 0;
+            }
+            else if (!strcmp(argv[i], "-streams") && i + 1 < argc){
+                // Stripe the payload over this many parallel connections
+                i++;
+                stream_count = atoi(argv[i]);
+                if (stream_count < 1 || stream_count > MAX_STREAMS){
+                    fprintf(stderr, "Streams should be between 1 and %d!\n", MAX_STREAMS);
+                    exit(1);
+                }
+            }
         }
         i++;
     }
@@ -104,9 +249,117 @@ int main(int argc, char *argv[]){
         exit(1);
     }
 
-    // Generate random data
-    printf("Generating random data, of at least %dMB in size...\n", MIN_FILE_SIZE/MB);
-    char *data = util_generate_random_data(MIN_FILE_SIZE+BUFSIZ);       // Generate data bigger than 2MB
+    // Handshake - offer our capabilities, the receiver answers with the ones it accepted
+    if (stream_count > 1){
+        capabilities |= CAP_STREAMS | (uint32_t)stream_count << 16;
+    }
+    uint32_t offer = htonl(capabilities);
+    if (send(sock, &offer, sizeof offer, 0) != sizeof offer || recv(sock, &offer, sizeof offer, MSG_WAITALL) != sizeof offer){
+        perror("handshake");
+        close(sock);
+        exit(1);
+    }
+    offer = ntohl(offer);
+    capabilities &= offer & 0xFFFF;
+    if (capabilities & CAP_STREAMS){
+        // the receiver may accept less streams than we asked for
+        stream_count = offer >> 16;
+        if (stream_count < 1 || stream_count > MAX_STREAMS){
+            fprintf(stderr, "ERROR! The receiver asked for %d streams!\n", stream_count);
+            close(sock);
+            exit(1);
+        }
+    }
+    else if (stream_count > 1){
+        printf("The receiver doesn't support streams, sending over a single connection.\n");
+        stream_count = 1;
+    }
+
+    // the other streams connect now, each tells the receiver its index
+    memset(streams, 0, sizeof streams);
+    streams[0].sock = sock;
+    for (int s = 1; s < stream_count; s++){
+        streams[s].sock = connect_stream(&server, algo, s);
+        if (streams[s].sock == -1){
+            close(sock);
+            exit(1);
+        }
+    }
+    if (stream_count > 1){
+        printf("Striping over %d streams.\n", stream_count);
+    }
+
+    tcpinfo_sampler *sampler = NULL;
+    if (tcpinfo_path != NULL){
+        int socks[MAX_STREAMS];
+        for (int s = 0; s < stream_count; s++){
+            socks[s] = streams[s].sock;
+        }
+        sampler = tcpinfo_start(tcpinfo_path, socks, stream_count, sample_ms);
+        if (sampler == NULL){
+            close(sock);
+            exit(1);
+        }
+    }
+
+    if (capabilities & CAP_COMPRESSION){
+        printf("Compression enabled.\n");
+        // chunks are big anyway - don't let Nagle hold the last (short) chunk until the previous ones are ACKed
+        int yes = 1;
+        for (int s = 0; s < stream_count; s++){
+            if (setsockopt(streams[s].sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) < 0){
+                perror("setsockopt");
+            }
+        }
+    }
+
+    char *data = NULL;
+    int fd = -1;
+    if (file_path != NULL){
+        fd = open(file_path, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1){
+            perror(file_path);
+            close(sock);
+            exit(1);
+        }
+        data_size = st.st_size;
+        if (data_size == 0){
+            fprintf(stderr, "ERROR! %s is empty!\n", file_path);
+            close(sock);
+            exit(1);
+        }
+        printf("Sending %s, of %.2fMB in size...\n", file_path, data_size / (float)MB);
+        if (capabilities & CAP_COMPRESSION){
+            // chunks are compressed in user space - map the file instead of reading it
+            data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED){
+                perror("mmap");
+                close(sock);
+                exit(1);
+            }
+        }
+    }
+    else {
+        // Generate the data
+        printf("Generating %s data (seed %llu), of %.2fMB in size...\n", payload_pattern_name(pattern), (unsigned long long)seed, data_size / (float)MB);
+        data = payload_generate(data_size, pattern, seed);
+        if (data == NULL){
+            fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+            close(sock);
+            exit(1);
+        }
+
+        // pages of the buffer go to the NIC as is - the buffer doesn't change, so it's never waited for until the end
+        for (int s = 0; zerocopy && !(capabilities & CAP_COMPRESSION) && s < stream_count; s++){
+            int yes = 1;
+            streams[s].zerocopy.enabled = 1;
+            if (setsockopt(streams[s].sock, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof yes) < 0){
+                perror("setsockopt SO_ZEROCOPY");
+                streams[s].zerocopy.enabled = 0;
+            }
+        }
+    }
 
     /*  USE A FILE WITH INCREASING NUMBER TO MAKE SURE THE DATA IS FULLY RECEIVED
     // OPEN FILE
@@ -147,119 +400,532 @@ int main(int argc, char *argv[]){
     // printf("Data generated: %s", data);
     // #endif
 
-    int bytes_sent, total_bytes_sent;
-    int packet_size;
-    char action;
+    // the payload is hashed while the first transfer is on the wire, files sent with sendfile() get a mapping of their own
+    hash_job hashing;
+    char *hashed = data;
+    if (hash && data == NULL){
+        hashed = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (hashed == MAP_FAILED){
+            perror("mmap");
+            close(sock);
+            exit(1);
+        }
+        madvise(hashed, data_size, MADV_SEQUENTIAL);
+    }
+    if (hash){
+        int yes = 1;
+        hash_start(&hashing, hashed, data_size);
+        // the trailer shouldn't wait for the payload to be acknowledged (Nagle)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+
+    ssize_t bytes_sent;
+    transfer_frame frame;
+    frame_trailer trailer;
+    uint32_t transfer_id = 0;
+    int action;
+    int run = 0;
+    struct timespec start_time, end_time;
 
     do {
         printf("Sending the data...\n");
-        bytes_sent = total_bytes_sent = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-        // Send the size of the file so the receiver is prepared to receive all the bytes
-        packet_size = strlen(data)+1;
-        bytes_sent = send(sock, &packet_size, sizeof packet_size, 0);
-        if (bytes_sent == -1){
-            perror("send");
-            close(sock);
-            free(data);
-            exit(1);
+        // The frame header tells the receiver how many bytes to expect, it leaves in the same segment as the first bytes
+        frame_encode(&frame, data_size, ++transfer_id, hash ? FRAME_FLAG_HASH : 0);
+        tcpinfo_mark(sampler, transfer_id);
+        if (stream_count == 1 && !(capabilities & CAP_COMPRESSION) && fd == -1 && !streams[0].zerocopy.enabled){
+            bytes_sent = send_frame(sock, &frame, data, data_size);
         }
-        else if (bytes_sent == 0){
-            printf("Connection was closed prior to sending the data!\n");
-            close(sock);
-            free(data);
-            exit(1);
+        else {
+            bytes_sent = send_all(sock, &frame, sizeof frame, MSG_MORE);
+            if (bytes_sent == sizeof frame && stream_count > 1)
+                bytes_sent = send_striped(streams, stream_count, data, fd, data_size, capabilities);
+            else if (bytes_sent == sizeof frame)
+                bytes_sent = send_range(&streams[0], data, fd, 0, data_size, capabilities);
+        }
+        if (bytes_sent > 0 && hash){
+            // the trailer follows the payload on the first connection (after every stream's range is sent)
+            if (run == 0)
+                printf("Payload XXH64: %016llx\n", (unsigned long long)hash_wait(&hashing));
+            trailer_encode(&trailer, hash_wait(&hashing));
+            if (send_all(sock, &trailer, sizeof trailer, 0) != sizeof trailer)
+                bytes_sent = -1;
         }
-
-        // Send data
-        bytes_sent = send(sock, data, strlen(data)+1, 0);
         if (bytes_sent == -1){
             perror("send");
             close(sock);
-            free(data);
+            release_payload(data, fd, data_size, hash ? &hashing : NULL);
             exit(1);
         }
         else if (bytes_sent == 0){
             printf("Connection was closed prior to sending the data!\n");
             close(sock);
-            free(data);
+            release_payload(data, fd, data_size, hash ? &hashing : NULL);
             exit(1);
         }
 
         #ifdef _DEBUG
-        printf("Sent data size: %d bytes.\n", bytes_sent);
+        printf("Sent data size: %zd bytes.\n", bytes_sent);
         #endif
 
-        printf("Do you want to send the file again?\n");
-        printf("N - No\nY - Yes\n");
-        // Get chars until one of the following: y,Y,n,N is received
-        while (1){
-            action = getchar();
-            if (action != '\n'){
-                if (action != 'y' && action != 'n' && action != 'Y' && action != 'N' )
-                    printf("Incorrect selection! Enter:\nN - NO\nY - Yes\n");
-                else
-                    break;      // good input was received
+        run++;
+        if (run == 1 && tune){
+            // the first transfer measured the path - size the buffers for the next ones. send() returns once the data
+            // is queued, so the transfer is timed until the receiver acknowledged it, like the receiver's goodput
+            uint64_t rate = 0;
+            if (wait_acknowledged(streams, stream_count) == 0){
+                clock_gettime(CLOCK_MONOTONIC, &end_time);
+                double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+                if (elapsed > 0)
+                    rate = data_size / elapsed / stream_count;
+            }
+            for (int s = 0; rate > 0 && s < stream_count; s++){
+                tune_result tuning;
+                char name[32];
+                snprintf(name, sizeof name, stream_count > 1 ? "Tuning stream #%d" : "Tuning", s);
+                if (tune_tcp_socket(streams[s].sock, rate, 1, &tuning) == 0)
+                    tune_print(name, &tuning);
+            }
+        }
+        if (runs > 0){
+            // non interactive - send the file exactly runs times
+            action = run < runs ? 'y' : 'n';
+        }
+        else {
+            printf("Do you want to send the file again?\n");
+            printf("N - No\nY - Yes\n");
+            // Get chars until one of the following: y,Y,n,N is received
+            while (1){
+                action = getchar();
+                if (action == EOF){
+                    action = 'n';       // nobody to ask
+                    break;
+                }
+                if (action != '\n'){
+                    if (action != 'y' && action != 'n' && action != 'Y' && action != 'N' )
+                        printf("Incorrect selection! Enter:\nN - NO\nY - Yes\n");
+                    else
+                        break;      // good input was received
+                }
             }
         }
         // Resend if received "yes"
     } while(action == 'y' || action == 'Y');
 
-    total_bytes_sent = 0;
     printf("Sending an exit message to the receiver...\n");
     /*
-    We notify the Receiver of an EXIT MESSAGE by "preparing him" to receive 0 bytes.
+    We notify the Receiver of an EXIT MESSAGE by sending an empty frame flagged as exit.
     */
-    bytes_sent = send(sock, &total_bytes_sent, sizeof total_bytes_sent, 0);     // telling him we have 0 bytes to send
+    frame_encode(&frame, 0, ++transfer_id, FRAME_FLAG_EXIT);
+    bytes_sent = send_all(sock, &frame, sizeof frame, 0);
     if (bytes_sent == -1){
         perror("send");
         close(sock);
-        free(data);
+        release_payload(data, fd, data_size, hash ? &hashing : NULL);
         exit(1);
     }
     else if (bytes_sent == 0){
         printf("Connection was closed prior to sending the data!\n");
         close(sock);
-        free(data);
+        release_payload(data, fd, data_size, hash ? &hashing : NULL);
         exit(1);
     }
 
     sleep(1);
+
+    if (hash){
+        hash_wait(&hashing);
+        if (hashed != data)
+            munmap(hashed, data_size);
+    }
+
+    zerocopy_state total = {0, 0, 0, 0};
+    for (int s = 0; s < stream_count; s++){
+        zerocopy_state *zc = &streams[s].zerocopy;
+        // the buffer can't be freed before the kernel is done with its pages
+        while (zc->enabled && zc->completed != zc->sends && zerocopy_reap(streams[s].sock, zc, 1000) > 0);
+        total.enabled |= zc->enabled;
+        total.sends += zc->sends;
+        total.completed += zc->completed;
+        total.copied += zc->copied;
+    }
+    if (total.enabled){
+        printf("Zero-copy sends: %u (%u completed, %u copied by the kernel anyway)\n",
+               total.sends, total.completed, total.copied);
+    }
     
+    if (sampler != NULL){
+        printf("TCP_INFO samples written to %s.\n", tcpinfo_path);
+        tcpinfo_stop(sampler);
+    }
+
     printf("Closing the TCP connection...\n");
-    close(sock);
+    for (int s = 0; s < stream_count; s++){
+        close(streams[s].sock);
+    }
 
     printf("Sender end.\n");
-    free(data);
+    release_payload(data, fd, data_size, NULL);
 
     return 0;
 }
 
 /*
- * @brief   A random data generator function based on srand() and rand().
- * @param   The size of the data to generate (up to 2^32 bytes).
- * @return  A pointer to the buffer.
+ * @brief   Sends a frame header and its payload with writev(), so the header shares a segment with the first bytes.
+ * @param   The socket, the encoded frame header, the data and its size.
+ * @return  The amount of payload bytes sent, or -1 on failure.
  */
-char* util_generate_random_data(unsigned int size){
-    char *buffer = NULL;
+ssize_t send_frame(int sock, transfer_frame *frame, char *data, size_t size){
+    struct iovec iov[2] = {{frame, sizeof(*frame)}, {data, size}};
+    struct iovec *current = iov;
+    int count = 2;
+
+    while (count > 0){
+        ssize_t sent = writev(sock, current, count);
+        if (sent <= 0){
+            return sent;
+        }
+        // skip whatever was sent, writev may stop in the middle
+        while (count > 0 && (size_t)sent >= current->iov_len){
+            sent -= current->iov_len;
+            current++;
+            count--;
+        }
+        if (count > 0){
+            current->iov_base = (char*)current->iov_base + sent;
+            current->iov_len -= sent;
+        }
+    }
+    return size;
+}
 
-    if (size == 0){
-        return NULL;
+/*
+ * @brief   Sends data as a series of chunks, each compressed if it shrinks (see compress_chunk_header).
+ * @param   The socket, the data and its size.
+ * @return  The amount of raw bytes sent, or -1 on failure.
+ */
+ssize_t send_compressed(int sock, char *data, size_t size){
+    char *buffer = (char*)malloc(sizeof(compress_chunk_header) + COMPRESS_BOUND(COMPRESS_CHUNK_SIZE));
+    if (buffer == NULL){
+        return -1;
     }
+    compress_chunk_header *header = (compress_chunk_header*)buffer;
+    char *payload = buffer + sizeof(compress_chunk_header);
 
-    buffer = (char*)malloc(size * sizeof(char));
+    size_t total_bytes_sent = 0;
+    while (total_bytes_sent < size){
+        int raw_size = size - total_bytes_sent < COMPRESS_CHUNK_SIZE ? size - total_bytes_sent : COMPRESS_CHUNK_SIZE;
+        int wire_size = compress_block(data + total_bytes_sent, raw_size, payload, COMPRESS_BOUND(COMPRESS_CHUNK_SIZE));
 
-    if (buffer == NULL){
-        return NULL;
+        header->raw_size = htonl(raw_size);
+        if (wire_size > 0){
+            header->wire_size = htonl(wire_size | COMPRESS_FLAG_COMPRESSED);
+        }
+        else {
+            // doesn't shrink - send it as is
+            wire_size = raw_size;
+            memcpy(payload, data + total_bytes_sent, raw_size);
+            header->wire_size = htonl(wire_size);
+        }
+
+        if (send_all(sock, buffer, sizeof(compress_chunk_header) + wire_size, 0) <= 0){
+            free(buffer);
+            return -1;
+        }
+        total_bytes_sent += raw_size;
+    }
+
+    free(buffer);
+    return total_bytes_sent;
+}
+
+/*
+ * @brief   Frees the payload - a mapping of the file when one is sent (-f with compression, NULL without it), or the
+ *          generated buffer - and closes the file.
+ * @param   The payload, the file (-1 for generated data), its size, and the hash job still reading it (NULL - none).
+ */
+void release_payload(char *data, int fd, size_t size, hash_job *hashing){
+    if (hashing != NULL){
+        hash_wait(hashing);
+    }
+    if (fd != -1){
+        if (data != NULL)
+            munmap(data, size);
+        close(fd);
+    }
+    else {
+        free(data);
+    }
+}
+
+/*
+ * @brief   Waits until the send queue of every stream is empty - everything sent was acknowledged.
+ * @param   The streams and their amount.
+ * @return  0 when they drained, -1 on failure or after DRAIN_TIMEOUT_USEC.
+ */
+int wait_acknowledged(tcp_stream *streams, int count){
+    for (uint64_t waited = 0; waited < DRAIN_TIMEOUT_USEC; waited += 100){
+        int queued = 0;
+        for (int s = 0; s < count && queued == 0; s++){
+            if (ioctl(streams[s].sock, SIOCOUTQ, &queued) == -1){
+                perror("ioctl SIOCOUTQ");
+                return -1;
+            }
+        }
+        if (queued == 0)
+            return 0;
+        usleep(100);
+    }
+    return -1;
+}
+
+/*
+ * @brief   send() that doesn't stop in the middle - retries until all of the data is sent.
+ * @param   The socket, the data, its size and send()'s flags.
+ * @return  size, or what the failed send() returned (-1 or 0).
+ */
+ssize_t send_all(int sock, const void *data, size_t size, int flags){
+    size_t total_bytes_sent = 0;
+    while (total_bytes_sent < size){
+        ssize_t sent = send(sock, (const char*)data + total_bytes_sent, size - total_bytes_sent, flags);
+        if (sent == -1 && errno == EINTR){
+            continue;
+        }
+        if (sent <= 0){
+            return sent;
+        }
+        total_bytes_sent += sent;
+    }
+    return size;
+}
+
+/*
+ * @brief   Sends data with MSG_ZEROCOPY - the kernel sends the buffer's pages instead of copying them, and tells us
+ *          on the error queue when it's done with them. The buffer must not change until then (see zerocopy_reap()).
+ * @param   The socket (with SO_ZEROCOPY set), the data, its size and the zero-copy bookkeeping.
+ * @return  The amount of bytes sent, or -1 on failure.
+ */
+ssize_t send_zerocopy(int sock, char *data, size_t size, zerocopy_state *zc){
+    size_t total_bytes_sent = 0;
+    while (total_bytes_sent < size){
+        size_t chunk = size - total_bytes_sent < ZEROCOPY_CHUNK ? size - total_bytes_sent : ZEROCOPY_CHUNK;
+        ssize_t sent = send(sock, data + total_bytes_sent, chunk, MSG_ZEROCOPY);
+        if (sent == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == ENOBUFS){
+                // too many pages are pinned (optmem_max) - wait for some completions and try again
+                if (zerocopy_reap(sock, zc, 1000) == -1)
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0){
+            return 0;
+        }
+        // every send() that sent something gets its own notification, even a partial one
+        zc->sends++;
+        total_bytes_sent += sent;
+
+        // read whatever completed so far without blocking, so the error queue doesn't grow
+        if (zerocopy_reap(sock, zc, 0) == -1)
+            return -1;
+    }
+    return total_bytes_sent;
+}
+
+/*
+ * @brief   Reads zero-copy completion notifications from the socket's error queue.
+ * @param   timeout_ms How long to wait for a notification, 0 - don't wait.
+ * @return  The amount of notifications read, -1 on failure.
+ */
+int zerocopy_reap(int sock, zerocopy_state *zc, int timeout_ms){
+    int notifications = 0;
+    if (timeout_ms > 0){
+        // the error queue is signaled with POLLERR, which poll() always reports
+        struct pollfd pfd = {sock, 0, 0};
+        if (poll(&pfd, 1, timeout_ms) == -1){
+            return errno == EINTR ? 0 : -1;
+        }
+    }
+    while (1){
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1){
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return notifications;
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                  || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))){
+                continue;
+            }
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+                continue;
+            }
+            // sends [ee_info, ee_data] are done
+            uint32_t count = err->ee_data - err->ee_info + 1;
+            zc->completed += count;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += count;
+            notifications++;
+        }
+    }
+}
+
+/*
+ * @brief   Sends size bytes of a file with sendfile() - the kernel moves the page cache to the socket, nothing is
+ *          copied to user space. Falls back to splice() through a pipe where sendfile() isn't supported.
+ * @param   The socket, the file, where to start and the amount of bytes to send.
+ * @return  The amount of bytes sent, or -1 on failure.
+ */
+ssize_t send_file(int sock, int fd, off_t offset, size_t size){
+    off_t end = offset + size;
+    while (offset < end){
+        size_t chunk = end - offset < SENDFILE_CHUNK ? end - offset : SENDFILE_CHUNK;
+        ssize_t sent = sendfile(sock, fd, &offset, chunk);     // advances offset, even on a partial send
+        if (sent == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS){
+                ssize_t spliced = splice_file(sock, fd, offset, end - offset);
+                return spliced == -1 ? -1 : (ssize_t)(size - (end - offset)) + spliced;
+            }
+            return -1;
+        }
+        if (sent == 0){
+            fprintf(stderr, "ERROR! The file got shorter while sending it!\n");
+            return -1;
+        }
+    }
+    return size;
+}
+
+/*
+ * @brief   Sends size bytes of a file, starting at offset, by splicing the pages into a pipe and from it to the socket.
+ * @return  The amount of bytes sent, or -1 on failure.
+ */
+ssize_t splice_file(int sock, int fd, off_t offset, size_t size){
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1){
+        return -1;
+    }
+    size_t total_bytes_sent = 0;
+    while (total_bytes_sent < size){
+        ssize_t in_pipe = splice(fd, &offset, pipe_fds[1], NULL, size - total_bytes_sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1 && errno == EINTR){
+            continue;
+        }
+        if (in_pipe <= 0){
+            if (in_pipe == 0)
+                fprintf(stderr, "ERROR! The file got shorter while sending it!\n");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return -1;
+        }
+        // drain the pipe into the socket
+        while (in_pipe > 0){
+            ssize_t sent = splice(pipe_fds[0], NULL, sock, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (sent == -1 && errno == EINTR){
+                continue;
+            }
+            if (sent <= 0){
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            in_pipe -= sent;
+            total_bytes_sent += sent;
+        }
     }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return total_bytes_sent;
+}
 
-    srand(time(NULL));
+/*
+ * @brief   Sends a part of the payload over one stream, the way the payload is sent (compressed, from the file, etc.).
+ * @param   The stream, the data (or the file), the part's offset and size, and the negotiated capabilities.
+ * @return  The amount of bytes sent, or what the failed send returned (-1 or 0).
+ */
+ssize_t send_range(tcp_stream *stream, char *data, int fd, size_t offset, size_t size, uint32_t capabilities){
+    if (capabilities & CAP_COMPRESSION)
+        return send_compressed(stream->sock, data + offset, size);
+    if (fd != -1)
+        return send_file(stream->sock, fd, offset, size);
+    if (stream->zerocopy.enabled)
+        return send_zerocopy(stream->sock, data + offset, size, &stream->zerocopy);
+    return send_all(stream->sock, data + offset, size, 0);
+}
 
-    for (unsigned int i = 0; i < size-1; i++){
-        // set a random value insidee - make sure the value isn't '\0' that will act as the end of the string
-        while ((*(buffer + i) = ((unsigned int) rand() % 256)) == '\0');
+void* send_stream(void *arg){
+    tcp_stream *stream = (tcp_stream *)arg;
+    stream->result = stream->size > 0 ? send_range(stream, stream->data, stream->fd, stream->offset, stream->size, stream->capabilities) : 0;
+    return NULL;
+}
+
+/*
+ * @brief   Splits the payload into count contiguous ranges and sends range i over stream i, every stream on its own thread.
+ *          The receiver knows the ranges from the payload's size, so nothing but the data is sent.
+ * @return  The amount of bytes sent, or -1 if a stream failed.
+ */
+ssize_t send_striped(tcp_stream *streams, int count, char *data, int fd, size_t size, uint32_t capabilities){
+    pthread_t threads[MAX_STREAMS];
+    for (int s = 0; s < count; s++){
+        streams[s].data = data;
+        streams[s].fd = fd;
+        streams[s].offset = size / count * s;
+        streams[s].size = s + 1 < count ? size / count : size - streams[s].offset;
+        streams[s].capabilities = capabilities;
+        if (pthread_create(&threads[s], NULL, send_stream, &streams[s]) != 0){
+            fprintf(stderr, "ERROR! Failed to start a thread for stream %d!\n", s);
+            exit(1);
+        }
+    }
+    ssize_t result = size;
+    for (int s = 0; s < count; s++){
+        pthread_join(threads[s], NULL);
+        if (streams[s].result != (ssize_t)streams[s].size)
+            result = -1;
     }
-    buffer[size-1] = '\0';
+    return result;
+}
 
-    return buffer;
+/*
+ * @brief   Opens one more connection to the receiver, for stream number index.
+ * @return  The socket, or -1 on failure (the error is printed).
+ */
+int connect_stream(struct sockaddr_in *server, const char *algo, uint32_t index){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0){
+        perror("sock");
+        return -1;
+    }
+    if (algo != NULL && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algo, strlen(algo)) < 0){
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)server, sizeof(*server)) == -1){
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    uint32_t hello = htonl(index);
+    if (send_all(sock, &hello, sizeof hello, 0) != sizeof hello){
+        perror("handshake");
+        close(sock);
+        return -1;
+    }
+    return sock;
 }
@@ -1,83 +1,174 @@
 #include "RUDP_API.h"
+#include "RUDP_Packet.h"
+#include "Compression.h"
+#include "Impair.h"
+#include "RUDP_Trace.h"
+#include "Tuning.h"
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sock_diag.h>
 
 /*
  * This file contain all implementations for the RUDP API functions.
  */
 
-/* RUDP: (built "on top" of the regular UDP)
-    0 1 2 3 4 5 6 7 8            15 16                            31 
-   +-+-+-+-+-+-+-+-+---------------++-+-+-+-+-+-+-+-+---------------+
-   |                               |                                |
-   |              Length           |            Checksum            |
-   |                               |                                |
-   |                               |                                |
-   +-+-+-+-+-+-+-+-+---------------++-+-+-+-+-+-+-+-+---------------+
-   |  Sequence #   |   Ack Number  ||S|A|E|R|N|C|T| |
-   |               |               ||Y|C|A|S|U|H|C|0|
-   |               |               ||N|K|K|T|L|K|S| |
-   +---------------+---------------+
-*/
-
 /*
  * Defines:
 */
 #define max(a, b) ((a) > (b) ? (a) : (b))
-#define min(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 /*
  * Structs:
 */
-// UDP header will be created on top of this
-typedef struct _flags {
-    unsigned int syn : 1;       // indicates a sync segment in present
-    unsigned int ack : 1;       // indicates the ack num in the header is valid
-    unsigned int eak : 1;       // not used
-    unsigned int rst : 1;       // not used
-    unsigned int nul : 1;       // indicates a null segment packet
-    unsigned int chk : 1;       // 0 - checksum contains header only. 1 - checksum contains header and data.
-    unsigned int tcs : 1;       // not used
-    unsigned int     : 1;       // not used
-} flags_bitfield;
-
-typedef struct _rudp_packet_header {
-    uint16_t length;      // length of the data itself, without the RUDP header
-    uint16_t checksum;      // used to validate the corectness of the data
-    uint16_t seq_ack_number;    // when sending a packet - seq number is stored here. when sending an ack, the ack number is stored here.
-    flags_bitfield flags;          // 1 byte unassigned int - used to classify the packet (SYN, ACK, etc.)
-} rudp_packet_header;
-
-typedef struct _rudp_packet {
-    rudp_packet_header header;          // header, defined above
-    char data[RUDP_MAX_PACKET_SIZE - sizeof(rudp_packet_header)];      // data without header
-} rudp_packet;
+// Per connection state, kept for every socket created by rudp_socket()
+typedef struct _rudp_connection {
+    uint16_t peer_window;       // last window advertised by the peer
+    uint8_t capabilities;       // negotiated during the handshake (RUDP_CAP_*)
+    uint8_t peer_capabilities;  // offered by the peer in its SYN / SYN ACK
+    int send_window;            // max packets in flight, regardless of the peer's window
+    int rcvbuf_packets;         // how many packets fit in the kernel's receive buffer (SO_RCVBUF) - when SO_MEMINFO can't tell the space left
+    int reassembly_used;        // amount of packets waiting in the reassembly buffer
+    int has_peer;               // data was received from peer_addr
+    struct sockaddr_in peer_addr;
+    uint16_t next_seq;          // next sequence number expected from the peer
+    uint64_t send_offset;       // bytes sent on the connection so far - stamped on every data packet
+    uint64_t next_offset;       // stream offset of the next byte expected from the peer
+    rudp_packet *reassembly[RUDP_REASSEMBLY_SLOTS];     // out of order packets, indexed by seq % RUDP_REASSEMBLY_SLOTS
+    // out of order packets that rudp_recv_direct() already copied to their place, also indexed by seq % RUDP_REASSEMBLY_SLOTS
+    char placed[RUDP_REASSEMBLY_SLOTS];
+    uint16_t placed_seq[RUDP_REASSEMBLY_SLOTS];
+    uint16_t placed_length[RUDP_REASSEMBLY_SLOTS];      // uncompressed data length
+    rudp_stats stats;           // see rudp_get_stats()
+    uint16_t furthest_seq;      // the data packet furthest ahead received so far, for the gap counters
+    int has_furthest;
+    rudp_trace *trace;          // packet events, NULL when tracing is off
+    int tuned;                  // the buffers were sized from a measured transfer already
+    int data_size_limit;        // data bytes per packet - RUDP_MAX_DATA_SIZE unless packet sizing shrank it
+    int sizing_packets;         // new packets since the last size decision
+    uint64_t sizing_retransmits;        // stats.retransmits at the last size decision
+    uint64_t srtt_usec;         // smoothed RTT
+    uint64_t rttvar_usec;       // its variance - both kept by rudp_rtt_update(), 0 until the first sample
+    int stripes;                // UDP flows bulk rounds are spread over (RUDP_CAP_STRIPES), 1 - this socket only
+    int stripe_socks[RUDP_MAX_STRIPES];     // our end of every flow, [0] is the connection's socket
+    struct sockaddr_in stripe_addrs[RUDP_MAX_STRIPES];      // the receiver's end of every flow but [0]
+    // the offsets of the other streams, like send_offset and next_offset for the default one ([0] is not used)
+    uint64_t stream_send_offset[RUDP_MAX_STREAMS];
+    uint64_t stream_next_offset[RUDP_MAX_STREAMS];
+    // kernel timestamps (rudp_set_timestamping()), in microseconds of CLOCK_REALTIME (the NIC's clock for the hardware ones)
+    int timestamping;           // SOF_TIMESTAMPING_* flags the socket took, 0 - off
+    int stamp_sends;            // rudp_transmit() asks for transmit timestamps - not in bulk rounds, which share a sequence number
+    uint64_t rx_software;       // when the kernel received the packet we read last, 0 - it wasn't stamped
+    uint64_t rx_hardware;
+    int hardware_stamped;       // the NIC stamped one of our packets - the kernel takes the flags whether it will or not
+    uint64_t wakeup_usec;       // smoothed time from the kernel receiving a packet until we read it - the RTT samples leave it out
+    uint32_t tx_key;            // the kernel numbers our stamped sends (SOF_TIMESTAMPING_OPT_ID) - the id of the next one
+    uint16_t tx_key_seq[RUDP_TX_STAMP_KEYS];        // the packet behind every id, indexed by id % RUDP_TX_STAMP_KEYS
+    // when every packet in flight left, indexed by seq % RUDP_MAX_WINDOW - ours until the kernel's stamp arrives
+    uint16_t tx_seq[RUDP_MAX_WINDOW];
+    uint64_t tx_software[RUDP_MAX_WINDOW];
+    uint64_t tx_hardware[RUDP_MAX_WINDOW];
+} rudp_connection;
+
+// A bulk round as the receiver sees it, shared with the threads that drain the other stripes
+typedef struct _rudp_round {
+    char *data;
+    size_t size;
+    uint32_t start;             // low 32 bits of the stream offset of the round
+    uint16_t seq;
+    uint32_t count;             // packets in the round
+    int stripes;
+    // the connection's counters rudp_get_progress() reads while the round is on - every stripe adds to data_received,
+    // gaps, gaps_filled and duplicates there, atomically
+    rudp_stats *progress;
+    uint8_t *have;              // written by the stripe the packet belongs to only
+    uint32_t received;          // the rest are updated atomically - packets placed so far,
+    uint32_t newest;            // the packet that arrived last,
+    // and one past the furthest packet that arrived on every stripe - a flow keeps its order, so only the gaps
+    // behind it are lost (the other flows may just be behind)
+    uint32_t highest[RUDP_MAX_STRIPES];
+} rudp_round;
+
+// A thread that drains one stripe of a round (see rudp_set_stripes())
+typedef struct _rudp_stripe {
+    rudp_round *round;
+    int index;
+    int sock;
+    pthread_t thread;
+    rudp_stats stats;           // its own counters, added to the connection's after the round (but round->progress)
+} rudp_stripe;
 
 /*
  * Static Consts:
 */
 static const int RUDP_MAX_DATA_SIZE = RUDP_MAX_PACKET_SIZE - sizeof(rudp_packet_header);
-static int max_tries = 0;
-int *b = &max_tries; /* global int pointer, pointing to global static*/
-
-// These are close to the best settings for 0% packet loss. if there is packet loss, the program will change those values to perform the best
+static rudp_connection *connections[FD_SETSIZE];        // indexed by socket id (select() limits us to FD_SETSIZE anyway)
+static uint8_t requested_capabilities = 0;      // offered in the next handshake
+static impair_state *impairment = NULL;         // network impairment simulator, NULL when off
+static char *trace_path = NULL;                 // where connections write their packet events, NULL when off
+static rudp_io io = {sendto, recvfrom, NULL, NULL};     // NULL - select() and CLOCK_MONOTONIC
+static int autotune = 1;                        // size buffers and windows from the measured BDP
+static int packet_sizing = 0;                   // adapt the packet size to the loss
+static uint64_t bulk_rate = 0;                  // pace of bulk transfers (bytes per second), 0 - not offered
+static int requested_stripes = 1;               // UDP flows offered for bulk transfers in the next handshake
+static uint64_t busy_poll_usec = 0;             // how long a wait spins before it sleeps, 0 - no spinning
+static int busy_poll_cpu = -1;                  // where rudp_socket() pins its thread, -1 - not pinned
+static int timestamping = 0;                    // take RTT samples from kernel timestamps
+
+// if there is packet loss, the program will change it to perform the best (the timeouts come from rudp_rto())
 static int MAX_RETRIES = 10000;
-static int TIMEOUT_SEC = 0;
-static int TIMEOUT_USEC = 1000;
 
-// Used to calculate packet loss during the run and adjust timeout and retries
-static int packets_sent = 0;
-static int ack_received = 0;
+// Used to calculate packet loss during the run and adjust the retries - data and SYN packets only, ACKs aren't resent
+static int packets_sent = 0;        // first sends
+static int packets_resent = 0;      // sends again, after a timeout or duplicate ACKs
 
 /*
  * Declating Functions:
 */
-unsigned short int calculate_checksum(void *data, unsigned int bytes);
 float calculate_packet_loss();
-char* get_packet_type(rudp_packet* packet);
+void rudp_rtt_update(rudp_connection *conn, uint64_t rtt);
+uint64_t rudp_rto(rudp_connection *conn, int backoff);
 int rudp_send_packet(rudp_packet* packet, int sock_id, struct sockaddr_in *to);
+void rudp_transmit(rudp_packet* packet, int sock_id, struct sockaddr_in *to, int try_number);
+void trace_packet(rudp_connection *conn, uint8_t type, rudp_packet *packet, uint32_t extra);
+int rudp_wait_readable(int sock, int timeout_sec, int timeout_usec);
+int rudp_busy_poll(int sock, uint64_t budget_usec);
+uint64_t rudp_now_usec();
+uint64_t rudp_realtime_usec();
+void rudp_enable_timestamps(rudp_connection *conn, int sock, int peer_type);
+void rudp_hardware_stamp(rudp_connection *conn);
+ssize_t rudp_recvfrom(int sock, void *buf, size_t len, struct sockaddr_in *from, socklen_t *from_len);
+ssize_t rudp_sendto_stamped(rudp_connection *conn, int sock, rudp_packet *packet, struct sockaddr_in *to);
+void rudp_read_tx_stamps(rudp_connection *conn, int sock);
+uint64_t rudp_kernel_rtt(rudp_connection *conn, int sock, uint16_t seq);
+void rudp_probe_window(rudp_connection *conn, int sock_id, struct sockaddr_in *to, uint16_t seq_number);
+uint16_t rudp_advertised_window(int sock);
+void rudp_autotune(rudp_connection *conn, int sock, uint64_t bytes, uint64_t elapsed_usec);
+uint16_t rudp_next_expected(rudp_connection *conn, uint16_t seq);
+int rudp_slot_taken(rudp_connection *conn, uint16_t seq);
+int rudp_keep_packet(rudp_connection *conn, rudp_packet *packet);
+uint16_t rudp_recv_data_packet(rudp_connection *conn, int sock, rudp_packet *packet, struct sockaddr_in *client_addr, uint16_t seq);
+uint64_t rudp_packet_offset(rudp_connection *conn, rudp_packet *packet);
+int rudp_place_packet(rudp_connection *conn, rudp_packet *packet, char *data, uint64_t start, uint64_t end);
+int rudp_copy_packet(rudp_packet *packet, void *data, size_t data_size);
+int rudp_stream_in_order(rudp_connection *conn, rudp_packet *packet);
 int rudp_send_ack(int sock_id, struct sockaddr_in *to, int seq_number);
 int rudp_send_syn(int sock_id, struct sockaddr_in *to, int seq_number);
 rudp_packet* create_packet(void *data, size_t data_size, int seq_ack_number);
+rudp_packet* create_compressed_packet(void *data, size_t *data_size, size_t capacity, int seq_ack_number);
+void rudp_pad_packet(rudp_packet *packet, int bytes);
+void rudp_adapt_packet_size(rudp_connection *conn);
+int rudp_send_round(rudp_connection *conn, int sock_id, const char *data, size_t size, struct sockaddr_in *to, uint16_t seq, uint64_t *rate);
+int rudp_recv_round(rudp_connection *conn, int sock, char *data, size_t size, struct sockaddr_in *client_addr, uint16_t seq);
+void rudp_send_nak(int sock, struct sockaddr_in *to, rudp_round *round, uint32_t from, int all);
+int rudp_round_place(rudp_round *round, int stripe, rudp_packet *packet, int bytes, rudp_stats *stats);
+void* rudp_stripe_thread(void *arg);
+int rudp_open_stripes(rudp_connection *conn, int sock, int count);
+void rudp_connect_stripes(rudp_connection *conn, struct sockaddr_in *receiver, rudp_packet *ack);
+char* iov_gather(const struct iovec *iov, int iovcnt, size_t offset, size_t size, char *scratch);
 int rudp_recv_syn(int sock, struct sockaddr_in *client_addr);
 int rudp_recv_ack(int sock, struct sockaddr_in *sender_addr);
 
@@ -88,6 +179,18 @@ int rudp_socket(struct sockaddr_in *server_address, int peer_type, uint16_t * se
 {
     int sock = -1;
 
+    // impairments can be requested without changing the programs
+    if (impairment == NULL && getenv(RUDP_IMPAIR_ENV) != NULL){
+        if (rudp_set_impairment(getenv(RUDP_IMPAIR_ENV)) == -1){
+            fprintf(stderr, "Invalid %s, exiting...\n", RUDP_IMPAIR_ENV);
+            exit(FAIL);
+        }
+    }
+
+    if (trace_path == NULL && getenv(RUDP_TRACE_ENV) != NULL){
+        rudp_set_trace(getenv(RUDP_TRACE_ENV));
+    }
+
     // create a socket over UDP, with UDP Protocol
     sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -96,6 +199,65 @@ int rudp_socket(struct sockaddr_in *server_address, int peer_type, uint16_t * se
         exit(FAIL);
     }
 
+    if (sock >= FD_SETSIZE){
+        fprintf(stderr, "ERROR: Socket id %d is too big for select()!\n", sock);
+        close(sock);
+        exit(FAIL);
+    }
+
+    // prepare the connection's state
+    rudp_connection *conn = (rudp_connection *) calloc (1, sizeof(rudp_connection));
+    if (conn == NULL){
+        fprintf(stderr, "ERROR: Failed to allocate memory for the connection!\n");
+        close(sock);
+        exit(FAIL);
+    }
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof rcvbuf;
+    if (autotune && peer_type == SERVER){
+        // bursts (and resent packets) can reach twice the window we advertise before we get to read them
+        int limited = 0;
+        rcvbuf = tune_socket_buffer(sock, SO_RCVBUF, TUNE_FACTOR * RUDP_REASSEMBLY_SLOTS * RUDP_MAX_PACKET_SIZE, &limited);
+        if (rcvbuf > 0)
+            printf("Tuning: SO_RCVBUF=%dKB%s\n", rcvbuf / 1024, limited ? " (capped by the system limit)" : "");
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == -1){
+        perror("getsockopt");
+        rcvbuf = 0;
+    }
+    // the kernel charges each datagram about twice its size (bookkeeping), so only count half of the buffer
+    conn->rcvbuf_packets = rcvbuf / (2 * RUDP_MAX_PACKET_SIZE);
+    conn->send_window = RUDP_DEFAULT_WINDOW;
+    conn->data_size_limit = RUDP_MAX_DATA_SIZE;
+    conn->peer_window = 1;      // until the peer tells us otherwise - stop and wait
+    conn->stripes = 1;
+    conn->stripe_socks[0] = sock;
+    conn->stamp_sends = 1;
+    if (busy_poll_usec > 0 || busy_poll_cpu >= 0){
+        // the kernel's busy polling is a privilege past net.core.busy_read - spinning here works anyway
+        const char *kernel = "";
+        #ifdef SO_BUSY_POLL
+        int usec = busy_poll_usec;
+        if (busy_poll_usec > 0)
+            kernel = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) == 0 ? " (and SO_BUSY_POLL)" : " (SO_BUSY_POLL refused)";
+        #endif
+        int pinned = busy_poll_cpu >= 0 && tune_pin_cpu(busy_poll_cpu) == 0;
+        printf("Busy polling: up to %lluus per wait%s", (unsigned long long)busy_poll_usec, kernel);
+        if (pinned)
+            printf(", pinned to CPU %d", busy_poll_cpu);
+        printf("\n");
+    }
+    if (timestamping){
+        rudp_enable_timestamps(conn, sock, peer_type);
+    }
+    if (trace_path != NULL){
+        conn->trace = rudp_trace_create(RUDP_TRACE_DEFAULT_EVENTS, peer_type);
+        if (conn->trace == NULL){
+            fprintf(stderr, "ERROR: Failed to allocate memory for the trace, tracing is off!\n");
+        }
+    }
+    connections[sock] = conn;
+
     // if peer_type is SERVER - this is a server that needs binding
     if (peer_type == SERVER) {
         if (bind(sock, (struct sockaddr *)server_address, sizeof(*server_address)) == -1){
@@ -129,126 +291,655 @@ int rudp_socket(struct sockaddr_in *server_address, int peer_type, uint16_t * se
         rudp_send_syn(sock, server_address, *seq_number);
         printf("SYN Sent.\n");
         printf("ACK-SYN Received.\n");
+        // the server's ACK tells us which of our capabilities it accepted
+        conn->capabilities = requested_capabilities & conn->peer_capabilities;
+        if (conn->stripes < 2)
+            conn->capabilities &= ~RUDP_CAP_STRIPES;
     } else if (peer_type == SERVER) {
         struct sockaddr_in client_addr;
         // wait for SYN from client
-        *seq_number = rudp_recv_syn(sock, &client_addr);
+        *seq_number = rudp_recv_syn(sock, &client_addr);      // accepts the client's capabilities
         printf("SYN Received.\n");
         printf("ACK-SYN Sent.\n");
     }
     *seq_number += 1;
+    if (conn->capabilities & RUDP_CAP_COMPRESSION){
+        printf("Compression enabled.\n");
+    }
+    if (conn->capabilities & RUDP_CAP_BULK){
+        if (peer_type == CLIENT){
+            printf("Bulk transfers enabled, paced at up to %.2fMB/s.\n", bulk_rate / (float)MB);
+            if (conn->capabilities & RUDP_CAP_STRIPES)
+                printf("Bulk transfers striped over %d UDP flows.\n", conn->stripes);
+        }
+        else {
+            printf("Bulk transfers enabled.\n");
+            if (conn->capabilities & RUDP_CAP_STRIPES)
+                printf("Bulk transfers striped over %d UDP flows.\n", conn->stripes);
+            if (autotune){
+                // a paced round arrives without waiting for us - the buffer absorbs our scheduling hiccups
+                int limited = 0;
+                int rcvbuf = 0;
+                for (int s = 0; s < conn->stripes; s++)
+                    rcvbuf = tune_socket_buffer(conn->stripe_socks[s], SO_RCVBUF, RUDP_BULK_RCVBUF, &limited);
+                if (rcvbuf > 0)
+                    printf("Tuning: SO_RCVBUF=%dKB for bulk transfers%s\n", rcvbuf / 1024, limited ? " (capped by the system limit)" : "");
+            }
+        }
+    }
     printf("Handshake completed!\n");
     return sock;
 }
 
 int rudp_send(int sock_id, void *data, size_t data_size, int flags, struct sockaddr_in *to, uint16_t* seq_number)
 {
-    int chunk_size, remaining_bytes;
-    int total_bytes_sent = 0, bytes_sent;
+    struct iovec iov = {data, data_size};
+    return rudp_sendv(sock_id, &iov, 1, flags, to, seq_number);
+}
+
+ssize_t rudp_sendv(int sock_id, const struct iovec *iov, int iovcnt, int flags, struct sockaddr_in *to, uint16_t* seq_number)
+{
+    rudp_stream_data stream = {RUDP_DEFAULT_STREAM, iov, iovcnt};
+    return rudp_send_streams(sock_id, &stream, 1, to, seq_number);
+}
 
-    while (total_bytes_sent < data_size){
-        // // calculate chunk size
-        remaining_bytes = data_size-total_bytes_sent;
+ssize_t rudp_send_streams(int sock_id, const rudp_stream_data *streams, int count, struct sockaddr_in *to, uint16_t *seq_number)
+{
+    rudp_connection *conn = connections[sock_id];
+    rudp_packet *in_flight[RUDP_MAX_WINDOW] = {NULL};     // sent and not yet acknowledged, indexed by seq % RUDP_MAX_WINDOW
+    uint64_t first_sent[RUDP_MAX_WINDOW];       // send time of every packet in flight, for the latency histograms
+    char resent[RUDP_MAX_WINDOW];               // the packet was sent more than once - its ACK is no RTT sample
+    uint16_t base = *seq_number;        // oldest unacknowledged packet
+    size_t chunk_size, remaining_bytes;
+    size_t data_size = 0, total_bytes_sent = 0;
+    size_t stream_size[RUDP_MAX_STREAMS], stream_sent[RUDP_MAX_STREAMS];       // indexed like streams
+    int next_stream = 0;        // the streams take turns, a packet each
+    char scratch[RUDP_MAX_CHUNK_SIZE];      // for chunks that span two buffers
+    int tries = 0;      // count num of resends of the oldest packet
+    int dup_acks = 0;   // ACKs in a row that acknowledged nothing new - the receiver is still missing the oldest packet
+    uint64_t timer = 0; // when the retransmission timer of the oldest packet started
+    int compressing = conn->capabilities & RUDP_CAP_COMPRESSION;
+    size_t compress_chunk = RUDP_MAX_CHUNK_SIZE;       // shrinks to a single packet while the data doesn't compress
+    uint64_t started = rudp_now_usec();
+
+    if (count < 1 || count > RUDP_MAX_STREAMS){
+        return -1;
+    }
+    for (int s = 0; s < count; s++){
+        for (int other = 0; other < s; other++){
+            if (streams[other].stream == streams[s].stream){
+                return -1;      // its pieces would be interleaved
+            }
+        }
+        stream_size[s] = 0;
+        stream_sent[s] = 0;
+        for (int i = 0; i < streams[s].iovcnt; i++){
+            stream_size[s] += streams[s].iov[i].iov_len;
+        }
+        data_size += stream_size[s];
+    }
 
-        #ifdef _DEBUG
-        printf("Remaining to send: %d\n", remaining_bytes);
-        #endif
+    while (total_bytes_sent < data_size || base != *seq_number){
+        // send new chunks as long as both our window and the receiver's window allow it
+        int usable_window = min(conn->send_window, conn->peer_window);
+        while (total_bytes_sent < data_size && (uint16_t)(*seq_number - base) < usable_window){
+            // the next stream with data left
+            while (stream_sent[next_stream] == stream_size[next_stream])
+                next_stream = (next_stream + 1) % count;
+            int current = next_stream;
+            const rudp_stream_data *stream = &streams[current];
+            next_stream = (next_stream + 1) % count;
+
+            // calculate chunk size
+            remaining_bytes = stream_size[current] - stream_sent[current];
+
+            // spliting large size data into chunks that fit the data size of a packet
+            chunk_size = min(remaining_bytes, (size_t) conn->data_size_limit);
+
+            rudp_packet* packet = NULL;
+            if (compressing){
+                // try to fit a bigger chunk into one packet, fall back to a raw packet if it doesn't shrink
+                size_t raw_size = min(remaining_bytes, compress_chunk);
+                char *chunk = iov_gather(stream->iov, stream->iovcnt, stream_sent[current], raw_size, scratch);
+                packet = create_compressed_packet(chunk, &raw_size, conn->data_size_limit, *seq_number);
+                if (packet != NULL){
+                    chunk_size = raw_size;
+                }
+                compress_chunk = packet != NULL ? RUDP_MAX_CHUNK_SIZE : (size_t) conn->data_size_limit;
+            }
+            if (packet == NULL){
+                // create an RUDP simple packet (with current data chunk - the stream's sent bytes act as a pointer)
+                packet = create_packet(iov_gather(stream->iov, stream->iovcnt, stream_sent[current], chunk_size, scratch), chunk_size, *seq_number);
+            }
+            if (packet == NULL){
+                close(sock_id);
+                exit(FAIL);
+            }
+            uint64_t *offset = stream->stream == RUDP_DEFAULT_STREAM ? &conn->send_offset : &conn->stream_send_offset[stream->stream];
+            packet->header.offset = (uint32_t) *offset;
+            packet->header.stream = stream->stream;
+            *offset += chunk_size;
+
+            if (*seq_number == base)
+                timer = rudp_now_usec();
+            rudp_transmit(packet, sock_id, to, 1);
+            in_flight[*seq_number % RUDP_MAX_WINDOW] = packet;
+            first_sent[*seq_number % RUDP_MAX_WINDOW] = rudp_now_usec();
+            resent[*seq_number % RUDP_MAX_WINDOW] = 0;
+
+            total_bytes_sent += chunk_size;
+            stream_sent[current] += chunk_size;
+            *seq_number += 1;
+            histogram_record(&conn->stats.packet_data, chunk_size);
+            if (packet_sizing && ++conn->sizing_packets >= RUDP_SIZING_INTERVAL){
+                rudp_adapt_packet_size(conn);
+            }
+        }
 
-        // spliting large size data into chunks that fit the maximum allowed data size for RUDP
-        chunk_size = remaining_bytes < RUDP_MAX_DATA_SIZE ? remaining_bytes : RUDP_MAX_DATA_SIZE; // -1 for '\0'
-        
-        // create an RUDP simple packet (with current data chunk - total_bytes_sent acts as a pointer)
-        rudp_packet* packet = create_packet(data+total_bytes_sent, chunk_size, *seq_number);
+        if (base == *seq_number){
+            // nothing is in flight but there is more to send - the receiver's window is closed
+            rudp_probe_window(conn, sock_id, to, base);
+            continue;
+        }
 
-        // send chunk
-        bytes_sent = rudp_send_packet(packet, sock_id, to);     // actual bytes - data witout header
+        // optimize loss
+        loss_optimization();
+
+        // Wait for an ACK of the packets in flight - until the oldest one's timer runs out, whatever arrives meanwhile
+        uint64_t now = rudp_now_usec();
+        uint64_t expires = timer + rudp_rto(conn, tries);
+        int ready = now >= expires ? 0 : rudp_wait_readable(sock_id, (expires - now) / 1000000, (expires - now) % 1000000);
+        if (ready == 0){
+            // Timeout occurred - resend the oldest packet, the receiver keeps the ones after it
+            tries++;
+            conn->stats.timeouts++;
+            trace_packet(conn, RUDP_TRACE_TIMEOUT, in_flight[base % RUDP_MAX_WINDOW], tries);
+            if (tries >= MAX_RETRIES){
+                fprintf(stderr, "ERROR! Exceeded max retries to send packet! exiting...\n");
+                close(sock_id);
+                exit(FAIL);
+            }
+            rudp_transmit(in_flight[base % RUDP_MAX_WINDOW], sock_id, to, tries + 1);
+            resent[base % RUDP_MAX_WINDOW] = 1;
+            timer = rudp_now_usec();
+            dup_acks = 0;
+            continue;
+        }
 
-        #ifdef _DEBUG
-        printf("Bytes sent: %d\n", bytes_sent);
-        #endif
+        // ACKs are cumulative - the ack number is the next packet the receiver is waiting for
+        int ack = rudp_recv_ack(sock_id, to);
+        if (ack != -1 && (uint16_t)(ack - base) == 0 && ++dup_acks >= RUDP_DUP_ACKS
+            && (!resent[base % RUDP_MAX_WINDOW] || rudp_now_usec() - timer >= conn->srtt_usec)){
+            // packets after the oldest one keep arriving without it - it was lost, resend it without waiting for
+            // its timer (fast retransmit). Again only if they keep arriving an RTT after the last resend - the copy was lost too
+            conn->stats.fast_retransmits++;
+            rudp_transmit(in_flight[base % RUDP_MAX_WINDOW], sock_id, to, tries + 2);
+            resent[base % RUDP_MAX_WINDOW] = 1;
+            timer = rudp_now_usec();
+            dup_acks = 0;
+            continue;
+        }
+        if (ack == -1 || (uint16_t)(ack - base) == 0 || (uint16_t)(ack - base) > (uint16_t)(*seq_number - base)){
+            // stale or duplicate ACK - keep waiting
+            continue;
+        }
 
-        total_bytes_sent += bytes_sent;
-        *seq_number += 1;
+        if (tries + 1 > conn->stats.max_tries)
+            conn->stats.max_tries = tries + 1;
+        tries = 0;
+        dup_acks = 0;
+        now = rudp_now_usec();
+        // the ACK was sent right after the newest packet it covers arrived - that packet gives the RTT,
+        // unless a resent packet held the ACK back (or it's unknown which copy was acknowledged)
+        uint16_t newest = (uint16_t)(ack - 1) % RUDP_MAX_WINDOW;
+        int rtt_sample = 1;
+        if (conn->srtt_usec == 0 && resent[base % RUDP_MAX_WINDOW]){
+            // no estimate yet - under heavy loss every ACK may be held back by a resent packet, and Karn's rule would
+            // keep the timer at RUDP_INITIAL_RTO_USEC for good. The resend of the oldest packet (the timer started
+            // with it) is most likely the copy that arrived
+            histogram_record(&conn->stats.rtt, now - timer);
+            rudp_rtt_update(conn, now - timer);
+        }
+        timer = now;
+        while (base != (uint16_t)ack){
+            histogram_record(&conn->stats.delivery, now - first_sent[base % RUDP_MAX_WINDOW]);
+            if (resent[base % RUDP_MAX_WINDOW])
+                rtt_sample = 0;
+            free(in_flight[base % RUDP_MAX_WINDOW]);
+            in_flight[base % RUDP_MAX_WINDOW] = NULL;
+            base++;
+        }
+        if (rtt_sample){
+            uint64_t rtt = rudp_kernel_rtt(conn, sock_id, (uint16_t)(ack - 1));
+            if (rtt == 0)
+                rtt = now - first_sent[newest];
+            histogram_record(&conn->stats.rtt, rtt);
+            rudp_rtt_update(conn, rtt);
+        }
+    }
+
+    // the first transfer that is long enough to measure the rate sizes the window for the next ones
+    if (autotune && !conn->tuned && total_bytes_sent >= (size_t) RUDP_MAX_WINDOW * RUDP_MAX_DATA_SIZE){
+        rudp_autotune(conn, sock_id, total_bytes_sent, rudp_now_usec() - started);
     }
 
     return total_bytes_sent;
 }
 
 int rudp_recv(int sock, void * data, size_t data_size, struct sockaddr_in *client_addr, uint16_t* seq){
-    rudp_packet* packet = (rudp_packet *) malloc (sizeof(rudp_packet));
+    rudp_connection *conn = connections[sock];
+    rudp_packet* packet = NULL;
+
+    // the packet we are waiting for may have already arrived out of order
+    packet = conn->reassembly[*seq % RUDP_REASSEMBLY_SLOTS];
+    if (packet != NULL && packet->header.seq_ack_number == *seq){
+        conn->reassembly[*seq % RUDP_REASSEMBLY_SLOTS] = NULL;
+        conn->reassembly_used--;
+    }
+    else {
+        packet = (rudp_packet *) malloc (sizeof(rudp_packet));
+        if (packet == NULL){
+            fprintf(stderr, "ERROR: Failed to allocate memory for the packet!\n");
+            return 0;
+        }
+
+        // keep packets that arrive ahead of a lost packet until the gap is filled
+        while (rudp_recv_data_packet(conn, sock, packet, client_addr, *seq) != 0){
+            rudp_keep_packet(conn, packet);
+            rudp_send_ack(sock, client_addr, rudp_next_expected(conn, *seq));
+        }
+
+        // acknowledge this packet and every packet after it that is waiting in the reassembly buffer
+        rudp_send_ack(sock, client_addr, rudp_next_expected(conn, *seq + 1));
+    }
+    *seq += 1;
+    // remembered so rudp_close() can acknowledge resent packets
+    conn->peer_addr = *client_addr;
+    conn->next_seq = *seq;
+    conn->has_peer = 1;
+    uint64_t offset = rudp_packet_offset(conn, packet);
+
+    int length = rudp_copy_packet(packet, data, data_size);
+    if (length == -1){
+        fprintf(stderr, "ERROR: Failed to decompress a packet (or the buffer is too small)!\n");
+        free(packet);
+        return 0;
+    }
+    data_size = length;
+    conn->next_offset = offset + data_size;
+
+    // Received and send ack -> free packet
+    free(packet);
+    
+    return data_size;
+}
 
+ssize_t rudp_recv_direct(int sock, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq){
+    rudp_connection *conn = connections[sock];
+    uint64_t start = conn->next_offset, end = start + data_size;
+    rudp_packet *packet = (rudp_packet *) malloc (sizeof(rudp_packet));
     if (packet == NULL){
         fprintf(stderr, "ERROR: Failed to allocate memory for the packet!\n");
-        return 0;
+        return -1;
     }
-    socklen_t len = sizeof(struct sockaddr_in);
 
-    do{
-        int bytes = recvfrom(sock, packet, sizeof(*packet), 0, (struct sockaddr *) client_addr, &len);
+    while (conn->next_offset < end){
+        uint16_t slot = *seq % RUDP_REASSEMBLY_SLOTS;
+        int length = -1;
 
-        if (bytes <= -1){
-            perror("recv");
-            close(sock);
-            exit(FAIL);
+        // the packet we are waiting for may be in place already, or kept from before this call
+        if (conn->placed[slot] && conn->placed_seq[slot] == *seq){
+            conn->placed[slot] = 0;
+            conn->reassembly_used--;
+            length = conn->placed_length[slot];
         }
-        else if (bytes == 0){
-            printf("Connection was closed prior to receiving the data4!\n");
-            close(sock);
-            exit(FAIL);
+        else if (conn->reassembly[slot] != NULL && conn->reassembly[slot]->header.seq_ack_number == *seq){
+            length = rudp_place_packet(conn, conn->reassembly[slot], data, start, end);
+            if (length == -1){
+                break;      // doesn't fit the buffer - left for rudp_recv()
+            }
+            free(conn->reassembly[slot]);
+            conn->reassembly[slot] = NULL;
+            conn->reassembly_used--;
+        }
+        if (length != -1){
+            *seq += 1;
+            conn->next_offset += length;
+            continue;
         }
 
-        #ifdef _DEBUG
-        char* type = get_packet_type(packet);
-        printf("Received %spacket, SEQ: %d\n", type, packet->header.seq_ack_number);
-        if(packet->header.checksum != calculate_checksum(packet->data, sizeof(packet->data))){
-            printf("Checksum doesn't match: Received: %d, Calculated: %d\n", packet->header.checksum, calculate_checksum(packet->data, sizeof(packet->data)));
+        uint16_t distance = rudp_recv_data_packet(conn, sock, packet, client_addr, *seq);
+        length = rudp_place_packet(conn, packet, data, start, end);
+        if (length != -1){
+            // copied to its final place - only its length is kept until the packets before it arrive
+            slot = packet->header.seq_ack_number % RUDP_REASSEMBLY_SLOTS;
+            conn->placed[slot] = 1;
+            conn->placed_seq[slot] = packet->header.seq_ack_number;
+            conn->placed_length[slot] = length;
+            conn->reassembly_used++;
+            if (distance != 0)
+                conn->stats.out_of_order++;
         }
-        #endif
+        else if (rudp_keep_packet(conn, packet) == -1){
+            break;      // out of memory - the sender will resend it
+        }
+        rudp_send_ack(sock, client_addr, rudp_next_expected(conn, *seq));
+        if (length == -1 && distance == 0){
+            break;      // runs past the end of the buffer - left for rudp_recv()
+        }
+    }
+    free(packet);
+
+    // remembered so rudp_close() can acknowledge resent packets
+    conn->peer_addr = *client_addr;
+    conn->next_seq = *seq;
+    conn->has_peer = 1;
+    return conn->next_offset - start;
+}
 
-        // Send ACK after receiving only if received packet was not ACK
-        if (packet->header.flags.ack != 1){
-            rudp_send_ack(sock, client_addr, packet->header.seq_ack_number+1);
+ssize_t rudp_recv_stream(int sock, uint8_t *stream, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq){
+    rudp_connection *conn = connections[sock];
+    rudp_packet *packet = NULL;
+    uint16_t distance = 0;
+    int arrived = 0;        // the packet was just received (and is not acknowledged yet)
+
+    // a kept packet may have become the next one of its stream - the oldest first
+    for (uint16_t d = 0; d < RUDP_REASSEMBLY_SLOTS && packet == NULL; d++){
+        uint16_t slot = (uint16_t)(*seq + d) % RUDP_REASSEMBLY_SLOTS;
+        rudp_packet *kept = conn->reassembly[slot];
+        if (kept != NULL && kept->header.seq_ack_number == (uint16_t)(*seq + d) && rudp_stream_in_order(conn, kept)){
+            conn->reassembly[slot] = NULL;
+            conn->reassembly_used--;
+            packet = kept;
+            distance = d;
+        }
+    }
+    if (packet == NULL){
+        packet = (rudp_packet *) malloc (sizeof(rudp_packet));
+        if (packet == NULL){
+            fprintf(stderr, "ERROR: Failed to allocate memory for the packet!\n");
+            return -1;
+        }
+        // keep the packets that wait for an earlier packet of their own stream
+        while (1){
+            distance = rudp_recv_data_packet(conn, sock, packet, client_addr, *seq);
+            if (rudp_stream_in_order(conn, packet))
+                break;
+            rudp_keep_packet(conn, packet);
+            rudp_send_ack(sock, client_addr, rudp_next_expected(conn, *seq));
+        }
+        if (distance != 0)
+            conn->stats.out_of_order++;
+        arrived = 1;
+    }
+    int length = rudp_copy_packet(packet, data, data_size);
+    if (length == -1){
+        fprintf(stderr, "ERROR: Failed to decompress a packet (or the buffer is too small)!\n");
+        free(packet);
+        return -1;
+    }
+    *stream = packet->header.stream;
+    if (packet->header.stream == RUDP_DEFAULT_STREAM)
+        conn->next_offset += length;
+    else
+        conn->stream_next_offset[packet->header.stream] += length;
+
+    if (distance != 0){
+        // delivered ahead of the packets before it - only its place in the sequence is kept, until they arrive
+        uint16_t slot = packet->header.seq_ack_number % RUDP_REASSEMBLY_SLOTS;
+        conn->placed[slot] = 1;
+        conn->placed_seq[slot] = packet->header.seq_ack_number;
+        conn->placed_length[slot] = 0;
+        conn->reassembly_used++;
+    }
+    else {
+        *seq += 1;
+        // and the packets after it that were delivered already
+        uint16_t slot = *seq % RUDP_REASSEMBLY_SLOTS;
+        while (conn->placed[slot] && conn->placed_seq[slot] == *seq){
+            conn->placed[slot] = 0;
+            conn->reassembly_used--;
+            *seq += 1;
+            slot = *seq % RUDP_REASSEMBLY_SLOTS;
         }
-        if (*(int*)(packet->data) == 0){    // sender wants to end connection - wait to see if more packet arrive (maybe the ack is lost)
-            struct timeval timeout;
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;
+    }
+    if (arrived)
+        rudp_send_ack(sock, client_addr, rudp_next_expected(conn, *seq));
+    free(packet);
 
-            fd_set read_fds;
-            FD_ZERO(&read_fds);
-            FD_SET(sock, &read_fds);
+    // remembered so rudp_close() can acknowledge resent packets
+    conn->peer_addr = *client_addr;
+    conn->next_seq = *seq;
+    conn->has_peer = 1;
+    return length;
+}
 
-            int ready = select(sock + 1, &read_fds, NULL, NULL, &timeout);
-            if (ready == -1) {
-                perror("select");
-                close(sock);
-                exit(FAIL);
-            } else if (ready == 0) {
-                break;      // no more packets - connection will be closed
-            } else {
-                continue;       // recv again and resend ack
-            }
+ssize_t rudp_send_bulk(int sock_id, const void *data, size_t data_size, struct sockaddr_in *to, uint16_t *seq_number){
+    rudp_connection *conn = connections[sock_id];
+    if (!(conn->capabilities & RUDP_CAP_BULK)){
+        return rudp_send(sock_id, (void *) data, data_size, 0, to, seq_number);
+    }
+    // every round starts at the configured pace, and every round is a sequence number of its own
+    uint64_t rate = bulk_rate;
+    size_t sent = 0;
+    conn->stamp_sends = 0;
+    while (sent < data_size){
+        size_t round = min(data_size - sent, (size_t) RUDP_BULK_ROUND_SIZE);
+        if (rudp_send_round(conn, sock_id, (const char *) data + sent, round, to, *seq_number, &rate) == -1){
+            conn->stamp_sends = 1;
+            return -1;
         }
-        if ((packet->header.flags.syn != 1) && *seq == packet->header.seq_ack_number && (packet->header.checksum == calculate_checksum(packet->data, sizeof(packet->data)))){
-            break;
+        *seq_number += 1;
+        conn->send_offset += round;
+        sent += round;
+    }
+    conn->stamp_sends = 1;
+    return sent;
+}
+
+ssize_t rudp_recv_bulk(int sock, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq){
+    rudp_connection *conn = connections[sock];
+    if (!(conn->capabilities & RUDP_CAP_BULK)){
+        return rudp_recv_direct(sock, data, data_size, client_addr, seq);
+    }
+    size_t received = 0;
+    while (received < data_size){
+        size_t round = min(data_size - received, (size_t) RUDP_BULK_ROUND_SIZE);
+        if (rudp_recv_round(conn, sock, (char *) data + received, round, client_addr, *seq) == -1){
+            return -1;
         }
-        // else // if by accident a syn was given -OR- seq doesnt match -OR- checksum doesnt match === wrong packet, ignore it and keep receiving
-    } while (1);
-    *seq += 1;
+        *seq += 1;
+        conn->next_offset += round;
+        received += round;
+    }
 
-    data_size = packet->header.length;
+    // remembered so rudp_close() can acknowledge resent packets
+    conn->peer_addr = *client_addr;
+    conn->next_seq = *seq;
+    conn->has_peer = 1;
+    return received;
+}
 
-    if (data != NULL){
-        memcpy(data, packet->data, data_size);
+int rudp_get_capabilities(int sock){
+    if (sock < 0 || sock >= FD_SETSIZE || connections[sock] == NULL){
+        return -1;
     }
+    return connections[sock]->capabilities;
+}
 
-    // Received and send ack -> free packet
-    free(packet);
-    
-    return data_size;
+void rudp_set_bulk(uint64_t rate){
+    bulk_rate = rate;
+    if (rate > 0)
+        requested_capabilities |= RUDP_CAP_BULK;
+    else
+        requested_capabilities &= ~RUDP_CAP_BULK;
+}
+
+int rudp_set_busy_poll(uint64_t budget_usec, int cpu){
+    if (budget_usec > RUDP_BUSY_POLL_MAX_USEC){
+        return -1;
+    }
+    busy_poll_usec = budget_usec;
+    busy_poll_cpu = cpu;
+    return 0;
+}
+
+void rudp_set_timestamping(int enable){
+    timestamping = enable;
+}
+
+int rudp_set_stripes(int count){
+    if (count < 1 || count > RUDP_MAX_STRIPES){
+        return -1;
+    }
+    requested_stripes = count;
+    if (count > 1)
+        requested_capabilities |= RUDP_CAP_STRIPES;
+    else
+        requested_capabilities &= ~RUDP_CAP_STRIPES;
+    return 0;
+}
+
+void rudp_set_compression(int enable){
+    if (enable)
+        requested_capabilities |= RUDP_CAP_COMPRESSION;
+    else
+        requested_capabilities &= ~RUDP_CAP_COMPRESSION;
+}
+
+int rudp_set_impairment(const char *spec){
+    if (impairment != NULL){
+        impair_report(impairment);
+        impair_destroy(impairment);
+        impairment = NULL;
+    }
+    if (spec == NULL){
+        return 0;
+    }
+    impairment = impair_create(spec, sendto);
+    if (impairment == NULL){
+        return -1;
+    }
+    printf("Network impairments: %s\n", spec);
+    return 0;
+}
+
+void rudp_set_trace(const char *path){
+    free(trace_path);
+    trace_path = path != NULL ? strdup(path) : NULL;
+}
+
+void rudp_set_autotune(int enable){
+    autotune = enable;
+}
+
+void rudp_set_packet_sizing(int enable){
+    packet_sizing = enable;
+}
+
+int rudp_set_send_window(int sock, int packets){
+    if (sock < 0 || sock >= FD_SETSIZE || connections[sock] == NULL || packets < 1 || packets > RUDP_MAX_WINDOW){
+        return -1;
+    }
+    connections[sock]->send_window = packets;
+    return 0;
+}
+
+void rudp_set_io(const rudp_io *new_io){
+    if (new_io != NULL){
+        io = *new_io;
+    }
+    else {
+        io.sendto = sendto;
+        io.recvfrom = recvfrom;
+        io.wait_readable = NULL;
+        io.now_usec = NULL;
+    }
+    packets_sent = 0;
+    packets_resent = 0;
+}
+
+int rudp_get_stats(int sock, rudp_stats *stats){
+    if (sock < 0 || sock >= FD_SETSIZE || connections[sock] == NULL){
+        return -1;
+    }
+    *stats = connections[sock]->stats;
+    stats->rto_usec = rudp_rto(connections[sock], 0);
+    return 0;
+}
+
+int rudp_get_progress(int sock, rudp_progress *progress){
+    if (sock < 0 || sock >= FD_SETSIZE || connections[sock] == NULL){
+        return -1;
+    }
+    // added to atomically by the receiving threads as they go - each counter is read whole, not all at the same instant
+    rudp_stats *stats = &connections[sock]->stats;
+    progress->data_received = __atomic_load_n(&stats->data_received, __ATOMIC_RELAXED);
+    progress->resent = __atomic_load_n(&stats->gaps_filled, __ATOMIC_RELAXED) + __atomic_load_n(&stats->duplicates, __ATOMIC_RELAXED);
+    progress->gaps = __atomic_load_n(&stats->gaps, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void rudp_print_stats(const rudp_stats *stats){
+    printf("Packets sent: %llu (%llu bytes), retransmits: %llu (%llu fast), timeouts: %llu, ACKs sent: %llu, NAKs sent: %llu\n",
+           (unsigned long long)stats->packets_sent, (unsigned long long)stats->bytes_sent,
+           (unsigned long long)stats->retransmits, (unsigned long long)stats->fast_retransmits, (unsigned long long)stats->timeouts,
+           (unsigned long long)stats->acks_sent, (unsigned long long)stats->naks_sent);
+    printf("Packets received: %llu (%llu bytes), ACKs received: %llu, NAKs received: %llu, duplicates: %llu, out of order: %llu, bad checksum: %llu\n",
+           (unsigned long long)stats->packets_received, (unsigned long long)stats->bytes_received,
+           (unsigned long long)stats->acks_received, (unsigned long long)stats->naks_received, (unsigned long long)stats->duplicates,
+           (unsigned long long)stats->out_of_order, (unsigned long long)stats->checksum_failures);
+    if (stats->data_received > 0)
+        printf("Data received: %llu bytes, gaps: %llu, gaps filled: %llu\n", (unsigned long long)stats->data_received,
+               (unsigned long long)stats->gaps, (unsigned long long)stats->gaps_filled);
+    printf("Max tries: %d, retransmission timeout: %lluus, packet resizes: %llu", stats->max_tries,
+           (unsigned long long)stats->rto_usec, (unsigned long long)stats->resizes);
+    if (stats->kernel_rtt_samples > 0)
+        printf(", RTT samples from kernel timestamps: %llu", (unsigned long long)stats->kernel_rtt_samples);
+    if (stats->hardware_rtt_samples > 0)
+        printf(" (%llu from the NIC's)", (unsigned long long)stats->hardware_rtt_samples);
+    printf("\n");
+    histogram_print(&stats->rtt, "RTT", "usec");
+    histogram_print(&stats->delivery, "Delivery latency", "usec");
+    histogram_print(&stats->packet_data, "Packet data", "bytes");
+    if (stats->wakeup.count > 0)
+        histogram_print(&stats->wakeup, "Receive wakeup", "usec");
 }
 
 void rudp_close(int sock){
+    rudp_connection *conn = connections[sock];
+    if (conn != NULL && conn->has_peer){
+        // The sender may not have received our last ACK - wait to see if more packets arrive and acknowledge them again
+        rudp_packet duplicate;
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        while (rudp_wait_readable(sock, 1, 0) > 0){
+            int bytes = io.recvfrom(sock, &duplicate, sizeof(duplicate), 0, (struct sockaddr *) &from, &len);
+            rudp_pad_packet(&duplicate, bytes);
+            if (bytes > 0 && duplicate.header.flags.ack != 1){
+                trace_packet(conn, RUDP_TRACE_RECEIVED, &duplicate, 0);
+                trace_packet(conn, RUDP_TRACE_DROP, &duplicate, RUDP_TRACE_DROP_DUPLICATE);
+                rudp_send_ack(sock, &conn->peer_addr, rudp_next_expected(conn, conn->next_seq));
+            }
+        }
+    }
+    if (conn != NULL){
+        for (int s = 1; s < conn->stripes; s++){
+            connections[conn->stripe_socks[s]] = NULL;
+            close(conn->stripe_socks[s]);
+        }
+        for (int i = 0; i < RUDP_REASSEMBLY_SLOTS; i++){
+            free(conn->reassembly[i]);
+        }
+        if (conn->trace != NULL){
+            if (rudp_trace_write(conn->trace, trace_path) == -1){
+                perror("trace");
+            }
+            rudp_trace_destroy(conn->trace);
+        }
+        free(conn);
+        connections[sock] = NULL;
+    }
     close(sock);
 }
 
@@ -256,71 +947,47 @@ void rudp_close(int sock){
  * Helepr Functions
 */
 int rudp_send_packet(rudp_packet* packet, int sock_id, struct sockaddr_in *to) {
+    rudp_connection *conn = connections[sock_id];
     int bytes_sent;
     int tries = 0;      // count num of tries to get an ack packet back
+    uint64_t sent_at = 0;
 
     // Send packet
     do {    // while ACK not received or timed out
-        packets_sent++;
-        #ifdef _DEBUG
-        printf("Try #%d\n", tries+1);
-        #endif
-
         tries++;
-        bytes_sent = sendto(sock_id, packet, sizeof(*packet), 0, (struct sockaddr *) to, sizeof(*to));
-        if (bytes_sent == -1) {
-            perror("sendto");
-            close(sock_id);
-            exit(FAIL);
-        } else if (bytes_sent == 0) {
-            printf("Connection was closed prior to sending the data!\n");
-            close(sock_id);
-            exit(FAIL);
-        }
+        sent_at = rudp_now_usec();
+        rudp_transmit(packet, sock_id, to, tries);
         bytes_sent = packet->header.length;     // actual data size
 
         // optimize loss
-        float packet_loss = loss_optimization(); 
-
-        #ifdef _DEBUG
-        char* type = get_packet_type(packet);
-        printf("Sending %spacket, SEQ: %d\n", type, packet->header.seq_ack_number);
-        printf("Packet loss; %f\n", packet_loss);
-        #endif
+        loss_optimization();
 
         // Wait for new packet - ACK if sent packet was data or SYN, and data if sent packet was ACK
         if (packet->header.flags.ack != 1) {   
             // Check if ACK received
-            struct timeval timeout;
-            timeout.tv_sec = TIMEOUT_SEC;
-            timeout.tv_usec = TIMEOUT_USEC;
-
-            fd_set read_fds;
-            FD_ZERO(&read_fds);
-            FD_SET(sock_id, &read_fds);
-
-            int ready = select(sock_id + 1, &read_fds, NULL, NULL, &timeout);
-            if (ready == -1) {
-                perror("select");
-                close(sock_id);
-                exit(FAIL);
-            } else if (ready == 0) {
+            uint64_t rto = rudp_rto(conn, tries - 1);
+            int ready = rudp_wait_readable(sock_id, rto / 1000000, rto % 1000000);
+            if (ready == 0) {
                 // Timeout occurred
-                #ifdef _DEBUG
-                printf("Timeout occurred while waiting for acknowledgment, resending packet\n");
-                #endif
+                if (conn != NULL)
+                    conn->stats.timeouts++;
+                trace_packet(conn, RUDP_TRACE_TIMEOUT, packet, tries);
                 continue;       // resend
             } else {
                 // Check ACK received
                 int seq = rudp_recv_ack(sock_id, to);
                 if (seq == -1 || seq != packet->header.seq_ack_number+1) {
                     // ack doesnt match seq
-                    #ifdef _DEBUG
-                    printf("ACK doesn't match SEQ, resending...\n");
-                    #endif
                     continue;   // resend
                 } else {
                     // a good ACK was received
+                    if (conn != NULL && tries == 1){
+                        uint64_t rtt = rudp_kernel_rtt(conn, sock_id, packet->header.seq_ack_number);
+                        if (rtt == 0)
+                            rtt = rudp_now_usec() - sent_at;
+                        histogram_record(&conn->stats.rtt, rtt);
+                        rudp_rtt_update(conn, rtt);
+                    }
                     break;
                 }
             }
@@ -328,10 +995,10 @@ int rudp_send_packet(rudp_packet* packet, int sock_id, struct sockaddr_in *to) {
         else{
             break;
         }
-    } while (tries < MAX_RETRIES || packet->header.length == 4);     // Resend if ACK was not received. Only if this packet is not an ACK
+    } while (tries < MAX_RETRIES);     // Resend if ACK was not received. Only if this packet is not an ACK
 
-    if (tries > max_tries)
-        max_tries = tries;
+    if (conn != NULL && tries > conn->stats.max_tries)
+        conn->stats.max_tries = tries;
     if (tries == MAX_RETRIES){
         fprintf(stderr, "ERROR! Exceeded max retries to send packet! exiting...\n");
         close(sock_id);
@@ -344,21 +1011,560 @@ int rudp_send_packet(rudp_packet* packet, int sock_id, struct sockaddr_in *to) {
     return bytes_sent;
 }
 
+// sends a single packet as is - no waiting for an ACK. try_number is 1 for the first send of the packet
+void rudp_transmit(rudp_packet* packet, int sock_id, struct sockaddr_in *to, int try_number) {
+    if (packet->header.flags.ack != 1){
+        if (try_number > 1)
+            packets_resent++;
+        else
+            packets_sent++;
+    }
+    rudp_connection *conn = connections[sock_id];
+    if (conn != NULL){
+        conn->stats.packets_sent++;
+        conn->stats.bytes_sent += RUDP_WIRE_SIZE(packet);
+        if (packet->header.flags.ack == 1 && packet->header.flags.eak == 1)
+            conn->stats.naks_sent++;
+        else if (packet->header.flags.ack == 1)
+            conn->stats.acks_sent++;
+        if (try_number > 1)
+            conn->stats.retransmits++;
+        trace_packet(conn, try_number > 1 ? RUDP_TRACE_RETRANSMIT : RUDP_TRACE_SENT, packet, try_number);
+    }
+    int stamped = conn != NULL && conn->timestamping && conn->stamp_sends && packet->header.flags.ack != 1;
+    if (stamped){
+        // our own stamp, until the kernel's arrives
+        uint16_t slot = packet->header.seq_ack_number % RUDP_MAX_WINDOW;
+        conn->tx_seq[slot] = packet->header.seq_ack_number;
+        conn->tx_software[slot] = rudp_realtime_usec();
+        conn->tx_hardware[slot] = 0;
+    }
+    int bytes_sent;
+    if (impairment != NULL)
+        bytes_sent = impair_sendto(impairment, sock_id, packet, RUDP_WIRE_SIZE(packet), 0, (struct sockaddr *) to, sizeof(*to));
+    else if (stamped && (conn->timestamping & SOF_TIMESTAMPING_OPT_ID) && sock_id == conn->stripe_socks[0])
+        bytes_sent = rudp_sendto_stamped(conn, sock_id, packet, to);
+    else
+        bytes_sent = io.sendto(sock_id, packet, RUDP_WIRE_SIZE(packet), 0, (struct sockaddr *) to, sizeof(*to));
+    if (bytes_sent == -1) {
+        perror("sendto");
+        close(sock_id);
+        exit(FAIL);
+    } else if (bytes_sent == 0) {
+        printf("Connection was closed prior to sending the data!\n");
+        close(sock_id);
+        exit(FAIL);
+    }
+}
+
+// returns 1 if there is a packet waiting to be received, 0 on timeout
+int rudp_wait_readable(int sock, int timeout_sec, int timeout_usec) {
+    if (io.wait_readable != NULL){
+        return io.wait_readable(sock, (uint64_t) timeout_sec * 1000000 + timeout_usec);
+    }
+    if (busy_poll_usec > 0){
+        // spin first, and only sleep for what is left of the timeout
+        uint64_t timeout = (uint64_t) timeout_sec * 1000000 + timeout_usec;
+        uint64_t started = rudp_now_usec();
+        if (rudp_busy_poll(sock, min(timeout, busy_poll_usec)))
+            return 1;
+        uint64_t spent = rudp_now_usec() - started;
+        if (spent >= timeout)
+            return 0;
+        timeout_sec = (timeout - spent) / 1000000;
+        timeout_usec = (timeout - spent) % 1000000;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = timeout_sec;
+    timeout.tv_usec = timeout_usec;
+
+    fd_set read_fds;
+    int ready;
+    rudp_connection *conn = connections[sock];
+    for (;;){
+        FD_ZERO(&read_fds);
+        FD_SET(sock, &read_fds);
+
+        ready = select(sock + 1, &read_fds, NULL, NULL, &timeout);
+        if (ready == -1) {
+            perror("select");
+            close(sock);
+            exit(FAIL);
+        }
+        if (ready == 0 || conn == NULL || !(conn->timestamping & SOF_TIMESTAMPING_OPT_ID)){
+            break;
+        }
+        // transmit timestamps wake select() up too - read them, and if no packet came with them, wait
+        // for what is left of the timeout (Linux's select() leaves it in timeout)
+        rudp_read_tx_stamps(conn, sock);
+        char byte;
+        if (recv(sock, &byte, sizeof byte, MSG_PEEK | MSG_DONTWAIT) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+            break;
+        }
+        if (timeout.tv_sec == 0 && timeout.tv_usec == 0){
+            ready = 0;
+            break;
+        }
+    }
+    return ready;
+}
+
+// Spins until a packet is waiting to be received, for up to budget_usec. returns 1 if one is, 0 if the budget ran out
+int rudp_busy_poll(int sock, uint64_t budget_usec) {
+    uint64_t deadline = rudp_now_usec() + budget_usec;
+    char byte;
+    do {
+        // peeking leaves the datagram for the real receive - a receive error is left for it too
+        if (recv(sock, &byte, sizeof byte, MSG_PEEK | MSG_DONTWAIT) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return 1;
+    } while (rudp_now_usec() < deadline);
+    return 0;
+}
+
+uint64_t rudp_now_usec() {
+    if (io.now_usec != NULL){
+        return io.now_usec();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// the clock of the kernel's software timestamps
+uint64_t rudp_realtime_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Asks the kernel to stamp the socket's packets (rudp_set_timestamping()) - the NIC's stamps too, if the kernel takes the flags.
+// They only arrive from a NIC whose timestamping was turned on (SIOCSHWTSTAMP), see rudp_hardware_stamp()
+void rudp_enable_timestamps(rudp_connection *conn, int sock, int peer_type) {
+    if (io.recvfrom != recvfrom || io.sendto != sendto){
+        return;     // no packet goes through the socket
+    }
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    // only a sender waits for the ACKs of its packets - and the simulator decides when (and if) they really leave.
+    // the sends themselves ask for their stamps, see rudp_sendto_stamped()
+    int transmit = peer_type == CLIENT && impairment == NULL;
+    if (transmit)
+        flags |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    int hardware = flags | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &hardware, sizeof hardware) == 0){
+        conn->timestamping = hardware;
+    }
+    else if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags) == 0){
+        conn->timestamping = flags;
+    }
+    else {
+        perror("setsockopt(SO_TIMESTAMPING)");
+        printf("Timestamping: off, RTT samples come from our clock\n");
+        return;
+    }
+    printf("Timestamping: kernel %s timestamps\n", transmit ? "receive and transmit" : "receive");
+}
+
+// Reports the NIC's timestamps when its first one arrives - a socket takes the hardware flags either way
+void rudp_hardware_stamp(rudp_connection *conn) {
+    if (!conn->hardware_stamped){
+        conn->hardware_stamped = 1;
+        printf("Timestamping: the NIC stamps packets too\n");
+    }
+}
+
+// recvfrom() that also keeps the packet's kernel receive timestamps (and how long it waited for us), when the socket is stamped
+ssize_t rudp_recvfrom(int sock, void *buf, size_t len, struct sockaddr_in *from, socklen_t *from_len) {
+    rudp_connection *conn = connections[sock];
+    if (conn == NULL || !conn->timestamping){
+        return io.recvfrom(sock, buf, len, 0, (struct sockaddr *) from, from_len);
+    }
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_name = from;
+    msg.msg_namelen = from != NULL ? *from_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t bytes = recvmsg(sock, &msg, 0);
+    if (from != NULL)
+        *from_len = msg.msg_namelen;
+    conn->rx_software = 0;
+    conn->rx_hardware = 0;
+    if (bytes == -1){
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING){
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof stamps);
+            conn->rx_software = (uint64_t) stamps.ts[0].tv_sec * 1000000 + stamps.ts[0].tv_nsec / 1000;
+            conn->rx_hardware = (uint64_t) stamps.ts[2].tv_sec * 1000000 + stamps.ts[2].tv_nsec / 1000;
+        }
+    }
+    if (conn->rx_hardware > 0){
+        rudp_hardware_stamp(conn);
+    }
+    if (conn->rx_software > 0){
+        uint64_t now = rudp_realtime_usec();
+        uint64_t wakeup = now > conn->rx_software ? now - conn->rx_software : 0;
+        histogram_record(&conn->stats.wakeup, wakeup);
+        conn->wakeup_usec = (7 * conn->wakeup_usec + wakeup) / 8;
+    }
+    return bytes;
+}
+
+// Sends a packet and asks the kernel for its transmit timestamps, which come back on the error queue (rudp_read_tx_stamps())
+ssize_t rudp_sendto_stamped(rudp_connection *conn, int sock, rudp_packet *packet, struct sockaddr_in *to) {
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    memset(control, 0, sizeof control);
+    struct iovec iov = {packet, RUDP_WIRE_SIZE(packet)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_name = to;
+    msg.msg_namelen = sizeof(*to);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE;
+    memcpy(CMSG_DATA(cmsg), &flags, sizeof flags);
+
+    ssize_t bytes = sendmsg(sock, &msg, 0);
+    if (bytes > 0){
+        // the kernel numbers the stamped sends from 0, in the order they were made
+        conn->tx_key_seq[conn->tx_key % RUDP_TX_STAMP_KEYS] = packet->header.seq_ack_number;
+        conn->tx_key++;
+    }
+    return bytes;
+}
+
+// Reads the transmit timestamps waiting in the socket's error queue into the table of packets in flight
+void rudp_read_tx_stamps(rudp_connection *conn, int sock) {
+    if (!(conn->timestamping & SOF_TIMESTAMPING_OPT_ID)){
+        return;
+    }
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+    for (;;){
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1){
+            return;     // nothing left
+        }
+
+        struct scm_timestamping stamps;
+        int have_stamps = 0;
+        struct sock_extended_err error;
+        int have_error = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING){
+                memcpy(&stamps, CMSG_DATA(cmsg), sizeof stamps);
+                have_stamps = 1;
+            }
+            else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR){
+                memcpy(&error, CMSG_DATA(cmsg), sizeof error);
+                have_error = 1;
+            }
+        }
+        if (!have_stamps || !have_error || error.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || error.ee_info != SCM_TSTAMP_SND){
+            continue;
+        }
+        // an id the table has already forgotten, or a packet that left the window since
+        if (conn->tx_key - error.ee_data - 1 >= RUDP_TX_STAMP_KEYS){
+            continue;
+        }
+        uint16_t seq = conn->tx_key_seq[error.ee_data % RUDP_TX_STAMP_KEYS];
+        uint16_t slot = seq % RUDP_MAX_WINDOW;
+        if (conn->tx_seq[slot] != seq){
+            continue;
+        }
+        // the software and the hardware stamps may come in messages of their own
+        if (stamps.ts[0].tv_sec != 0 || stamps.ts[0].tv_nsec != 0)
+            conn->tx_software[slot] = (uint64_t) stamps.ts[0].tv_sec * 1000000 + stamps.ts[0].tv_nsec / 1000;
+        if (stamps.ts[2].tv_sec != 0 || stamps.ts[2].tv_nsec != 0){
+            conn->tx_hardware[slot] = (uint64_t) stamps.ts[2].tv_sec * 1000000 + stamps.ts[2].tv_nsec / 1000;
+            rudp_hardware_stamp(conn);
+        }
+    }
+}
+
+// The RTT of packet seq, from when it left until the kernel received the ACK read last - the NIC's stamps if both ends
+// have them. returns 0 if the ACK wasn't stamped
+uint64_t rudp_kernel_rtt(rudp_connection *conn, int sock, uint16_t seq) {
+    if (conn == NULL || conn->rx_software == 0){
+        return 0;
+    }
+    rudp_read_tx_stamps(conn, sock);
+    uint16_t slot = seq % RUDP_MAX_WINDOW;
+    if (conn->tx_seq[slot] != seq || conn->tx_software[slot] == 0){
+        return 0;
+    }
+    if (conn->rx_hardware > 0 && conn->tx_hardware[slot] > 0 && conn->rx_hardware > conn->tx_hardware[slot]){
+        conn->stats.kernel_rtt_samples++;
+        conn->stats.hardware_rtt_samples++;
+        return conn->rx_hardware - conn->tx_hardware[slot];
+    }
+    if (conn->rx_software <= conn->tx_software[slot]){
+        return 0;
+    }
+    conn->stats.kernel_rtt_samples++;
+    return conn->rx_software - conn->tx_software[slot];
+}
+
+// The receiver closed its window - keep probing it (with growing intervals) until it opens again
+void rudp_probe_window(rudp_connection *conn, int sock_id, struct sockaddr_in *to, uint16_t seq_number) {
+    int interval = RUDP_PROBE_MIN_USEC;
+
+    while (conn->peer_window == 0) {
+        rudp_packet* probe = create_packet(NULL, 0, seq_number);
+        if (probe == NULL){
+            close(sock_id);
+            exit(FAIL);
+        }
+        // a NUL packet that is not a SYN or an ACK - the receiver answers with an ACK carrying its window
+        probe->header.flags.nul = 1;
+
+        rudp_transmit(probe, sock_id, to, 1);
+        free(probe);
+
+        if (rudp_wait_readable(sock_id, interval / 1000000, interval % 1000000) > 0) {
+            rudp_recv_ack(sock_id, to);      // updates the peer's window
+        }
+        interval = min(interval * 2, RUDP_PROBE_MAX_USEC);
+    }
+}
+
+// Sizes the send window and SO_SNDBUF to twice the BDP, from the lowest RTT seen (the handshake's included) and
+// the rate of a transfer. Never goes below the current window - a short path is no reason to send less
+void rudp_autotune(rudp_connection *conn, int sock, uint64_t bytes, uint64_t elapsed_usec) {
+    tune_result tuning;
+    memset(&tuning, 0, sizeof tuning);
+    conn->tuned = 1;
+    if (conn->stats.rtt.count == 0 || elapsed_usec == 0){
+        return;
+    }
+    tuning.rtt_usec = conn->stats.rtt.min;
+    tuning.rate = bytes * 1000000 / elapsed_usec;
+    tuning.bdp = tuning.rate * tuning.rtt_usec / 1000000;
+
+    uint64_t packets = tune_target(tuning.rtt_usec, tuning.rate) / RUDP_MAX_DATA_SIZE + 1;
+    conn->send_window = min(max(packets, (uint64_t) conn->send_window), RUDP_MAX_WINDOW);
+    tuning.window = conn->send_window;
+    // the kernel charges each datagram about twice its size, tune_socket_buffer() counts on that
+    tuning.sndbuf = tune_socket_buffer(sock, SO_SNDBUF, (uint64_t) conn->send_window * RUDP_MAX_PACKET_SIZE, &tuning.limited);
+    tune_print("Tuning", &tuning);
+}
+
+// Free reassembly slots, limited by the space left in the kernel's receive buffer
+uint16_t rudp_advertised_window(int sock) {
+    rudp_connection *conn = connections[sock];
+    if (conn == NULL){
+        return 0;
+    }
+    int window = RUDP_REASSEMBLY_SLOTS - conn->reassembly_used;
+    // what the datagrams we didn't read yet take of the buffer (FIONREAD only tells the size of the next one on UDP)
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof meminfo;
+    if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && len > SK_MEMINFO_RCVBUF * sizeof(uint32_t)){
+        int64_t space = (int64_t) meminfo[SK_MEMINFO_RCVBUF] - meminfo[SK_MEMINFO_RMEM_ALLOC];
+        window = min(window, max(space, 0) / (2 * RUDP_MAX_PACKET_SIZE));
+    }
+    else if (conn->rcvbuf_packets > 0){
+        window = min(window, conn->rcvbuf_packets);
+    }
+    return window;
+}
+
+// The next sequence number the receiver is missing, starting at seq (skipping packets waiting for reassembly)
+uint16_t rudp_next_expected(rudp_connection *conn, uint16_t seq) {
+    while (rudp_slot_taken(conn, seq) == 2){
+        seq++;
+    }
+    return seq;
+}
+
+// 2 if the packet seq is already waiting for reassembly, 1 if its slot is taken by another packet, 0 if the slot is free
+int rudp_slot_taken(rudp_connection *conn, uint16_t seq) {
+    uint16_t slot = seq % RUDP_REASSEMBLY_SLOTS;
+    if (conn->reassembly[slot] != NULL)
+        return conn->reassembly[slot]->header.seq_ack_number == seq ? 2 : 1;
+    if (conn->placed[slot])
+        return conn->placed_seq[slot] == seq ? 2 : 1;
+    return 0;
+}
+
+// Keeps a copy of an out of order packet in the reassembly buffer. returns -1 if there is no memory for it
+int rudp_keep_packet(rudp_connection *conn, rudp_packet *packet) {
+    rudp_packet *copy = (rudp_packet *) malloc (sizeof(rudp_packet));
+    if (copy == NULL){
+        return -1;
+    }
+    memcpy(copy, packet, sizeof(*copy));
+    conn->reassembly[packet->header.seq_ack_number % RUDP_REASSEMBLY_SLOTS] = copy;
+    conn->reassembly_used++;
+    conn->stats.out_of_order++;
+    return 0;
+}
+
+// Receives until a data packet we don't have yet arrives - SYNs, probes, ACKs, corrupted packets and duplicates are handled here.
+// returns the packet's distance from seq (0 - the packet we are waiting for)
+uint16_t rudp_recv_data_packet(rudp_connection *conn, int sock, rudp_packet *packet, struct sockaddr_in *client_addr, uint16_t seq) {
+    socklen_t len = sizeof(struct sockaddr_in);
+
+    do{
+        // the receive below sleeps until a packet arrives - unless it already did
+        if (busy_poll_usec > 0 && io.wait_readable == NULL)
+            rudp_busy_poll(sock, busy_poll_usec);
+        int bytes = rudp_recvfrom(sock, packet, sizeof(*packet), client_addr, &len);
+
+        if (bytes <= -1){
+            perror("recv");
+            close(sock);
+            exit(FAIL);
+        }
+        else if (bytes == 0){
+            printf("Connection was closed prior to receiving the data4!\n");
+            close(sock);
+            exit(FAIL);
+        }
+        conn->stats.packets_received++;
+        conn->stats.bytes_received += bytes;
+        rudp_pad_packet(packet, bytes);
+        trace_packet(conn, packet->header.flags.ack == 1 ? RUDP_TRACE_ACK : RUDP_TRACE_RECEIVED, packet, 0);
+
+        // Nothing to answer for an ACK
+        if (packet->header.flags.ack == 1){
+            continue;
+        }
+        // A resent SYN (our SYN ACK was lost) or a zero-window probe - answer with our current state
+        if (packet->header.flags.syn == 1 || packet->header.flags.nul == 1){
+            rudp_send_ack(sock, client_addr, rudp_next_expected(conn, seq));
+            continue;
+        }
+        // A corrupted (or cut) packet is not acknowledged - the sender will resend it
+        if ((size_t) bytes < RUDP_WIRE_SIZE(packet) || packet->header.checksum != calculate_checksum(packet->data, sizeof(packet->data))){
+            conn->stats.checksum_failures++;
+            trace_packet(conn, RUDP_TRACE_DROP, packet, RUDP_TRACE_DROP_CHECKSUM);
+            continue;
+        }
+
+        uint16_t distance = packet->header.seq_ack_number - seq;
+        if (distance == 0 || (distance < RUDP_REASSEMBLY_SLOTS && rudp_slot_taken(conn, packet->header.seq_ack_number) == 0)){
+            // a packet past the furthest one opens the gaps before it, a packet short of it fills one
+            uint16_t furthest = conn->furthest_seq - seq;
+            uint16_t seen = conn->has_furthest && furthest < RUDP_REASSEMBLY_SLOTS ? furthest + 1 : 0;
+            // (read by rudp_get_progress() on another thread)
+            if (distance >= seen){
+                __atomic_add_fetch(&conn->stats.gaps, distance - seen, __ATOMIC_RELAXED);
+                conn->furthest_seq = packet->header.seq_ack_number;
+                conn->has_furthest = 1;
+            }
+            else {
+                __atomic_add_fetch(&conn->stats.gaps_filled, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&conn->stats.data_received, packet->header.length, __ATOMIC_RELAXED);
+            return distance;
+        }
+        // a duplicate of a packet we already have - tell the sender what we are missing
+        __atomic_add_fetch(&conn->stats.duplicates, 1, __ATOMIC_RELAXED);
+        trace_packet(conn, RUDP_TRACE_DROP, packet, RUDP_TRACE_DROP_DUPLICATE);
+        rudp_send_ack(sock, client_addr, rudp_next_expected(conn, seq));
+    } while (1);
+}
+
+// The full stream offset of a packet's data - the header only carries its low 32 bits, and every packet
+// we accept is within the window of next_offset
+uint64_t rudp_packet_offset(rudp_connection *conn, rudp_packet *packet) {
+    return conn->next_offset + (int32_t)(packet->header.offset - (uint32_t) conn->next_offset);
+}
+
+// Copies (decompresses) a packet's data to data, which holds data_size bytes (NULL - the data is not needed).
+// returns the amount of data bytes, -1 if the data doesn't decompress or fit
+int rudp_copy_packet(rudp_packet *packet, void *data, size_t data_size) {
+    if (packet->header.flags.cmp == 1){
+        // compressed packet - the original data size is known only after decompression
+        char raw[RUDP_MAX_CHUNK_SIZE];
+        int raw_size = decompress_block(packet->data, packet->header.length, raw, min(data_size, sizeof raw));
+        if (raw_size != -1 && data != NULL){
+            memcpy(data, raw, raw_size);
+        }
+        return raw_size;
+    }
+    if (data != NULL){
+        if (packet->header.length > data_size){
+            return -1;
+        }
+        memcpy(data, packet->data, packet->header.length);
+    }
+    return packet->header.length;
+}
+
+// 1 if every byte of the packet's stream before its data was delivered already
+int rudp_stream_in_order(rudp_connection *conn, rudp_packet *packet) {
+    uint64_t next = packet->header.stream == RUDP_DEFAULT_STREAM ? conn->next_offset : conn->stream_next_offset[packet->header.stream];
+    return packet->header.offset == (uint32_t) next;
+}
+
+// Copies (decompresses) a packet's data to its place in a buffer that holds the stream bytes [start, end).
+// returns the amount of data bytes, -1 if the data doesn't fit in the buffer
+int rudp_place_packet(rudp_connection *conn, rudp_packet *packet, char *data, uint64_t start, uint64_t end) {
+    uint64_t offset = rudp_packet_offset(conn, packet);
+    if (offset < start || offset >= end){
+        return -1;
+    }
+    if (packet->header.flags.cmp == 1){
+        return decompress_block(packet->data, packet->header.length, data + (offset - start), min(end - offset, RUDP_MAX_CHUNK_SIZE));
+    }
+    if (packet->header.length > end - offset){
+        return -1;
+    }
+    memcpy(data + (offset - start), packet->data, packet->header.length);
+    return packet->header.length;
+}
+
 
 int rudp_send_ack(int sock_id, struct sockaddr_in *to, int seq_number){
     rudp_packet* ack_packet = create_packet(NULL, 0, seq_number);
     // set NUL flag to 1 -> set ACK flag to 1 - this is an ACK packet; following draft guidelines
     ack_packet->header.flags.nul = 1;
     ack_packet->header.flags.ack = 1;
+    ack_packet->header.window = rudp_advertised_window(sock_id);
+    // the accepted capabilities - what the peer is waiting for in the ACK of its SYN
+    if (connections[sock_id] != NULL){
+        rudp_connection *conn = connections[sock_id];
+        ack_packet->header.length = 1;
+        ack_packet->data[0] = conn->capabilities;
+        if (conn->capabilities & RUDP_CAP_STRIPES){
+            // followed by the flow count and the ports of flows 1 and up (network byte order)
+            ack_packet->data[1] = conn->stripes;
+            for (int s = 1; s < conn->stripes; s++)
+                memcpy(ack_packet->data + 2 * s, &conn->stripe_addrs[s].sin_port, sizeof(uint16_t));
+            ack_packet->header.length = 2 * conn->stripes;
+        }
+        ack_packet->header.checksum = calculate_checksum(ack_packet->data, sizeof(ack_packet->data));
+    }
 
     return rudp_send_packet(ack_packet, sock_id, to);
 }
 
 int rudp_send_syn(int sock_id, struct sockaddr_in *to, int seq_number){
-    rudp_packet* syn_packet = create_packet(NULL, 0, seq_number);
+    // the SYN offers our capabilities to the server, and the UDP flows we would stripe bulk transfers over
+    uint8_t offer[2] = {requested_capabilities, (uint8_t) requested_stripes};
+    rudp_packet* syn_packet = create_packet(offer, sizeof offer, seq_number);
     // set NUL flag to 1 -> set SYN flag to 1 - this is a SYN packet; following draft guidelines
     syn_packet->header.flags.nul = 1;
     syn_packet->header.flags.syn = 1;
+    syn_packet->header.window = rudp_advertised_window(sock_id);
 
     return rudp_send_packet(syn_packet, sock_id, to);
 }
@@ -383,23 +1589,541 @@ rudp_packet* create_packet(void *data, size_t data_size, int seq_ack_number){
     return packet;
 }
 
+// Returns a pointer to size bytes starting at offset of the buffers, copying them into scratch only if they span more than one buffer
+char* iov_gather(const struct iovec *iov, int iovcnt, size_t offset, size_t size, char *scratch){
+    int i = 0;
+    while (i < iovcnt && offset >= iov[i].iov_len){
+        offset -= iov[i].iov_len;
+        i++;
+    }
+    if (i == iovcnt || offset + size <= iov[i].iov_len){
+        return (char *)iov[i < iovcnt ? i : 0].iov_base + offset;     // contiguous (or empty)
+    }
+
+    size_t copied = 0;
+    while (copied < size && i < iovcnt){
+        size_t part = min(size - copied, iov[i].iov_len - offset);
+        memcpy(scratch + copied, (char *)iov[i].iov_base + offset, part);
+        copied += part;
+        offset = 0;
+        i++;
+    }
+    return scratch;
+}
+
+// Compresses up to *data_size bytes into a single packet and sets *data_size to the amount of raw bytes in it.
+// returns NULL if the data doesn't shrink - the caller should send it raw.
+rudp_packet* create_compressed_packet(void *data, size_t *data_size, size_t capacity, int seq_ack_number){
+    rudp_packet* packet = create_packet(NULL, 0, seq_ack_number);
+    if (packet == NULL){
+        return NULL;
+    }
+
+    capacity = min(capacity, sizeof(packet->data));
+    int compressed_size = compress_block(data, *data_size, packet->data, capacity);
+    if (compressed_size == 0 && *data_size > capacity){
+        // the whole chunk doesn't fit - try a single packet's worth of data
+        *data_size = capacity;
+        compressed_size = compress_block(data, *data_size, packet->data, capacity);
+    }
+    if (compressed_size == 0){
+        free(packet);
+        return NULL;
+    }
+    // a failed first attempt leaves bytes past the block, which the trimmed datagram doesn't carry
+    memset(packet->data + compressed_size, 0, sizeof(packet->data) - compressed_size);
+
+    packet->header.length = compressed_size;
+    packet->header.flags.cmp = 1;
+    packet->header.checksum = calculate_checksum(packet->data, sizeof(packet->data));
+    return packet;
+}
+
+// Sends one round of a bulk transfer: every packet once at the pace of *rate, then whatever the NAK reports
+// ask for, until the receiver's ACK of seq + 1. returns 0, -1 if out of memory
+int rudp_send_round(rudp_connection *conn, int sock_id, const char *data, size_t size, struct sockaddr_in *to, uint16_t seq, uint64_t *rate){
+    uint32_t count = (size + RUDP_MAX_DATA_SIZE - 1) / RUDP_MAX_DATA_SIZE;
+    uint64_t *last_sent = (uint64_t *) calloc(count, sizeof(*last_sent));       // 0 - not sent yet
+    uint32_t *queue = (uint32_t *) malloc(count * sizeof(*queue));              // packets to resend, a ring
+    uint8_t *resend = (uint8_t *) calloc(count, 1);                             // 1 - queued, 2 - resent since
+    if (last_sent == NULL || queue == NULL || resend == NULL){
+        fprintf(stderr, "ERROR: Failed to allocate memory for the bulk round!\n");
+        free(last_sent);
+        free(queue);
+        free(resend);
+        return -1;
+    }
+    // how long a resent packet takes to show up - the RTT of the acknowledged transfers (the handshake's at least) until
+    // the reports measure it, with the receiver's backlog
+    uint64_t rtt = conn->srtt_usec > 0 ? conn->srtt_usec : (conn->stats.rtt.count > 0 ? conn->stats.rtt.min : RUDP_BULK_NAK_USEC);
+    uint64_t now = rudp_now_usec();
+    uint64_t next_send = now * 1000;        // nanoseconds - a packet's share of the pace is a few microseconds
+    uint64_t next_probe = now, next_check = now + RUDP_BULK_NAK_USEC;
+    uint32_t next_new = 0, queue_head = 0, queued = 0;
+    uint32_t paced = 0, lost = 0;       // packets sent, and reported lost, in this report interval
+    int probes = 0, done = 0;
+    rudp_packet packet;
+
+    while (!done){
+        now = rudp_now_usec();
+        // send what the pace allows, lost packets first
+        while (now * 1000 >= next_send && (queued > 0 || next_new < count)){
+            uint32_t index;
+            int try_number = 1;
+            if (queued > 0){
+                index = queue[queue_head];
+                queue_head = (queue_head + 1) % count;
+                queued--;
+                resend[index] = 2;
+                try_number = 2;
+            }
+            else {
+                index = next_new++;
+            }
+            size_t offset = (size_t) index * RUDP_MAX_DATA_SIZE;
+            rudp_packet *chunk = create_packet((char *) data + offset, min(size - offset, (size_t) RUDP_MAX_DATA_SIZE), seq);
+            if (chunk == NULL){
+                close(sock_id);
+                exit(FAIL);
+            }
+            chunk->header.offset = (uint32_t) (conn->send_offset + offset);
+            // a packet always takes the same flow, resent or not
+            int stripe = index % conn->stripes;
+            rudp_transmit(chunk, conn->stripe_socks[stripe], stripe == 0 ? to : &conn->stripe_addrs[stripe], try_number);
+            next_send += RUDP_WIRE_SIZE(chunk) * 1000000000 / *rate;
+            last_sent[index] = now;
+            paced++;
+            free(chunk);
+            // the receiver gets a chance to complete the round on its own before it is asked
+            next_probe = now + max(2 * rtt, (uint64_t) RUDP_BULK_NAK_USEC);
+        }
+        // a pacer that fell behind (descheduled, waiting in sendto()) only catches up on a short burst
+        if (now * 1000 > next_send + RUDP_BULK_MAX_BURST_USEC * 1000)
+            next_send = (now - RUDP_BULK_MAX_BURST_USEC) * 1000;
+        // losing a good share of what was sent, or a queue that grows, is congestion (often a receiver that can't keep up) -
+        // slow down by an eighth, anything less brings the pace back up a sixteenth at a time
+        if (now >= next_check){
+            int queueing = rtt > 2 * conn->stats.rtt.min + RUDP_BULK_QUEUE_USEC;
+            if (queueing || (paced > 0 && (uint64_t) lost * 100 >= (uint64_t) paced * RUDP_BULK_CONGESTION_LOSS))
+                *rate = max(*rate - *rate / 8, (uint64_t) RUDP_BULK_MIN_RATE);
+            else
+                *rate = min(*rate + *rate / 16, bulk_rate);
+            paced = 0;
+            lost = 0;
+            next_check = now + RUDP_BULK_NAK_USEC;
+        }
+
+        uint64_t wait = now * 1000 < next_send ? (next_send - now * 1000 + 999) / 1000 : 0;
+        if (queued == 0 && next_new == count){
+            // everything went out - ask the receiver for the last gaps
+            if (now >= next_probe){
+                if (probes++ >= RUDP_BULK_MAX_PROBES){
+                    fprintf(stderr, "ERROR! The receiver stopped answering the bulk transfer! exiting...\n");
+                    close(sock_id);
+                    exit(FAIL);
+                }
+                rudp_packet *probe = create_packet(NULL, 0, seq);
+                if (probe == NULL){
+                    close(sock_id);
+                    exit(FAIL);
+                }
+                probe->header.flags.nul = 1;
+                probe->header.flags.eak = 1;
+                if (probes > 1){
+                    // the last probe went unanswered
+                    conn->stats.timeouts++;
+                    trace_packet(conn, RUDP_TRACE_TIMEOUT, probe, probes - 1);
+                }
+                rudp_transmit(probe, sock_id, to, 1);
+                free(probe);
+                next_probe = now + max(2 * rtt, (uint64_t) RUDP_BULK_NAK_USEC);
+            }
+            wait = next_probe > now ? next_probe - now : 0;
+        }
+
+        // NAK reports, and the ACK that ends the round
+        if (rudp_wait_readable(sock_id, wait / 1000000, wait % 1000000) == 0){
+            continue;
+        }
+        socklen_t len = sizeof(*to);
+        int bytes = rudp_recvfrom(sock_id, &packet, sizeof(packet), to, &len);
+        if (bytes <= 0){
+            continue;
+        }
+        conn->stats.packets_received++;
+        conn->stats.bytes_received += bytes;
+        rudp_pad_packet(&packet, bytes);
+        trace_packet(conn, packet.header.flags.ack == 1 ? RUDP_TRACE_ACK : RUDP_TRACE_RECEIVED, &packet, 0);
+        if (packet.header.flags.ack != 1){
+            continue;
+        }
+        if (packet.header.flags.eak != 1){
+            conn->stats.acks_received++;
+            done = packet.header.seq_ack_number == (uint16_t)(seq + 1);
+            continue;
+        }
+        conn->stats.naks_received++;
+        if (packet.header.seq_ack_number != seq || packet.header.checksum != calculate_checksum(packet.data, sizeof(packet.data))){
+            continue;       // a late report of the previous round, or a corrupted one
+        }
+        probes = 0;
+        uint32_t newest = packet.header.offset;
+        if (newest < next_new && resend[newest] == 0){
+            uint64_t sample = now - last_sent[newest];
+            histogram_record(&conn->stats.rtt, sample);
+            rtt = (7 * rtt + sample) / 8;
+        }
+
+        // queue the packets the report misses, unless a copy sent since may still be on its way
+        rudp_nak_range *ranges = (rudp_nak_range *) packet.data;
+        for (size_t r = 0; r < packet.header.length / sizeof(*ranges); r++){
+            uint32_t first = min(ranges[r].first, next_new);
+            uint32_t end = min((uint64_t) ranges[r].first + ranges[r].count, (uint64_t) next_new);
+            for (uint32_t index = first; index < end; index++){
+                if (resend[index] == 1 || (resend[index] == 2 && now - last_sent[index] < rtt + RUDP_BULK_RESEND_SLACK_USEC)){
+                    continue;
+                }
+                queue[(queue_head + queued) % count] = index;
+                queued++;
+                resend[index] = 1;
+                lost++;
+            }
+        }
+    }
+
+    free(last_sent);
+    free(queue);
+    free(resend);
+    return 0;
+}
+
+// Receives one round of a bulk transfer into data, reporting the gaps behind the newest packet every RUDP_BULK_NAK_USEC
+// and all of them when the sender probes. Striped rounds are drained by a thread per stripe, this one drains stripe 0.
+// returns 0, -1 if out of memory
+int rudp_recv_round(rudp_connection *conn, int sock, char *data, size_t size, struct sockaddr_in *client_addr, uint16_t seq){
+    rudp_round round;
+    memset(&round, 0, sizeof(round));
+    round.data = data;
+    round.size = size;
+    round.start = (uint32_t) conn->next_offset;
+    round.seq = seq;
+    round.stripes = 1;
+    round.progress = &conn->stats;
+    round.count = (size + RUDP_MAX_DATA_SIZE - 1) / RUDP_MAX_DATA_SIZE;
+    round.have = (uint8_t *) calloc(round.count, 1);
+    if (round.have == NULL){
+        fprintf(stderr, "ERROR: Failed to allocate memory for the bulk round!\n");
+        return -1;
+    }
+    rudp_stripe stripes[RUDP_MAX_STRIPES];
+    if (conn->capabilities & RUDP_CAP_STRIPES){
+        round.stripes = conn->stripes;
+        for (int s = 1; s < round.stripes; s++){
+            memset(&stripes[s], 0, sizeof(stripes[s]));
+            stripes[s].round = &round;
+            stripes[s].index = s;
+            stripes[s].sock = conn->stripe_socks[s];
+            if (pthread_create(&stripes[s].thread, NULL, rudp_stripe_thread, &stripes[s]) != 0){
+                fprintf(stderr, "ERROR: Failed to start the thread of stripe %d! exiting...\n", s);
+                close(sock);
+                exit(FAIL);
+            }
+        }
+    }
+    // with other threads placing packets, look up often enough to see the round end
+    uint64_t poll_usec = round.stripes > 1 ? RUDP_STRIPE_POLL_USEC : RUDP_BULK_NAK_USEC;
+    uint32_t first_missing = 0;
+    uint64_t next_report = rudp_now_usec() + RUDP_BULK_NAK_USEC;
+    rudp_packet packet;
+
+    while (__atomic_load_n(&round.received, __ATOMIC_ACQUIRE) < round.count){
+        uint64_t now = rudp_now_usec();
+        if (now >= next_report){
+            while (__atomic_load_n(&round.have[first_missing], __ATOMIC_RELAXED))
+                first_missing++;
+            rudp_send_nak(sock, client_addr, &round, first_missing, 0);
+            next_report = now + RUDP_BULK_NAK_USEC;
+        }
+        if (rudp_wait_readable(sock, 0, min(next_report - now, poll_usec)) == 0){
+            continue;
+        }
+
+        socklen_t len = sizeof(struct sockaddr_in);
+        int bytes = rudp_recvfrom(sock, &packet, sizeof(packet), client_addr, &len);
+        if (bytes <= -1){
+            perror("recv");
+            close(sock);
+            exit(FAIL);
+        }
+        conn->stats.packets_received++;
+        conn->stats.bytes_received += bytes;
+        rudp_pad_packet(&packet, bytes);
+        trace_packet(conn, packet.header.flags.ack == 1 ? RUDP_TRACE_ACK : RUDP_TRACE_RECEIVED, &packet, 0);
+
+        if (packet.header.flags.ack == 1){
+            continue;
+        }
+        // a resent SYN or a packet from before the round (its ACK was lost) - tell the sender where we are
+        if (packet.header.flags.syn == 1 || packet.header.seq_ack_number != seq){
+            rudp_send_ack(sock, client_addr, seq);
+            continue;
+        }
+        // the sender sent everything - report every gap
+        if (packet.header.flags.nul == 1){
+            while (__atomic_load_n(&round.have[first_missing], __ATOMIC_RELAXED))
+                first_missing++;
+            rudp_send_nak(sock, client_addr, &round, first_missing, 1);
+            next_report = now + RUDP_BULK_NAK_USEC;
+            continue;
+        }
+        int dropped = rudp_round_place(&round, 0, &packet, bytes, &conn->stats);
+        if (dropped)
+            trace_packet(conn, RUDP_TRACE_DROP, &packet, dropped);
+    }
+
+    for (int s = 1; s < round.stripes; s++){
+        pthread_join(stripes[s].thread, NULL);
+        conn->stats.packets_received += stripes[s].stats.packets_received;
+        conn->stats.bytes_received += stripes[s].stats.bytes_received;
+        conn->stats.out_of_order += stripes[s].stats.out_of_order;
+        conn->stats.checksum_failures += stripes[s].stats.checksum_failures;
+    }
+    free(round.have);
+
+    // a plain ACK of the next sequence number ends the round - resent as the answer to any late probe.
+    // Only sent once every stripe stopped reading, so none of them takes a packet of the next round
+    rudp_send_ack(sock, client_addr, seq + 1);
+    return 0;
+}
+
+// Checks a data packet of the round that arrived on the given stripe and copies it to its place. Counts it in stats,
+// the stripe's own, and in the round's progress counters
+// returns 0 if it was placed, the RUDP_TRACE_DROP_* reason it was counted under if not
+int rudp_round_place(rudp_round *round, int stripe, rudp_packet *packet, int bytes, rudp_stats *stats){
+    uint32_t distance = packet->header.offset - round->start;
+    uint32_t index = distance / RUDP_MAX_DATA_SIZE;
+    if ((size_t) bytes < RUDP_WIRE_SIZE(packet) || packet->header.checksum != calculate_checksum(packet->data, sizeof(packet->data))
+        || distance % RUDP_MAX_DATA_SIZE != 0 || index >= round->count || (int) (index % round->stripes) != stripe
+        || packet->header.length != min(round->size - (size_t) index * RUDP_MAX_DATA_SIZE, (size_t) RUDP_MAX_DATA_SIZE)){
+        stats->checksum_failures++;
+        return RUDP_TRACE_DROP_CHECKSUM;
+    }
+    if (round->have[index]){
+        __atomic_add_fetch(&round->progress->duplicates, 1, __ATOMIC_RELAXED);
+        return RUDP_TRACE_DROP_DUPLICATE;
+    }
+    memcpy(round->data + (size_t) index * RUDP_MAX_DATA_SIZE, packet->data, packet->header.length);
+    __atomic_store_n(&round->have[index], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&round->newest, index, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&round->progress->data_received, packet->header.length, __ATOMIC_RELAXED);
+    if (index + 1 < round->highest[stripe]){
+        stats->out_of_order++;
+        __atomic_add_fetch(&round->progress->gaps_filled, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        // the packets of this stripe between its furthest one and this one are missing
+        uint32_t expected = round->highest[stripe] == 0 ? (uint32_t) stripe : round->highest[stripe] - 1 + round->stripes;
+        if (index > expected)
+            __atomic_add_fetch(&round->progress->gaps, (index - expected) / round->stripes, __ATOMIC_RELAXED);
+        __atomic_store_n(&round->highest[stripe], index + 1, __ATOMIC_RELAXED);
+    }
+    // the copy is visible to whoever sees the round complete
+    __atomic_add_fetch(&round->received, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Drains one stripe of a round until the round is complete (see rudp_recv_round())
+void* rudp_stripe_thread(void *arg){
+    rudp_stripe *stripe = (rudp_stripe *) arg;
+    rudp_round *round = stripe->round;
+    rudp_packet packet;
+    while (__atomic_load_n(&round->received, __ATOMIC_ACQUIRE) < round->count){
+        if (rudp_wait_readable(stripe->sock, 0, RUDP_STRIPE_POLL_USEC) == 0){
+            continue;
+        }
+        int bytes = io.recvfrom(stripe->sock, &packet, sizeof(packet), 0, NULL, NULL);
+        if (bytes <= -1){
+            perror("recv");
+            exit(FAIL);
+        }
+        stripe->stats.packets_received++;
+        stripe->stats.bytes_received += bytes;
+        rudp_pad_packet(&packet, bytes);
+        // only data travels on the stripes - anything of another round is a late copy
+        if (packet.header.flags.ack == 1 || packet.header.flags.nul == 1 || packet.header.flags.syn == 1){
+            stripe->stats.checksum_failures++;
+            continue;
+        }
+        if (packet.header.seq_ack_number != round->seq){
+            __atomic_add_fetch(&round->progress->duplicates, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        rudp_round_place(round, stripe->index, &packet, bytes, &stripe->stats);
+    }
+    return NULL;
+}
+
+// Opens the receiver's end of the stripes next to sock (its address, ephemeral ports) for the SYN that asked for count.
+// returns the amount of flows open, sock's included
+int rudp_open_stripes(rudp_connection *conn, int sock, int count){
+    if (conn->stripes > 1){
+        return conn->stripes;       // a resent SYN
+    }
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr *) &addr, &len) == -1){
+        perror("getsockname");
+        return 1;
+    }
+    addr.sin_port = 0;
+    count = min(count, RUDP_MAX_STRIPES);
+    while (conn->stripes < count){
+        int stripe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (stripe == -1 || bind(stripe, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+            perror("stripe");
+            if (stripe != -1)
+                close(stripe);
+            break;
+        }
+        len = sizeof(conn->stripe_addrs[conn->stripes]);
+        if (stripe >= FD_SETSIZE || getsockname(stripe, (struct sockaddr *) &conn->stripe_addrs[conn->stripes], &len) == -1){
+            fprintf(stderr, "ERROR: Failed to open stripe %d, striping over %d flows!\n", conn->stripes, conn->stripes);
+            close(stripe);
+            break;
+        }
+        conn->stripe_socks[conn->stripes++] = stripe;
+        connections[stripe] = conn;
+    }
+    return conn->stripes;
+}
+
+// Opens our end of the stripes the receiver listed in the ACK of our SYN - unbound sockets, each gets a source port
+// (a flow of its own) on its first packet
+void rudp_connect_stripes(rudp_connection *conn, struct sockaddr_in *receiver, rudp_packet *ack){
+    int count = (uint8_t) ack->data[1];
+    if (count < 2 || count > RUDP_MAX_STRIPES || ack->header.length < 2 * count){
+        return;
+    }
+    for (int s = 1; s < count; s++){
+        int stripe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (stripe == -1 || stripe >= FD_SETSIZE){
+            // the receiver expects every flow now
+            fprintf(stderr, "ERROR: Failed to open stripe %d! exiting...\n", s);
+            exit(FAIL);
+        }
+        conn->stripe_socks[s] = stripe;
+        conn->stripe_addrs[s] = *receiver;
+        memcpy(&conn->stripe_addrs[s].sin_port, ack->data + 2 * s, sizeof(uint16_t));
+        connections[stripe] = conn;
+    }
+    conn->stripes = count;
+}
+
+// Reports the packets of the round from index from on that are missing - all of them, or only those a later packet of
+// their stripe overtook - in as many NAK reports as their ranges need
+void rudp_send_nak(int sock, struct sockaddr_in *to, rudp_round *round, uint32_t from, int all){
+    // the stripes' threads may be filling the round in the meantime
+    uint32_t highest[RUDP_MAX_STRIPES], until = 0;
+    for (int s = 0; s < round->stripes; s++){
+        highest[s] = all ? round->count : __atomic_load_n(&round->highest[s], __ATOMIC_RELAXED);
+        until = max(until, highest[s]);
+    }
+    uint32_t newest = __atomic_load_n(&round->newest, __ATOMIC_RELAXED);
+    rudp_nak_range ranges[RUDP_NAK_MAX_RANGES];
+    uint32_t index = from;
+    while (1){
+        size_t count = 0;
+        while (index < until && count < RUDP_NAK_MAX_RANGES){
+            if (__atomic_load_n(&round->have[index], __ATOMIC_RELAXED) || index >= highest[index % round->stripes]){
+                index++;
+                continue;
+            }
+            ranges[count].first = index;
+            while (index < until && !__atomic_load_n(&round->have[index], __ATOMIC_RELAXED) && index < highest[index % round->stripes])
+                index++;
+            ranges[count].count = index - ranges[count].first;
+            count++;
+        }
+        if (count == 0){
+            return;
+        }
+        rudp_packet *nak = create_packet(ranges, count * sizeof(*ranges), round->seq);
+        if (nak == NULL){
+            close(sock);
+            exit(FAIL);
+        }
+        nak->header.flags.ack = 1;
+        nak->header.flags.eak = 1;
+        nak->header.window = rudp_advertised_window(sock);
+        nak->header.offset = newest;
+        rudp_transmit(nak, sock, to, 1);
+        free(nak);
+    }
+}
+
+// zeroes what a trimmed datagram left out of the packet, so its checksum covers the same bytes as the sender's
+void rudp_pad_packet(rudp_packet *packet, int bytes){
+    if (bytes >= 0 && (size_t) bytes < sizeof(*packet)){
+        memset((char *) packet + bytes, 0, sizeof(*packet) - bytes);
+    }
+}
+
+// decides the data size of the next packets from the retransmits of the last RUDP_SIZING_INTERVAL ones
+void rudp_adapt_packet_size(rudp_connection *conn){
+    uint64_t resent = conn->stats.retransmits - conn->sizing_retransmits;
+    int loss = (int) (resent * 100 / conn->sizing_packets);
+    int size = conn->data_size_limit;
+    // a queue that grew - the losses are congestion, which smaller packets would only add headers to
+    int queueing = conn->stats.rtt.count > 0 && conn->srtt_usec > 2 * conn->stats.rtt.min + RUDP_SIZING_QUEUE_USEC;
+
+    if (loss >= RUDP_SIZING_SHRINK_LOSS && !queueing){
+        size = max(size / 2, RUDP_MIN_DATA_SIZE);
+    }
+    else if (loss < RUDP_SIZING_GROW_LOSS){
+        size = min(size + size / 4, RUDP_MAX_DATA_SIZE);
+    }
+    if (size != conn->data_size_limit){
+        conn->stats.resizes++;
+        conn->data_size_limit = size;
+    }
+    conn->sizing_packets = 0;
+    conn->sizing_retransmits = conn->stats.retransmits;
+}
+
 int rudp_recv_packet(int sock, rudp_packet * packet, size_t packet_size, struct sockaddr_in *client_addr){
     socklen_t len = sizeof(struct sockaddr_in);
-    recvfrom(sock, packet, sizeof(*packet), 0, (struct sockaddr *) client_addr, &len);
-
-    #ifdef _DEBUG
-    char* type = get_packet_type(packet);
-    printf("Received %spacket, SEQ: %d\n", type, packet->header.seq_ack_number);
-    #endif
+    int bytes = rudp_recvfrom(sock, packet, sizeof(*packet), client_addr, &len);
+    rudp_pad_packet(packet, bytes);
+    if (bytes > 0 && connections[sock] != NULL){
+        connections[sock]->stats.packets_received++;
+        connections[sock]->stats.bytes_received += bytes;
+        trace_packet(connections[sock], packet->header.flags.ack == 1 ? RUDP_TRACE_ACK : RUDP_TRACE_RECEIVED, packet, 0);
+    }
 
     int data_size = packet->header.length;
 
+    if (packet->header.flags.syn == 1 && packet->header.flags.ack != 1 && connections[sock] != NULL && data_size >= 1){
+        // accept the capabilities we support, our ACK below tells the client which ones
+        connections[sock]->peer_capabilities = packet->data[0];
+        connections[sock]->capabilities = packet->data[0] & RUDP_SUPPORTED_CAPS;
+        // stripes only carry bulk rounds
+        if ((connections[sock]->capabilities & RUDP_CAP_STRIPES)
+            && (!(connections[sock]->capabilities & RUDP_CAP_BULK) || data_size < 2 || rudp_open_stripes(connections[sock], sock, packet->data[1]) < 2))
+            connections[sock]->capabilities &= ~RUDP_CAP_STRIPES;
+    }
+
     // Send ACK after receiving only if received packet was not ACK
     if (packet->header.flags.ack != 1){
         rudp_send_ack(sock,client_addr,packet->header.seq_ack_number+1);
     }
+    else if (packet->header.flags.eak == 1){
+        // a late NAK report of a bulk round that is over already
+        if (connections[sock] != NULL)
+            connections[sock]->stats.naks_received++;
+    }
     else {
-        ack_received++;
+        if (connections[sock] != NULL)
+            connections[sock]->stats.acks_received++;
     }
     
     return data_size;
@@ -451,23 +2175,31 @@ int rudp_recv_ack(int sock, struct sockaddr_in *sender_addr){
     } while (packet->header.flags.ack != 1);
 
     int seq = packet->header.seq_ack_number;
+    // every ACK carries the receiver's current window, and the capabilities it accepted
+    if (connections[sock] != NULL){
+        connections[sock]->peer_window = packet->header.window;
+        if (packet->header.length >= 1){
+            connections[sock]->peer_capabilities = packet->data[0];
+        }
+        if (packet->header.length >= 2 && (packet->data[0] & requested_capabilities & RUDP_CAP_STRIPES) && connections[sock]->stripes == 1){
+            rudp_connect_stripes(connections[sock], sender_addr, packet);
+        }
+    }
     // Received and sent ack if needed -> free packet
     free(packet);
 
     return seq;
 }
 
-char* get_packet_type(rudp_packet* packet){
-    char* type;
-    if (packet->header.flags.ack == 1 && packet->header.flags.syn == 1)
-        type = "SYN ACK ";
-    else if (packet->header.flags.ack == 1)
-        type = "ACK ";
-    else if (packet->header.flags.syn == 1)
-        type = "SYN ";
-    else
-        type = "";
-    return type;
+// Records an event about a packet, if the connection is traced
+void trace_packet(rudp_connection *conn, uint8_t type, rudp_packet *packet, uint32_t extra){
+    if (conn == NULL || conn->trace == NULL){
+        return;
+    }
+    uint8_t flags = (packet->header.flags.syn ? RUDP_TRACE_FLAG_SYN : 0) | (packet->header.flags.ack ? RUDP_TRACE_FLAG_ACK : 0)
+                  | (packet->header.flags.eak ? RUDP_TRACE_FLAG_EAK : 0)
+                  | (packet->header.flags.nul ? RUDP_TRACE_FLAG_NUL : 0) | (packet->header.flags.cmp ? RUDP_TRACE_FLAG_CMP : 0);
+    rudp_trace_record(conn->trace, type, flags, packet->header.seq_ack_number, packet->header.length, packet->header.window, extra);
 }
 
 /*
@@ -500,57 +2232,65 @@ unsigned short int calculate_checksum(void *data, unsigned int bytes) {
     return (~((unsigned short int)total_sum));
 }
 
-// A simple calculating for packet loss - not 100% accurate but gives a reasonable result to improve perfomance 
+// The share of the data and SYN packets that had to be sent again - a timer that follows the RTT (see rudp_rto())
+// only fires for packets that were really lost, so the ones still in flight don't count as lost
 float calculate_packet_loss() {
     if (packets_sent == 0) {
         return 0.0; // no packets sent. 0 loss
     }
-    return ((1.0 - ((float)ack_received / (float)packets_sent)) * 100.0)/2;
+    return ((float)packets_resent / (float)(packets_sent + packets_resent)) * 100.0;
 }
 
-// tries to deal with the packet loss by adjusting the timeout and retries for best performance
+// tries to deal with the packet loss by adjusting the retries for best performance
 /* From my tests I found that the recommended values for best performance are:
-(Big loss: the timeout should be as low as possible and max_retries as big as possible)
- * 0% loss: 5 retries, 1 timeout_sec
- * 2% loss: 100 retries, 1000 timeout_usec
- * 5% loss: 400 retries, 100 timeout_usec
- * 10% loss: 500 retries, 15 timeout_usec
- * 50% loss: 1000 retries, 15 timeout_usec
- * 75% loss: 10000 retries, 15 timeout_usec
+(Big loss: max_retries as big as possible)
+ * 0-5% loss: 100 retries
+ * 10% loss: 400 retries
+ * 40% loss: 500 retries
+ * 50% loss: 5000 retries
+ * 75% loss: 10000 retries
 */
 float loss_optimization(){
     // this is not the best but It does do a great job dealing with high losses
     float packet_loss = calculate_packet_loss();
 
-    if (packet_loss < 1) {
-        MAX_RETRIES = 100;
-        TIMEOUT_SEC = 1;
-        TIMEOUT_USEC = 0;
-    } else if (packet_loss < 2) {
+    if (packet_loss < 6) {
         MAX_RETRIES = 100;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 1000;
-    } else if (packet_loss < 6) {
-        MAX_RETRIES = 100;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 500;
     } else if (packet_loss < 11) {
         MAX_RETRIES = 400;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 100;
     } else if (packet_loss < 43) {
         MAX_RETRIES = 500;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 15;
     } else if (packet_loss < 53) {
         MAX_RETRIES = 5000;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 15;
     } else {
         MAX_RETRIES = 10000;
-        TIMEOUT_SEC = 0;
-        TIMEOUT_USEC = 0;
     }
 
     return packet_loss;
-}
\ No newline at end of file
+}
+
+// Takes an RTT sample into the smoothed RTT and its variance (RFC 6298)
+void rudp_rtt_update(rudp_connection *conn, uint64_t rtt) {
+    if (conn->srtt_usec == 0){
+        conn->srtt_usec = max(rtt, 1);
+        conn->rttvar_usec = rtt / 2;
+        return;
+    }
+    uint64_t deviation = conn->srtt_usec > rtt ? conn->srtt_usec - rtt : rtt - conn->srtt_usec;
+    conn->rttvar_usec = (3 * conn->rttvar_usec + deviation) / 4;
+    conn->srtt_usec = max((7 * conn->srtt_usec + rtt) / 8, 1);
+}
+
+// How long to wait for the ACK of the oldest packet in flight - doubled for every timeout in a row (backoff)
+uint64_t rudp_rto(rudp_connection *conn, int backoff) {
+    uint64_t rto = RUDP_INITIAL_RTO_USEC;
+    if (conn != NULL && conn->srtt_usec > 0){
+        // kernel timestamps measure the network alone, but the timer runs here - where the ACK only shows up once we
+        // woke up to read it
+        rto = max(conn->srtt_usec + 4 * conn->rttvar_usec + (conn->timestamping ? conn->wakeup_usec : 0), RUDP_MIN_RTO_USEC);
+    }
+    for (int i = 0; i < backoff && rto < RUDP_MAX_RTO_USEC; i++){
+        rto *= 2;
+    }
+    return min(rto, RUDP_MAX_RTO_USEC);
+}
@@ -3,10 +3,12 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include "Histogram.h"
 
 // #define _DEBUG
 
@@ -15,30 +17,136 @@
 */
 #define RUDP_MAX_PACKET_SIZE 576        // Sources: RFC 791, RFC 1122, RFC 2460
 
-// !!! We decided to remove the timeout (its faster this way), so we raised the MAX_RETRIES to give the ack a chance to arrive.
-// !!! It does consume more bandwidth so if thats important we can raise TIMEOUT_USEC to 10000.
-// !!! I tested the speeds with various timeouts and 0 performed the best but we decided to leave this option here
-/* Recommended values for best performance: (Big loss: the timeout should be as low as possible and max_retries as big as possible)
- * 0% loss: 5 retries, 1 timeout_sec
- * 2% loss: 100 retries, 1000 timeout_usec
- * 5% loss: 400 retries, 100 timeout_usec
- * 10% loss: 500 retries, 15 timeout_usec
- * 50% loss: 1000 retries, 15 timeout_usec
- * 75% loss: 10000 retries, 15 timeout_usec
+// !!! The retries are still picked from the measured packet loss (see loss_optimization() in RUDP_API.c), but the
+// !!! timeouts are not - a fixed table of them fired long before the ACKs of a slower link could arrive. They come
+// !!! from the RTT samples of the connection now (RUDP_*_RTO_USEC below).
+/* Recommended retries: (Big loss: max_retries as big as possible)
+ * 0-5% loss: 100 retries
+ * 10% loss: 400 retries
+ * 40% loss: 500 retries
+ * 50% loss: 5000 retries
+ * 75% loss: 10000 retries
 */
 // #define MAX_RETRIES 10000
-// #define TIMEOUT_SEC 0
-// #define TIMEOUT_USEC 100
-// Changes them to static and placed it into RUDP_API.c so they can be modified during the run according to the calculated packet loss
+// Changes it to static and placed it into RUDP_API.c so it can be modified during the run according to the calculated packet loss
 
 #define SERVER 1
 #define CLIENT 0
 
-#define EXIT_MESSAGE 0      // Exit message is sending 0 as of "we have 0 bytes to send"
 #define MB 1048576
 
 #define FAIL 1
 
+// Flow control: windows are counted in packets
+#define RUDP_DEFAULT_WINDOW 32          // packets the sender keeps in flight before waiting for ACKs
+#define RUDP_MAX_WINDOW 256             // upper bound for the send window (size of the in-flight table)
+#define RUDP_REASSEMBLY_SLOTS 64        // out of order packets the receiver can hold for reassembly
+#define RUDP_PROBE_MIN_USEC 1000        // first zero-window probe interval, doubled after every probe
+#define RUDP_PROBE_MAX_USEC 500000      // zero-window probe interval cap
+
+// Retransmission timeout (RFC 6298) - smoothed RTT + 4 * RTT variance, from the connection's own RTT samples
+#define RUDP_INITIAL_RTO_USEC 1000000   // until the first RTT sample
+#define RUDP_MIN_RTO_USEC 200           // floor - shorter timers would fire on the scheduler's jitter, not on loss
+#define RUDP_MAX_RTO_USEC 1000000       // cap of the doubling after every timeout in a row
+#define RUDP_DUP_ACKS 3                 // duplicate ACKs that resend the oldest packet without waiting for its timer
+
+// Loss-adaptive packet sizing (see rudp_set_packet_sizing()), in data bytes per packet
+#define RUDP_MIN_DATA_SIZE 128
+#define RUDP_SIZING_INTERVAL 64         // new packets between two size decisions
+#define RUDP_SIZING_SHRINK_LOSS 5       // percent of them resent that halves the size
+#define RUDP_SIZING_GROW_LOSS 1         // below this percent the size grows by a quarter
+#define RUDP_SIZING_QUEUE_USEC 1000     // smoothed RTT this far above twice the min RTT - losses come from a queue, not the link
+
+// NAK-based bulk transfers (see rudp_send_bulk())
+#define RUDP_BULK_DEFAULT_RATE (100 * MB)       // bytes per second
+#define RUDP_BULK_MIN_RATE MB                   // the pacer never slows down below this
+#define RUDP_BULK_ROUND_SIZE (64 * MB)          // both sides split a bulk transfer into rounds of this size, each ends with a repair phase
+#define RUDP_BULK_NAK_USEC 10000                // the receiver reports its gaps this often
+#define RUDP_BULK_RESEND_SLACK_USEC 2000        // a resent packet is not resent again for an RTT and this much
+#define RUDP_BULK_CONGESTION_LOSS 10            // percent of the packets sent in a report interval reported lost that slow the pace down
+#define RUDP_BULK_QUEUE_USEC 5000               // an RTT this far above twice the lowest one - a queue (the receiver's too) is growing
+#define RUDP_BULK_MAX_BURST_USEC 1000           // sending time a late pacer may catch up on at once
+#define RUDP_BULK_MAX_PROBES 100                // end of round probes in a row the receiver may leave unanswered
+#define RUDP_BULK_RCVBUF (8 * MB)               // SO_RCVBUF of a receiver that accepted bulk transfers
+
+// Striped bulk transfers (see rudp_set_stripes())
+#define RUDP_MAX_STRIPES 8                      // UDP flows of one connection, its own socket included
+#define RUDP_STRIPE_POLL_USEC 1000              // how often the receiver's threads look up from their sockets
+
+// Busy polling (see rudp_set_busy_poll())
+#define RUDP_BUSY_POLL_MAX_USEC 1000000 // the most a single wait may spin
+
+// Kernel timestamps (see rudp_set_timestamping())
+#define RUDP_TX_STAMP_KEYS 1024         // sends whose transmit timestamp may still be on its way
+
+// Streams (see rudp_send_streams())
+#define RUDP_MAX_STREAMS 256            // stream ids are a byte
+#define RUDP_DEFAULT_STREAM 0           // what rudp_send() / rudp_recv() and the bulk transfers use
+
+// Capabilities, offered in the SYN and accepted in its ACK
+#define RUDP_CAP_COMPRESSION 0x01       // packets flagged as compressed carry an LZ4 block instead of raw data
+#define RUDP_CAP_BULK 0x02              // bulk transfers are paced and repaired from NAK reports instead of acknowledged
+#define RUDP_CAP_STRIPES 0x04           // bulk packets are spread over several UDP flows, the ACK of the SYN lists the receiver's ports
+#define RUDP_SUPPORTED_CAPS (RUDP_CAP_COMPRESSION | RUDP_CAP_BULK | RUDP_CAP_STRIPES)
+#define RUDP_MAX_CHUNK_SIZE 2048        // max raw bytes in a single compressed packet - rudp_recv's buffer should fit it
+
+#define RUDP_IMPAIR_ENV "RUDP_IMPAIR"   // impairments applied to every packet we send (see Common/Impair.h)
+
+/*
+ * Structs:
+*/
+// Counters of a single connection, see rudp_get_stats(). Bytes are counted on the wire (whole datagrams).
+typedef struct _rudp_stats {
+    uint64_t packets_sent;          // every datagram, retransmits and ACKs included
+    uint64_t bytes_sent;
+    uint64_t retransmits;           // data / SYN packets sent again
+    uint64_t timeouts;              // waits for an ACK that timed out
+    uint64_t fast_retransmits;      // of the retransmits, the ones sent after RUDP_DUP_ACKS duplicate ACKs
+    uint64_t acks_sent;
+    uint64_t acks_received;
+    uint64_t naks_sent;             // bulk mode gap reports
+    uint64_t naks_received;
+    uint64_t packets_received;      // every datagram
+    uint64_t bytes_received;
+    uint64_t duplicates;            // data packets we already had
+    uint64_t out_of_order;          // data packets kept for reassembly
+    uint64_t data_received;         // data bytes of the new data packets (as sent - compressed ones count their compressed size)
+    uint64_t gaps;                  // data packets found missing when a later one arrived - lost (or overtaken)
+    uint64_t gaps_filled;           // data packets that arrived after a later one - resent (or overtaken)
+    uint64_t checksum_failures;     // dropped corrupted packets
+    int max_tries;                  // most sends a single packet needed
+    uint64_t rto_usec;              // the retransmission timeout the connection uses now (without the backoff)
+    uint64_t resizes;               // packet size changes (rudp_set_packet_sizing())
+    uint64_t kernel_rtt_samples;    // RTT samples taken from kernel timestamps (rudp_set_timestamping())
+    uint64_t hardware_rtt_samples;  // of them, the ones the NIC stamped on both ends
+    histogram rtt;                  // microseconds, from packets acknowledged without being resent (Karn)
+    histogram delivery;             // microseconds from a packet's first send until it was acknowledged
+    histogram packet_data;          // data bytes (before compression) of every new data packet
+    histogram wakeup;               // microseconds from the kernel receiving a packet until we read it (rudp_set_timestamping())
+} rudp_stats;
+
+// A receiver's progress so far, see rudp_get_progress()
+typedef struct _rudp_progress {
+    uint64_t data_received;         // like rudp_stats
+    uint64_t resent;                // gaps_filled and duplicates - copies the sender sent again
+    uint64_t gaps;
+} rudp_progress;
+
+// Data for one stream of rudp_send_streams()
+typedef struct _rudp_stream_data {
+    uint8_t stream;
+    const struct iovec *iov;        // packetized as one piece of the stream, like rudp_sendv() does
+    int iovcnt;
+} rudp_stream_data;
+
+// The system calls behind the RUDP functions - replaced by RUDP_Replay with a virtual network and clock
+typedef struct _rudp_io {
+    ssize_t (*sendto)(int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len);
+    ssize_t (*recvfrom)(int sock, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len);
+    int (*wait_readable)(int sock, uint64_t timeout_usec);      // 1 if a packet is waiting, 0 on timeout
+    uint64_t (*now_usec)();                                     // a monotonic clock
+} rudp_io;
+
 /*
  * API Functions:
 */
@@ -57,21 +165,207 @@
 int rudp_socket(struct sockaddr_in *my_addr, int peer_type, uint16_t *seq_number);
 
 /* 
- * @brief Sending data to the peer. Waits for an acknowledgement package, if not received, resends the data.
+ * @brief Sending data to the peer. Keeps up to min(send window, peer's advertised window) packets in flight,
+ *        resends the oldest unacknowledged packet on timeout and probes the peer while its window is closed.
  * @param 
  * @return 
 */
 int rudp_send(int sock_id, void *data, size_t data_size, int flags, struct sockaddr_in *to, uint16_t* seq_number);
 
 /* 
- * @brief Receives data from peer.
+ * @brief Like rudp_send(), for data spread over several buffers. The buffers are packetized as one stream,
+ *        so a small header buffer shares its packet with the first bytes of the next buffer.
+ * @return The amount of bytes sent.
+*/
+ssize_t rudp_sendv(int sock_id, const struct iovec *iov, int iovcnt, int flags, struct sockaddr_in *to, uint16_t* seq_number);
+
+/* 
+ * @brief Sends data on several streams at once. The streams take turns packet by packet in the same window, so a short
+ *        message on one stream goes out (and is delivered by rudp_recv_stream()) without waiting for a long one on another.
+ *        Sequence numbers, ACKs and retransmissions stay the connection's, but each stream counts its own offsets.
+ * @param streams count different streams (ids from 0 to RUDP_MAX_STREAMS - 1).
+ * @return The amount of bytes sent on all the streams, -1 if the streams are invalid.
+*/
+ssize_t rudp_send_streams(int sock_id, const rudp_stream_data *streams, int count, struct sockaddr_in *to, uint16_t *seq_number);
+
+/* 
+ * @brief Receives the data of the next packet that is in order within its own stream, whatever the stream: a lost
+ *        packet only holds back the packets of its stream, the others are delivered ahead of it (and only their place
+ *        in the sequence is kept, for the ACKs).
+ * @param stream Set to the stream the data belongs to.
+ * @param data_size Should fit a whole packet (RUDP_MAX_CHUNK_SIZE, if compression was negotiated).
+ * @note Don't mix with rudp_recv_direct() / rudp_recv_bulk() while other streams are still in flight.
+ * @return The amount of bytes received, -1 on failure.
+*/
+ssize_t rudp_recv_stream(int sock, uint8_t *stream, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq);
+
+/* 
+ * @brief Receives data from peer. Out of order packets are kept for reassembly, every ACK advertises
+ *        the free reassembly space (limited by SO_RCVBUF) as the receive window.
  * @param 
  * @return 
 */
 int rudp_recv(int sock, void * data, size_t data_size, struct sockaddr_in *client_addr, uint16_t* seq);
 
+/*
+ * @brief Receives the next data_size bytes of the stream straight into data. Every packet is copied to its
+ *        final place when it arrives, out of order ones included, so data can be a mapped file.
+ * @note data_size should end where one of the sender's rudp_sendv() calls ends - a packet that runs past it
+ *       is left for the next rudp_recv().
+ * @return The amount of bytes received (less than data_size only if a packet didn't fit), -1 on failure.
+*/
+ssize_t rudp_recv_direct(int sock, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq);
+
+/* 
+ * @brief Sends data_size bytes as a bulk transfer, when the peer accepted one in the handshake (see rudp_set_bulk()):
+ *        packets are paced at the bulk rate without waiting for ACKs, the receiver reports the missing ones in
+ *        periodic NAK reports and they are resent. Every report interval, the pace slows down by an eighth if the
+ *        reports missed RUDP_BULK_CONGESTION_LOSS percent of the packets sent in it (random loss doesn't) or their
+ *        RTT shows a growing queue, and grows back by a sixteenth otherwise. After every RUDP_BULK_ROUND_SIZE bytes, the sender probes the receiver for the
+ *        last gaps until a single ACK confirms the round. Packets are full and never compressed.
+ * @note The receiver must call rudp_recv_bulk() with the same size. Without the capability, this is rudp_send().
+ * @return The amount of bytes sent.
+*/
+ssize_t rudp_send_bulk(int sock_id, const void *data, size_t data_size, struct sockaddr_in *to, uint16_t *seq_number);
+
+/*
+ * @brief Receives a bulk transfer of data_size bytes (see rudp_send_bulk()) straight into data, every packet
+ *        copied to its place as it arrives. Without the capability, this is rudp_recv_direct().
+ * @return The amount of bytes received, -1 on failure.
+*/
+ssize_t rudp_recv_bulk(int sock, void *data, size_t data_size, struct sockaddr_in *client_addr, uint16_t *seq);
+
+/* 
+ * @brief The capabilities negotiated in the connection's handshake (RUDP_CAP_*).
+ * @return The capabilities, -1 if sock is not an RUDP socket.
+*/
+int rudp_get_capabilities(int sock);
+
+/* 
+ * @brief Offers bulk transfers (see rudp_send_bulk()) in the next rudp_socket() handshake.
+ * @param rate The most bytes per second the pacer sends, 0 to stay with acknowledged transfers.
+ * @note Must be called before rudp_socket(). Receiving bulk transfers is always supported.
+*/
+void rudp_set_bulk(uint64_t rate);
+
+/* 
+ * @brief Spreads the packets of bulk transfers over several UDP flows, so the receiving NIC hashes them to
+ *        different queues and cores. The receiver opens a socket (an ephemeral port) for every flow but the
+ *        connection's own and drains each on a thread of its own, placing the packets of the shared round in the
+ *        same buffer. Packet i of a round always travels on flow i % count, so a packet has a single writer;
+ *        the NAK reports and ACKs stay on the connection's socket.
+ * @param count 1 - RUDP_MAX_STRIPES flows, 1 to keep to the connection's socket.
+ * @return 0 on success, -1 if count is out of range.
+ * @note Must be called before rudp_socket(), and takes effect only with bulk transfers (see rudp_set_bulk()).
+ *       The receiver's threads don't trace the packets they drain.
+*/
+int rudp_set_stripes(int count);
+
+/* 
+ * @brief Asks the peer to compress packets that shrink (negotiated during the handshake).
+ * @param enable 1 to offer compression in the next rudp_socket() handshake, 0 to send raw data only.
+ * @note Must be called before rudp_socket(). Receiving compressed packets is always supported.
+*/
+void rudp_set_compression(int enable);
+
+/* 
+ * @brief Runs every packet this process sends through the impairment simulator (loss, delay, etc.).
+ * @param spec The impairments, see Common/Impair.h. NULL turns the simulator off.
+ * @return 0 on success, -1 if the spec is invalid.
+ * @note The spec can also be given in the RUDP_IMPAIR environment variable, read by rudp_socket().
+*/
+int rudp_set_impairment(const char *spec);
+
+/* 
+ * @brief Records the packet events of every connection created afterwards (see RUDP_Trace.h),
+ *        and writes them to a file when the connection is closed. RUDP_TraceDump converts the file to JSON.
+ * @param path The trace file. NULL turns tracing off.
+ * @note Must be called before rudp_socket(). The path can also be given in the RUDP_TRACE environment variable.
+*/
+void rudp_set_trace(const char *path);
+
+/* 
+ * @brief Sizes the socket buffers (and the send window) of every connection created afterwards from the path's
+ *        bandwidth-delay product, see Common/Tuning.h. The sender measures the RTT in the handshake and the rate
+ *        in its first big rudp_sendv(), the receiver grows its buffer to hold twice its reassembly window.
+ *        What was chosen is printed. On by default.
+*/
+void rudp_set_autotune(int enable);
+
+/* 
+ * @brief Adapts the data size of the packets rudp_send() makes to the path: every RUDP_SIZING_INTERVAL packets,
+ *        the size halves if at least RUDP_SIZING_SHRINK_LOSS percent of them were resent (smaller packets cost less
+ *        to resend) and grows by a quarter, up to a full packet, while less than RUDP_SIZING_GROW_LOSS percent
+ *        were (bigger packets cost less per byte). Losses while the RTT is inflated come from a queue - the size is kept.
+ * @param enable 1 to adapt, 0 to always fill packets (the default).
+ * @note Size changes are counted in rudp_stats.resizes, the sizes used in rudp_stats.packet_data.
+*/
+void rudp_set_packet_sizing(int enable);
+
+/* 
+ * @brief Low latency mode: every wait for a packet spins on non-blocking receives for up to budget_usec before it
+ *        sleeps in select() (or a blocking recvfrom()), saving the sleep and wakeup, and the sockets ask the kernel to
+ *        busy poll the device queue as well (SO_BUSY_POLL, where the kernel allows it). The thread that calls rudp_socket()
+ *        can also be pinned to a CPU of its own. The RTT percentiles in rudp_get_stats() show what it gained.
+ * @param budget_usec 0 - RUDP_BUSY_POLL_MAX_USEC, 0 sleeps right away (the default).
+ * @param cpu The CPU to pin the I/O thread to, -1 to leave it to the scheduler.
+ * @return 0 on success, -1 if budget_usec is out of range.
+ * @note Must be called before rudp_socket(). A spinning thread takes a whole core - best on dedicated ones.
+*/
+int rudp_set_busy_poll(uint64_t budget_usec, int cpu);
+
+/* 
+ * @brief Takes the RTT samples from kernel timestamps (SO_TIMESTAMPING) instead of our clock: the kernel stamps every
+ *        packet as it receives it (and the ACK's stamp ends the sample), and every data packet of rudp_send() as it
+ *        leaves (the stamp comes back on the socket's error queue), so the samples leave out the time we took to get
+ *        scheduled, wake up and make the system calls. The NIC's own stamps are used when both ends have them
+ *        (the device's stamping must be turned on already, e.g. by ptp4l or hwstamp_ctl), the kernel's software ones otherwise.
+ *        How long every packet waited in the socket before we read it is kept in rudp_stats.wakeup.
+ * @param enable 1 to timestamp the sockets of rudp_socket(), 0 to sample with CLOCK_MONOTONIC (the default).
+ * @note Must be called before rudp_socket(). With the impairment simulator (which may drop or hold back a packet after
+ *       rudp_send() sent it) packets are stamped as they are handed to it, and bulk rounds keep their own RTT samples.
+*/
+void rudp_set_timestamping(int enable);
+
+/* 
+ * @brief Sets the most packets the sender keeps in flight (the peer's window still applies).
+ * @param packets 1 - RUDP_MAX_WINDOW.
+ * @return 0 on success, -1 if sock is not an RUDP socket or packets is out of range.
+*/
+int rudp_set_send_window(int sock, int packets);
+
+/* 
+ * @brief Copies the connection's counters and latency histograms.
+ * @param sock A socket returned by rudp_socket() and not closed yet.
+ * @return 0 on success, -1 if sock is not an RUDP socket.
+*/
+int rudp_get_stats(int sock, rudp_stats *stats);
+
+/* 
+ * @brief Reads the receiver's progress counters, and only those, so another thread can follow a transfer (e.g. report
+ *        it every second) while this one receives.
+ * @return 0 on success, -1 if sock is not an RUDP socket.
+ * @note The threads of striped bulk rounds (rudp_set_stripes()) add their packets at the end of every round.
+ *       The socket must not be closed meanwhile.
+*/
+int rudp_get_progress(int sock, rudp_progress *progress);
+
+/* 
+ * @brief Prints the counters and the latency percentiles of rudp_get_stats().
+*/
+void rudp_print_stats(const rudp_stats *stats);
+
+/* 
+ * @brief Sends, receives, waits and reads the time through the given functions instead of the system's,
+ *        and resets the packet loss estimate (so every replayed scenario starts the same).
+ * @param io The functions, NULL goes back to sendto(), recvfrom(), select() and CLOCK_MONOTONIC.
+ * @note rudp_socket() still creates a real UDP socket, but no packet goes through it.
+*/
+void rudp_set_io(const rudp_io *io);
+
 /* 
- * @brief Closes a connection between peers.
+ * @brief Closes a connection between peers. A receiver keeps acknowledging resent packets for a second first,
+ *        in case the sender didn't get its last ACK.
  * @param 
  * @return 
 */
@@ -0,0 +1,318 @@
+#include "RUDP_API.h"
+#include "RUDP_Packet.h"
+#include "Payload.h"
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Microbenchmarks of the RUDP hot path - checksums, building and parsing packets, allocations, the loss
+ * estimate and the send path (with and without the kernel). Built with optimizations by `make bench`.
+ * Every benchmark runs until it takes BENCH_MIN_NSEC, the best of BENCH_REPEATS runs is printed as CSV:
+ *   name,bytes,iterations,cycles_per_op,ns_per_op,cycles_per_byte,mb_per_s
+ * Cycles are TSC ticks on x86 (calibrated against CLOCK_MONOTONIC), nanoseconds elsewhere.
+*/
+
+/*
+ * Defines:
+*/
+#define USAGE "[-only <name prefix>] [-quick]\n"
+#define BENCH_MIN_NSEC 100000000ull     // run every benchmark at least this long (0.1s)
+#define BENCH_REPEATS 5
+#define RUDP_DATA_SIZE (sizeof(((rudp_packet *)0)->data))
+
+/*
+ * Internal RUDP functions (RUDP_API.c):
+*/
+rudp_packet* create_packet(void *data, size_t data_size, int seq_ack_number);
+rudp_packet* create_compressed_packet(void *data, size_t *data_size, size_t capacity, int seq_ack_number);
+int rudp_send_packet(rudp_packet* packet, int sock_id, struct sockaddr_in *to);
+void rudp_transmit(rudp_packet* packet, int sock_id, struct sockaddr_in *to, int try_number);
+
+/*
+ * Structs:
+*/
+// What a benchmark works on, prepared by main()
+typedef struct _bench_context {
+    size_t bytes;                   // bytes processed by a single operation (0 - not a throughput benchmark)
+    char data[RUDP_DATA_SIZE];
+    char compressible[2048];
+    rudp_packet packet;             // a packet as it arrives, checksum included
+    int sock;                       // the sending socket, for the send path benchmarks
+    struct sockaddr_in to;
+} bench_context;
+
+typedef void (*bench_function)(bench_context *context, uint64_t iterations);
+
+/*
+ * Static:
+*/
+static volatile uint64_t sink;          // results go here, so the compiler can't drop the work
+static double cycles_per_nsec = 1;
+static uint64_t min_nsec = BENCH_MIN_NSEC;
+
+/*
+ * Functions:
+*/
+static inline uint64_t bench_cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t bench_nsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// measures the cycle counter against the monotonic clock
+static void bench_calibrate(){
+    uint64_t start_nsec = bench_nsec(), start_cycles = bench_cycles();
+    while (bench_nsec() - start_nsec < 50000000);
+    cycles_per_nsec = (double)(bench_cycles() - start_cycles) / (bench_nsec() - start_nsec);
+}
+
+static void bench_checksum(bench_context *context, uint64_t iterations){
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++){
+        sum += calculate_checksum(context->data, context->bytes);
+    }
+    sink = sum;
+}
+
+static void bench_create_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet *packet = create_packet(context->data, context->bytes, i);
+        sink = packet->header.checksum;
+        free(packet);
+    }
+}
+
+static void bench_create_compressed_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        size_t size = context->bytes;
+        rudp_packet *packet = create_compressed_packet(context->compressible, &size, RUDP_MAX_PACKET_SIZE, i);
+        sink = size;
+        free(packet);
+    }
+}
+
+// what the receiver does with a packet before using its data: verify it and read the header
+static void bench_parse_packet(bench_context *context, uint64_t iterations){
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet *packet = &context->packet;
+        if (packet->header.checksum == calculate_checksum(packet->data, sizeof(packet->data)) && !packet->header.flags.ack){
+            total += packet->header.seq_ack_number + packet->header.length + packet->header.offset;
+        }
+    }
+    sink = total;
+}
+
+static void bench_malloc_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet *packet = (rudp_packet *)malloc(sizeof(rudp_packet));
+        sink = (uintptr_t)packet;
+        free(packet);
+    }
+}
+
+static void bench_calloc_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet *packet = (rudp_packet *)calloc(1, sizeof(rudp_packet));
+        sink = packet->header.length;
+        free(packet);
+    }
+}
+
+// the alternative to allocating - a packet on the stack, cleared like create_packet() clears it
+static void bench_stack_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet packet;
+        memset(&packet, 0, sizeof packet);
+        __asm__ volatile("" : : "r"(&packet) : "memory");
+        sink = packet.header.length;
+    }
+}
+
+static void bench_loss_optimization(bench_context *context, uint64_t iterations){
+    float total = 0;
+    for (uint64_t i = 0; i < iterations; i++){
+        total += loss_optimization();
+    }
+    sink = (uint64_t)total;
+}
+
+static void bench_transmit(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_transmit(&context->packet, context->sock, &context->to, 1);
+    }
+}
+
+static void bench_send_packet(bench_context *context, uint64_t iterations){
+    for (uint64_t i = 0; i < iterations; i++){
+        rudp_packet *packet = create_packet(context->data, context->bytes, (uint16_t)i);
+        rudp_send_packet(packet, context->sock, &context->to);
+    }
+}
+
+static ssize_t null_sendto(int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len){
+    return len;
+}
+
+// answers every data packet with the ACK rudp_send_packet() waits for, until a packet flagged NUL arrives
+static void* bench_responder(void *arg){
+    int sock = *(int *)arg;
+    rudp_packet packet;
+    struct sockaddr_in from;
+    while (1){
+        socklen_t from_len = sizeof from;
+        if (recvfrom(sock, &packet, sizeof packet, 0, (struct sockaddr *)&from, &from_len) <= 0 || packet.header.flags.nul)
+            break;
+        uint16_t seq = packet.header.seq_ack_number + 1;
+        memset(&packet, 0, sizeof packet);
+        packet.header.seq_ack_number = seq;
+        packet.header.flags.ack = 1;
+        packet.header.flags.nul = 1;
+        packet.header.window = RUDP_DEFAULT_WINDOW;
+        packet.header.checksum = calculate_checksum(packet.data, sizeof(packet.data));
+        sendto(sock, &packet, sizeof packet, 0, (struct sockaddr *)&from, from_len);
+    }
+    return NULL;
+}
+
+// runs a benchmark until it takes min_nsec, BENCH_REPEATS times, and prints the best run
+static void bench_run(const char *name, const char *only, bench_function function, bench_context *context){
+    if (only != NULL && strncmp(name, only, strlen(only)) != 0){
+        return;
+    }
+    uint64_t iterations = 1;
+    function(context, 1);       // warm up
+    while (1){
+        uint64_t start = bench_nsec();
+        function(context, iterations);
+        uint64_t elapsed = bench_nsec() - start;
+        if (elapsed >= min_nsec / BENCH_REPEATS)
+            break;
+        iterations *= elapsed < min_nsec / BENCH_REPEATS / 16 ? 8 : 2;
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < BENCH_REPEATS; r++){
+        uint64_t start = bench_cycles();
+        function(context, iterations);
+        uint64_t cycles = bench_cycles() - start;
+        if (cycles < best)
+            best = cycles;
+    }
+
+    double cycles_per_op = (double)best / iterations;
+    double ns_per_op = cycles_per_op / cycles_per_nsec;
+    printf("%s,%zu,%llu,%.2f,%.2f,", name, context->bytes, (unsigned long long)iterations, cycles_per_op, ns_per_op);
+    if (context->bytes > 0)
+        printf("%.4f,%.2f\n", cycles_per_op / context->bytes, context->bytes / ns_per_op * 1e9 / MB);
+    else
+        printf(",\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+    const char *only = NULL;
+    for (int i = 1; i < argc; i++){
+        if (!strcmp(argv[i], "-only") && i + 1 < argc){
+            // Run the benchmarks whose name starts with this
+            only = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-quick")){
+            // Shorter runs, noisier numbers
+            min_nsec = BENCH_MIN_NSEC / 10;
+        }
+        else {
+            fprintf(stderr, "Usage: %s %s", argv[0], USAGE);
+            exit(FAIL);
+        }
+    }
+
+    bench_context *context = (bench_context *)calloc(1, sizeof(bench_context));
+    if (context == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        exit(FAIL);
+    }
+    payload_fill(context->data, sizeof context->data, 0, PAYLOAD_RANDOM, PAYLOAD_DEFAULT_SEED);
+    payload_fill(context->compressible, sizeof context->compressible, 0, PAYLOAD_COMPRESSIBLE, PAYLOAD_DEFAULT_SEED);
+    memcpy(context->packet.data, context->data, sizeof context->data);
+    context->packet.header.length = sizeof context->data;
+    context->packet.header.seq_ack_number = 1;
+    context->packet.header.checksum = calculate_checksum(context->packet.data, sizeof(context->packet.data));
+
+    bench_calibrate();
+    printf("name,bytes,iterations,cycles_per_op,ns_per_op,cycles_per_byte,mb_per_s\n");
+
+    size_t sizes[] = {64, 256, RUDP_DATA_SIZE};
+    char name[64];
+    for (size_t s = 0; s < sizeof sizes / sizeof *sizes; s++){
+        context->bytes = sizes[s];
+        snprintf(name, sizeof name, "checksum_%zu", sizes[s]);
+        bench_run(name, only, bench_checksum, context);
+    }
+
+    context->bytes = RUDP_DATA_SIZE;
+    bench_run("create_packet", only, bench_create_packet, context);
+    bench_run("parse_packet", only, bench_parse_packet, context);
+    context->bytes = sizeof context->compressible;
+    bench_run("create_compressed_packet", only, bench_create_compressed_packet, context);
+
+    context->bytes = 0;
+    bench_run("alloc_malloc_packet", only, bench_malloc_packet, context);
+    bench_run("alloc_calloc_packet", only, bench_calloc_packet, context);
+    bench_run("alloc_stack_packet", only, bench_stack_packet, context);
+    bench_run("loss_optimization", only, bench_loss_optimization, context);
+
+    // the send path: without the kernel, then through a loopback socket (nobody reads it - datagrams are dropped)
+    int receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    context->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    socklen_t to_len = sizeof context->to;
+    context->to.sin_family = AF_INET;
+    context->to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (receiver == -1 || context->sock == -1 || bind(receiver, (struct sockaddr *)&context->to, sizeof context->to) == -1
+        || getsockname(receiver, (struct sockaddr *)&context->to, &to_len) == -1){
+        perror("socket");
+        exit(FAIL);
+    }
+    rudp_io null_io = {null_sendto, recvfrom, NULL, NULL};
+    rudp_set_io(&null_io);
+    context->bytes = sizeof(rudp_packet);
+    bench_run("transmit_null_io", only, bench_transmit, context);
+    rudp_set_io(NULL);
+    bench_run("transmit_loopback", only, bench_transmit, context);
+
+    // a whole stop-and-wait round trip: send, wait for the ACK, receive it
+    rudp_packet dropped;
+    while (recv(receiver, &dropped, sizeof dropped, MSG_DONTWAIT) > 0);     // what transmit_loopback left behind
+    pthread_t responder;
+    if (pthread_create(&responder, NULL, bench_responder, &receiver) != 0){
+        fprintf(stderr, "ERROR! Failed to start the responder thread!\n");
+        exit(FAIL);
+    }
+    rudp_set_io(NULL);      // resets the loss estimate
+    context->bytes = RUDP_DATA_SIZE;
+    bench_run("send_packet_loopback_rtt", only, bench_send_packet, context);
+
+    rudp_packet *stop = create_packet(NULL, 0, 0);
+    stop->header.flags.nul = 1;
+    rudp_transmit(stop, context->sock, &context->to, 1);
+    free(stop);
+    pthread_join(responder, NULL);
+    close(receiver);
+    close(context->sock);
+    free(context);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "RUDP_API.h"
+
+/*
+ * The RUDP packet, as it is sent on the wire. Internal to the RUDP implementation (and its tools).
+*/
+
+/* RUDP: (built "on top" of the regular UDP)
+    0 1 2 3 4 5 6 7 8            15 16                            31 
+   +-+-+-+-+-+-+-+-+---------------++-+-+-+-+-+-+-+-+---------------+
+   |                               |                                |
+   |              Length           |            Checksum            |
+   |                               |                                |
+   |                               |                                |
+   +-+-+-+-+-+-+-+-+---------------++-+-+-+-+-+-+-+-+---------------+
+   |  Sequence #   |   Ack Number  ||            Window              |
+   |               |               ||       (free packet slots)      |
+   +---------------+---------------++--------------------------------+
+   |                             Offset                              |
+   |          (low 32 bits of the data's position in the stream)     |
+   +-----------------------------------------------------------------+
+   |S|A|E|R|N|C|T|C|               |
+   |Y|C|A|S|U|H|C|M|    Stream     |
+   |N|K|K|T|L|K|S|P|               |
+   +-+-+-+-+-+-+-+-+---------------+
+
+   A connection carries up to RUDP_MAX_STREAMS independent ordered streams (see rudp_send_streams()). Sequence numbers,
+   ACKs and the window are the connection's, but the offset counts the bytes of the packet's own stream, so the
+   receiver delivers a packet as soon as its stream is complete up to it. Stream 0 is the connection's default stream.
+
+   Bulk transfers (RUDP_CAP_BULK) use the EAK flag: an ACK flagged EAK is a NAK report, its data is the
+   rudp_nak_range list of packets missing from the round (and its offset the index of the packet that arrived last,
+   which gives the sender an RTT sample), and a NUL flagged EAK is the sender's end of round probe.
+   Inside a round, every packet carries the round's sequence number and is told apart by its offset.
+*/
+
+/*
+ * Structs:
+*/
+// UDP header will be created on top of this
+typedef struct _flags {
+    uint8_t syn : 1;       // indicates a sync segment in present
+    uint8_t ack : 1;       // indicates the ack num in the header is valid
+    uint8_t eak : 1;       // bulk mode - a NAK report (with ACK) or an end of round probe (with NUL)
+    uint8_t rst : 1;       // not used
+    uint8_t nul : 1;       // indicates a null segment packet
+    uint8_t chk : 1;       // 0 - checksum contains header only. 1 - checksum contains header and data.
+    uint8_t tcs : 1;       // not used
+    uint8_t cmp : 1;       // the data is an LZ4 block (compression was negotiated in the handshake)
+} flags_bitfield;
+
+typedef struct _rudp_packet_header {
+    uint16_t length;      // length of the data itself, without the RUDP header
+    uint16_t checksum;      // used to validate the corectness of the data
+    uint16_t seq_ack_number;    // when sending a packet - seq number is stored here. when sending an ack, the ack number is stored here.
+    uint16_t window;        // receive window of the packet's sender - how many more packets it can take right now
+    uint32_t offset;        // where the (uncompressed) data starts, counting every byte the sender sent on the packet's stream
+    flags_bitfield flags;          // 1 byte unassigned int - used to classify the packet (SYN, ACK, etc.)
+    uint8_t stream;         // the stream the data belongs to, 0 - the connection's default stream
+} rudp_packet_header;
+
+typedef struct _rudp_packet {
+    rudp_packet_header header;          // header, defined above
+    char data[RUDP_MAX_PACKET_SIZE - sizeof(rudp_packet_header)];      // data without header
+} rudp_packet;
+
+// Packets [first, first + count) of a bulk round are missing, as listed in a NAK report (host byte order, like the header)
+typedef struct _rudp_nak_range {
+    uint32_t first;
+    uint32_t count;
+} rudp_nak_range;
+
+#define RUDP_NAK_MAX_RANGES ((RUDP_MAX_PACKET_SIZE - sizeof(rudp_packet_header)) / sizeof(rudp_nak_range))
+
+// Datagrams carry only the used part of the data - the receiver zeroes the rest, which the checksum covers as zeros
+#define RUDP_WIRE_SIZE(packet) (sizeof((packet)->header) + (packet)->header.length)
+
+/*
+* @brief A checksum function that returns 16 bit checksum for data (RFC 1071).
+*/
+unsigned short int calculate_checksum(void *data, unsigned int bytes);
@@ -1,12 +1,17 @@
 #include "RUDP_API.h"
+#include "Framing.h"
+#include "Hash.h"
+#include "Interval.h"
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  * Defines:
 */
-#define USAGE "-p <server_port>"
+#define USAGE "-p <server_port> [-f <output_file>] [-notune] [-busypoll <usec>] [-cpu <n>] [-timestamps] [-i <sec>] [-ifile <file.csv>]"
 #define MAX_RUNS 10000
 /*
  * Strcuts:
@@ -18,22 +23,51 @@ struct
     float speed;           // speed in MB/s
 } runs[MAX_RUNS];           // runs[0] keeps the avg of all runs
 
+/*
+ * Declaring Functions:
+*/
+char* map_output_file(const char *path, uint64_t size);
+void release_payload(char *payload, uint64_t size, int mapped);
+ssize_t receive_streams(int sock, char *payload, uint64_t size, int streams, struct sockaddr_in *client, uint16_t *seq);
+void sample_counters(void *context, interval_counters *counters);
+
 /*
  * Functions:
 */
 int main(int argc, char *argv[]){
     printf("Starting Receiver...\n");
     struct sockaddr_in server, client;
+    char *file_path = NULL;         // write the received file here instead of discarding it
+    uint64_t busy_poll = 0;         // spin this long before sleeping for a packet
+    int cpu = -1;                   // pin the receiving thread here
+    double interval = 0;            // report the transfer every that many seconds (0 - only once it's done)
+    const char *interval_path = INTERVAL_DEFAULT_FILE;     // the reports' time series
     // reset address's memory before using it
     memset(&server, 0, sizeof(server));
     #ifndef _DEBUG
-    if (argc != 3){
+    if (argc < 3){
         fprintf(stderr, "Usage: %s", USAGE);
         exit(FAIL);
     }
 
     // Getting info from main's args into ip and port of server
     for (int i = 1; i < argc; i += 2){
+        if (strcmp(argv[i], "-notune") == 0){
+            // Keep the kernel's socket buffer sizes
+            rudp_set_autotune(0);
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "-timestamps") == 0){
+            // See how long packets wait in the socket before we read them
+            rudp_set_timestamping(1);
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc){
+            fprintf(stderr, "Missing value for %s! Usage: %s", argv[i], USAGE);
+            exit(FAIL);
+        }
         if (strcmp(argv[i], "-p") == 0){
             // Set port
             server.sin_port = htons(atoi(argv[i+1]));
@@ -41,6 +75,26 @@ int main(int argc, char *argv[]){
             printf("Port is set to: %d\n", atoi(argv[i+1]));
             #endif
         }
+        else if (strcmp(argv[i], "-f") == 0){
+            // Set output file
+            file_path = argv[i+1];
+        }
+        else if (strcmp(argv[i], "-busypoll") == 0){
+            // Spin on the socket instead of sleeping, for the lowest latency
+            busy_poll = strtoull(argv[i+1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-cpu") == 0){
+            // Pin the receiving thread to a CPU
+            cpu = atoi(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "-i") == 0){
+            // Report bytes, goodput, retransmits and losses every interval
+            interval = atof(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "-ifile") == 0){
+            // Write the interval reports here
+            interval_path = argv[i+1];
+        }
         else{
             fprintf(stderr, "Incorrect argument! Usage: %s", USAGE);
             exit(FAIL);
@@ -50,6 +104,10 @@ int main(int argc, char *argv[]){
     #ifdef _DEBUG
     server.sin_port = htons(2000);
     #endif
+    if (rudp_set_busy_poll(busy_poll, cpu) == -1){
+        fprintf(stderr, "Busy polling should spin for 0 - %d usec!\n", RUDP_BUSY_POLL_MAX_USEC);
+        exit(FAIL);
+    }
 
 
     server.sin_family = AF_INET;        // ipv4
@@ -61,36 +119,103 @@ int main(int argc, char *argv[]){
 
     int sock = rudp_socket((struct sockaddr_in*) &server, SERVER, &seq);
 
+    interval_reporter *reporter = NULL;
+    if (interval > 0){
+        reporter = interval_start(interval, interval_path, sample_counters, &sock);
+        if (reporter == NULL){
+            rudp_close(sock);
+            exit(FAIL);
+        }
+    }
+
     printf("Sender connected, beginning to receive the file...\n");
     int times = 0;       // Save the amount of times data is received
     struct timeval start_time, end_time;
 
-    int bytes_received, remaining_bytes, total_bytes;
+    int bytes_received;
+    uint64_t remaining_bytes, total_bytes;
+    transfer_frame frame;
     char buffer[BUFSIZ] = {0};
 
     do {
         times++;
 
-        // Receive the size of the file in bytes (Sender prepares us for the file)
-        bytes_received = rudp_recv(sock, &remaining_bytes, sizeof remaining_bytes, &client, &seq);
+        // The first packet starts with the frame header (Sender prepares us for the file), followed by the file's first bytes
+        bytes_received = rudp_recv(sock, buffer, BUFSIZ, &client, &seq);
+        gettimeofday(&start_time, NULL);        // Log current time, to calculate time later
+        if (bytes_received < (int) sizeof frame){
+            fprintf(stderr, "ERROR! Received a corrupted frame header!\n");
+            rudp_close(sock);
+            exit(FAIL);
+        }
+        memcpy(&frame, buffer, sizeof frame);
+        frame_decode(&frame);
 
         // Check if the received message is an exit message
-        if (remaining_bytes == EXIT_MESSAGE){
+        if (frame.flags & FRAME_FLAG_EXIT){
             printf("Sender sent exit message.\n");
             times--;        // don't count this message in the stats
             break;      // stop receiving
         }
 
-        total_bytes = remaining_bytes;
-        gettimeofday(&start_time, NULL);        // Log current time, to calculate time later
+        total_bytes = frame.length;
+        interval_mark(reporter, times);
+        if (bytes_received - sizeof frame > total_bytes){
+            fprintf(stderr, "ERROR! Received more data than the frame header announced!\n");
+            rudp_close(sock);
+            exit(FAIL);
+        }
+        remaining_bytes = total_bytes - (bytes_received - sizeof frame);
+
+        // the payload is hashed as it arrives and checked against the trailer that follows it
+        int hashing = (frame.flags & FRAME_FLAG_HASH) != 0;
+        xxh64_state hash;
+        xxh64_reset(&hash, HASH_SEED);
+        if (hashing)
+            xxh64_update(&hash, buffer + sizeof frame, bytes_received - sizeof frame);
+
+        int bulk = (frame.flags & FRAME_FLAG_BULK) != 0;
+        int streams = (frame.flags & FRAME_FLAG_STREAMS) ? FRAME_STREAMS(frame.flags) : 0;
+        char *payload = NULL;       // the whole payload, when it was received in place
+        hash_job payload_hash;
+        if ((file_path != NULL || bulk || streams > 0) && total_bytes > 0){
+            // Every packet is placed at its offset in the mapped file (or, for a bulk or streamed transfer, in a buffer
+            // of the whole payload) as it arrives, no matter the order
+            char *file = file_path != NULL ? map_output_file(file_path, total_bytes) : (char *) malloc(total_bytes);
+            if (file == NULL){
+                if (file_path == NULL)
+                    fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+                rudp_close(sock);
+                exit(FAIL);
+            }
+            memcpy(file, buffer + sizeof frame, bytes_received - sizeof frame);
+            char *rest = file + (total_bytes - remaining_bytes);
+            ssize_t received;
+            if (bulk)
+                received = rudp_recv_bulk(sock, rest, remaining_bytes, &client, &seq);
+            else if (streams > 0)
+                received = receive_streams(sock, rest, remaining_bytes, streams, &client, &seq);
+            else
+                received = rudp_recv_direct(sock, rest, remaining_bytes, &client, &seq);
+            if (received != (ssize_t) remaining_bytes){
+                fprintf(stderr, "ERROR! Failed to receive the file!\n");
+                release_payload(file, total_bytes, file_path != NULL);
+                rudp_close(sock);
+                exit(FAIL);
+            }
+            remaining_bytes = 0;
+            // packets were placed out of order - hash the payload once it's complete, while the trailer is received
+            payload = file;
+            if (hashing)
+                hash_start(&payload_hash, payload, total_bytes);
+        }
 
         // Receive the file
-        do {
+        while (remaining_bytes > 0){
             bytes_received = rudp_recv(sock, buffer, BUFSIZ, &client, &seq);
-            remaining_bytes -= bytes_received;
             #ifdef _DEBUG
             printf("Bytes received: %d\n", bytes_received);
-            printf("Remaining received: %d\n", remaining_bytes);
+            printf("Remaining received: %llu\n", (unsigned long long)remaining_bytes);
             #endif
             if (bytes_received <= -1){
                 perror("recv");
@@ -102,6 +227,14 @@ int main(int argc, char *argv[]){
                 rudp_close(sock);
                 exit(FAIL);
             }
+            if (bytes_received > remaining_bytes){
+                fprintf(stderr, "ERROR! Received more data than the frame header announced!\n");
+                rudp_close(sock);
+                exit(FAIL);
+            }
+            remaining_bytes -= bytes_received;
+            if (hashing)
+                xxh64_update(&hash, buffer, bytes_received);
             // Makes sure a '\0' exists at the end of the data to not accidently access forbidden memory - if we print the buffer
             // if (buffer[BUFSIZ - 1] != '\0'){
             //     buffer[BUFSIZ - 1] = '\0';
@@ -109,28 +242,55 @@ int main(int argc, char *argv[]){
             // printf("%s.\n", buffer);
 
             // keep receiving until the amount of expected bytes is reached
-        } while (remaining_bytes > 0);
+        }
+
+        if (hashing){
+            frame_trailer trailer;
+            if (rudp_recv(sock, buffer, BUFSIZ, &client, &seq) != (int) sizeof trailer){
+                fprintf(stderr, "ERROR! Received a corrupted trailer!\n");
+                rudp_close(sock);
+                exit(FAIL);
+            }
+            memcpy(&trailer, buffer, sizeof trailer);
+            uint64_t digest = payload != NULL ? hash_wait(&payload_hash) : xxh64_digest(&hash);
+            if (trailer_decode(&trailer) != digest){
+                fprintf(stderr, "ERROR! Integrity check failed: the sender's XXH64 is %016llx, the payload's is %016llx!\n",
+                        (unsigned long long)trailer_decode(&trailer), (unsigned long long)digest);
+                rudp_close(sock);
+                exit(FAIL);
+            }
+            printf("Integrity verified (XXH64 %016llx).\n", (unsigned long long)trailer_decode(&trailer));
+        }
+        if (payload != NULL){
+            release_payload(payload, total_bytes, file_path != NULL);
+        }
 
         gettimeofday(&end_time, NULL);      // log end time
+        interval_mark(reporter, 0);
 
         // Makes sure a '\0' exists at the end of the data to not accidently access forbidden memory - if we print the buffer
         if (buffer[BUFSIZ - 1] != '\0'){
             buffer[BUFSIZ - 1] = '\0';
         }
 
-        // Add stats
+        // Add stats - the sender decides how many runs there are, only the first MAX_RUNS - 1 are kept
         struct timeval elapsed;
         timersub(&end_time, &start_time, &elapsed);
-        runs[times].id = times;
-        runs[times].elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
-        runs[times].speed = (total_bytes / (float)MB) / (runs[times].elapsed_time / 1000.0);
+        if (times < MAX_RUNS){
+            runs[times].id = times;
+            runs[times].elapsed_time = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
+            runs[times].speed = (total_bytes / (float)MB) / (runs[times].elapsed_time / 1000.0);
 
-        // runs[0] keeps the avg of all runs. add data to avg:
-        runs[0].elapsed_time += runs[times].elapsed_time;
-        runs[0].speed += runs[times].speed;
+            // runs[0] keeps the avg of all runs. add data to avg:
+            runs[0].elapsed_time += runs[times].elapsed_time;
+            runs[0].speed += runs[times].speed;
+        }
+        else if (times == MAX_RUNS){
+            printf("Only the first %d runs are kept in the stats.\n", MAX_RUNS - 1);
+        }
 
         #ifdef _DEBUG
-        printf("Received data size: %d bytes.\n", total_bytes);
+        printf("Received data size: %llu bytes.\n", (unsigned long long)total_bytes);
         #endif
 
         printf("Data transfer completed.\n");
@@ -141,6 +301,15 @@ int main(int argc, char *argv[]){
         memset(buffer, 0, BUFSIZ);
     } while (1);
 
+    if (reporter != NULL){
+        interval_stop(reporter);
+        printf("Interval reports written to %s.\n", interval_path);
+    }
+    rudp_stats stats;
+    if (rudp_get_stats(sock, &stats) == 0){
+        rudp_print_stats(&stats);
+    }
+
     // Close connection
     rudp_close(sock);
 
@@ -149,6 +318,10 @@ int main(int argc, char *argv[]){
     printf("----------------------------\n");
     printf("-      * Statistics *      -\n");
 
+    if (times >= MAX_RUNS){
+        times = MAX_RUNS - 1;
+    }
+
     for (int i = 1; i <= times; i++){
         printf("Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", runs[i].id, runs[i].elapsed_time, runs[i].speed);
     }
@@ -164,4 +337,77 @@ int main(int argc, char *argv[]){
     printf("Receiver end.\n");
     
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * @brief   Creates (or truncates) the output file with the given size and maps it for writing.
+ * @return  A pointer to the mapping, NULL on failure (the error is printed).
+ */
+char* map_output_file(const char *path, uint64_t size){
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        perror("open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) == -1){
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    char *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if (file == MAP_FAILED){
+        perror("mmap");
+        return NULL;
+    }
+    return file;
+}
+
+void release_payload(char *payload, uint64_t size, int mapped){
+    if (mapped)
+        munmap(payload, size);
+    else
+        free(payload);
+}
+
+/*
+ * @brief   Receives a payload of size bytes split into equal parts over streams 1 - streams (see FRAME_FLAG_STREAMS),
+ *          every piece copied to its place in payload as soon as its own stream delivers it.
+ * @return  The amount of bytes received, -1 on failure (the error is printed).
+ */
+ssize_t receive_streams(int sock, char *payload, uint64_t size, int streams, struct sockaddr_in *client, uint16_t *seq){
+    uint64_t part = (size + streams - 1) / streams;
+    uint64_t received[RUDP_MAX_STREAMS] = {0};      // by stream
+    uint64_t total = 0;
+    char buffer[RUDP_MAX_CHUNK_SIZE];
+    while (total < size){
+        uint8_t stream;
+        ssize_t bytes = rudp_recv_stream(sock, &stream, buffer, sizeof buffer, client, seq);
+        if (bytes <= 0){
+            return -1;
+        }
+        uint64_t start = (uint64_t) (stream - 1) * part + received[stream];
+        if (stream < 1 || stream > streams || received[stream] + bytes > part || start + bytes > size){
+            fprintf(stderr, "ERROR! Received data past the end of stream %d's part!\n", stream);
+            return -1;
+        }
+        memcpy(payload + start, buffer, bytes);
+        received[stream] += bytes;
+        total += bytes;
+    }
+    return total;
+}
+
+/*
+ * @brief   The interval reports' counters (on the reporter's thread): the data received so far, the packets the
+ *          sender resent (filling a gap or arriving twice) and the gaps found, see rudp_get_progress().
+ */
+void sample_counters(void *context, interval_counters *counters){
+    rudp_progress progress;
+    if (rudp_get_progress(*(int *)context, &progress) == -1){
+        memset(&progress, 0, sizeof progress);
+    }
+    counters->bytes = progress.data_received;
+    counters->retransmits = progress.resent;
+    counters->lost = progress.gaps;
+}
@@ -0,0 +1,583 @@
+#include "RUDP_API.h"
+#include "RUDP_Packet.h"
+#include "RUDP_Trace.h"
+#include "Impair.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * Replays network conditions against the RUDP sender - offline, deterministic and without sleeping.
+ * The sender's code runs as is, but its packets go through a virtual network (see rudp_set_io()) with a
+ * virtual clock, to a model of the receiver that answers like RUDP_Receiver does. Time only moves when the
+ * sender waits, so a 2MB transfer over a lossy 20ms link takes milliseconds to replay.
+ *
+ * The fate of every packet comes from one of:
+ *  -trace <file> -receiver-trace <file>
+ *                  the traces of a real transfer (RUDP_TRACE=<file> for each side, on the same host so the clocks
+ *                  match): the n-th packet sent in the replay is lost if the n-th recorded packet never arrived,
+ *                  otherwise it arrives after the same delay. ACKs take the median recorded ACK delay.
+ *  -impair <spec>  the impairment simulator (see Common/Impair.h), one seed per scenario.
+ *
+ * With -min-goodput <MB/s> or -max-timeouts <n> the replay is a regression check (make check): it exits with FAIL
+ * when the average goodput drops below the floor, when a scenario times out more often, or when one gives up.
+*/
+
+/*
+ * Defines:
+*/
+#define USAGE "[-trace <sender_trace> -receiver-trace <receiver_trace> | -impair <spec>] [-ack-impair <spec>] [-scenarios <n>] [-size <bytes>] [-cost <usec>] [-slack <usec>] [-min-goodput <MB/s>] [-max-timeouts <n>] [-compress] [-adaptive]\n"
+#define MAX_QUEUED 4096         // datagrams in flight in each direction of the virtual network
+#define NEVER UINT64_MAX
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+ * Structs:
+*/
+typedef struct _datagram {
+    uint64_t arrival_usec;      // when it reaches the other side
+    uint64_t order;             // ties are delivered in the order they were sent
+    uint64_t ack_delay_usec;    // the delay of the ACK this packet triggers (without -ack-impair)
+    rudp_packet packet;
+} datagram;
+
+typedef struct _virtual_link {
+    datagram items[MAX_QUEUED];
+    int count;
+} virtual_link;
+
+// A recorded packet: lost, or delivered after delay_usec
+typedef struct _replay_hop {
+    int lost;
+    uint64_t delay_usec;
+} replay_hop;
+
+// What a scenario reports back
+typedef struct _replay_result {
+    uint64_t elapsed_usec;      // virtual time from the first data packet to the last ACK
+    uint64_t bytes_sent;
+    uint64_t retransmits;
+    uint64_t timeouts;
+    uint64_t rtt_p50;
+} replay_result;
+
+/*
+ * Static:
+*/
+static uint64_t now = 0;                // the virtual clock
+static uint64_t sent_order = 0;
+static uint64_t send_cost_usec = 2;     // time it takes to send a packet (a system call), so busy loops still advance the clock
+static uint64_t timer_slack_usec = 50;  // select() sleeps this much longer than asked (Linux's default timer slack)
+static virtual_link to_receiver, to_sender;
+static replay_hop *schedule = NULL;     // from -trace
+static size_t schedule_length = 0, schedule_next = 0;
+static uint64_t schedule_ack_delay_usec = 0;    // the fastest an ACK made it back, from -trace
+static impair_state *data_impair = NULL, *ack_impair = NULL;
+
+// The receiver, as RUDP_Receiver behaves: cumulative ACKs and a reassembly buffer
+static struct {
+    int connected;              // a SYN arrived - resent SYNs are only answered
+    uint16_t expected;
+    uint8_t capabilities;
+    int buffered;
+    int has[RUDP_REASSEMBLY_SLOTS];
+    uint16_t seq[RUDP_REASSEMBLY_SLOTS];
+} receiver;
+
+/*
+ * Declaring Functions:
+*/
+rudp_trace_event* load_trace(const char *path, int role, uint64_t *count);
+long latest_send(rudp_trace_event **sent, size_t count, uint16_t seq, uint64_t time, const char *matched);
+int load_schedule(const char *sender_path, const char *receiver_path);
+int run_scenario(const char *data_spec, const char *ack_spec, char *data, unsigned int data_size, replay_result *result);
+void link_push(virtual_link *l, rudp_packet *packet, uint64_t arrival_usec, uint64_t ack_delay_usec);
+int link_earliest(virtual_link *l);
+void receiver_deliver(datagram *d);
+ssize_t virtual_sendto(int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len);
+ssize_t virtual_recvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len);
+int virtual_wait_readable(int sock, uint64_t timeout_usec);
+uint64_t virtual_now_usec();
+
+/*
+ * Functions:
+*/
+int main(int argc, char *argv[]){
+    char *trace_file = NULL, *receiver_trace_file = NULL, *impair_spec = NULL, *ack_impair_spec = NULL;
+    int scenarios = 1;
+    double goodput_floor = 0;           // -min-goodput, 0 - not checked
+    long timeouts_ceiling = -1;         // -max-timeouts, -1 - not checked
+    unsigned int data_size = 2*MB + BUFSIZ;
+
+    // packets never leave the process - the real impairment simulator would send them
+    unsetenv(RUDP_IMPAIR_ENV);
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-compress") == 0){
+            rudp_set_compression(1);
+            continue;
+        }
+        if (strcmp(argv[i], "-adaptive") == 0){
+            rudp_set_packet_sizing(1);
+            continue;
+        }
+        if (i + 1 >= argc){
+            fprintf(stderr, "Missing value for %s! Usage: %s %s", argv[i], argv[0], USAGE);
+            exit(FAIL);
+        }
+        if (strcmp(argv[i], "-trace") == 0)
+            trace_file = argv[++i];
+        else if (strcmp(argv[i], "-receiver-trace") == 0)
+            receiver_trace_file = argv[++i];
+        else if (strcmp(argv[i], "-impair") == 0)
+            impair_spec = argv[++i];
+        else if (strcmp(argv[i], "-ack-impair") == 0)
+            ack_impair_spec = argv[++i];
+        else if (strcmp(argv[i], "-scenarios") == 0)
+            scenarios = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-size") == 0)
+            data_size = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-cost") == 0)
+            send_cost_usec = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-slack") == 0)
+            timer_slack_usec = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-min-goodput") == 0)
+            goodput_floor = atof(argv[++i]);
+        else if (strcmp(argv[i], "-max-timeouts") == 0)
+            timeouts_ceiling = atol(argv[++i]);
+        else {
+            fprintf(stderr, "Incorrect argument! Usage: %s %s", argv[0], USAGE);
+            exit(FAIL);
+        }
+    }
+    if (scenarios < 1 || data_size < 1 || (trace_file != NULL && impair_spec != NULL) || (trace_file == NULL) != (receiver_trace_file == NULL)){
+        fprintf(stderr, "Usage: %s %s", argv[0], USAGE);
+        exit(FAIL);
+    }
+
+    impair_config config = {0}, ack_config = {0};
+    if (impair_spec != NULL && impair_parse(&config, impair_spec) == -1){
+        fprintf(stderr, "Invalid impairment spec: %s\n", impair_spec);
+        exit(FAIL);
+    }
+    if (ack_impair_spec != NULL && impair_parse(&ack_config, ack_impair_spec) == -1){
+        fprintf(stderr, "Invalid impairment spec: %s\n", ack_impair_spec);
+        exit(FAIL);
+    }
+    if (trace_file != NULL && load_schedule(trace_file, receiver_trace_file) == -1){
+        exit(FAIL);
+    }
+
+    // the same data every run
+    char *data = (char *) malloc (data_size);
+    if (data == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        exit(FAIL);
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (unsigned int i = 0; i < data_size; i++){
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        data[i] = x;
+    }
+
+    double total_goodput = 0, min_goodput = 0, max_goodput = 0;
+    int failed = 0;
+    uint64_t max_timeouts = 0;
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    for (int scenario = 0; scenario < scenarios; scenario++){
+        char data_spec[512], ack_spec[512];
+        if (impair_spec != NULL)
+            snprintf(data_spec, sizeof data_spec, "%s,seed=%llu", impair_spec, (unsigned long long)(config.seed + scenario));
+        if (ack_impair_spec != NULL)
+            snprintf(ack_spec, sizeof ack_spec, "%s,seed=%llu", ack_impair_spec, (unsigned long long)(ack_config.seed + scenario));
+        schedule_next = scenario % (schedule_length > 0 ? schedule_length : 1);
+
+        replay_result result;
+        if (run_scenario(impair_spec != NULL ? data_spec : NULL, ack_impair_spec != NULL ? ack_spec : NULL, data, data_size, &result) == -1){
+            // the sender gave up (exceeded its retries) - that's a result too
+            failed++;
+            printf("Scenario #%d FAILED\n", scenario + 1);
+            continue;
+        }
+
+        double goodput = (result.bytes_sent / (double)MB) / (result.elapsed_usec / 1000000.0);
+        total_goodput += goodput;
+        if (scenario == failed || goodput < min_goodput)
+            min_goodput = goodput;
+        if (goodput > max_goodput)
+            max_goodput = goodput;
+        if (result.timeouts > max_timeouts)
+            max_timeouts = result.timeouts;
+        printf("Scenario #%d Data: Time=%.2fms; Speed=%.2fMB/s; Retransmits=%llu; Timeouts=%llu; RTT p50=%lluus\n",
+               scenario + 1, result.elapsed_usec / 1000.0, goodput, (unsigned long long)result.retransmits,
+               (unsigned long long)result.timeouts, (unsigned long long)result.rtt_p50);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    printf("----------------------------\n");
+    printf("Scenarios: %d (%d failed), replayed in %.2fs\n", scenarios, failed, wall);
+    if (scenarios > failed)
+        printf("Average goodput: %.2fMB/s (min %.2fMB/s, max %.2fMB/s)\n", total_goodput / (scenarios - failed), min_goodput, max_goodput);
+    printf("----------------------------\n");
+
+    // regression check
+    int regressed = 0;
+    if (goodput_floor > 0 || timeouts_ceiling >= 0){
+        if (failed > 0){
+            fprintf(stderr, "REGRESSION! %d scenarios gave up!\n", failed);
+            regressed = 1;
+        }
+        if (goodput_floor > 0 && (scenarios == failed || total_goodput / (scenarios - failed) < goodput_floor)){
+            fprintf(stderr, "REGRESSION! Average goodput %.2fMB/s is below %.2fMB/s!\n",
+                    scenarios > failed ? total_goodput / (scenarios - failed) : 0, goodput_floor);
+            regressed = 1;
+        }
+        if (timeouts_ceiling >= 0 && max_timeouts > (uint64_t)timeouts_ceiling){
+            fprintf(stderr, "REGRESSION! A scenario timed out %llu times, more than %ld!\n", (unsigned long long)max_timeouts, timeouts_ceiling);
+            regressed = 1;
+        }
+    }
+
+    free(schedule);
+    free(data);
+    return regressed ? FAIL : 0;
+}
+
+// Runs a single transfer over the virtual network in a child process - the RUDP code exits the process when it gives up
+int run_scenario(const char *data_spec, const char *ack_spec, char *data, unsigned int data_size, replay_result *result){
+    int fds[2];
+    if (pipe(fds) == -1){
+        perror("pipe");
+        exit(FAIL);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1){
+        perror("fork");
+        exit(FAIL);
+    }
+
+    if (pid == 0){
+        close(fds[0]);
+        // the RUDP functions print their progress - keep the report readable
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1){
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        if (data_spec != NULL)
+            data_impair = impair_create(data_spec, sendto);
+        if (ack_spec != NULL)
+            ack_impair = impair_create(ack_spec, sendto);
+
+        rudp_io io = {virtual_sendto, virtual_recvfrom, virtual_wait_readable, virtual_now_usec};
+        rudp_set_io(&io);
+        struct sockaddr_in receiver_addr;
+        memset(&receiver_addr, 0, sizeof(receiver_addr));
+        receiver_addr.sin_family = AF_INET;
+        receiver_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        uint16_t seq = 0;
+        int sock = rudp_socket(&receiver_addr, CLIENT, &seq);
+        uint64_t start = now;
+        replay_result child_result;
+        child_result.bytes_sent = rudp_send(sock, data, data_size, 0, &receiver_addr, &seq);
+        child_result.elapsed_usec = max(now - start, 1);
+        rudp_stats stats;
+        rudp_get_stats(sock, &stats);
+        rudp_close(sock);
+        child_result.retransmits = stats.retransmits;
+        child_result.timeouts = stats.timeouts;
+        child_result.rtt_p50 = histogram_percentile(&stats.rtt, 50);
+
+        int ok = write(fds[1], &child_result, sizeof child_result) == sizeof child_result;
+        _exit(ok ? 0 : FAIL);
+    }
+
+    close(fds[1]);
+    ssize_t bytes = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return bytes == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Reads a trace file recorded by the given side
+rudp_trace_event* load_trace(const char *path, int role, uint64_t *count){
+    rudp_trace_file_header header;
+    rudp_trace_event *events = NULL;
+    if (rudp_trace_read(path, &header, &events) == -1){
+        fprintf(stderr, "ERROR! %s is not a readable trace file!\n", path);
+        return NULL;
+    }
+    if (header.role != (uint32_t) role){
+        fprintf(stderr, "ERROR! %s was recorded by the %s!\n", path, header.role == SERVER ? "receiver" : "sender");
+        free(events);
+        return NULL;
+    }
+    *count = header.count;
+    return events;
+}
+
+// the latest packet sent with seq no later than time, -1 if there is none. sent is ordered by time.
+long latest_send(rudp_trace_event **sent, size_t count, uint16_t seq, uint64_t time, const char *matched){
+    size_t low = 0, high = count;
+    while (low < high){
+        size_t middle = (low + high) / 2;
+        if (sent[middle]->time_usec <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    // a packet and its copies are never more than the whole window (and its resends) apart
+    for (long i = (long) low - 1; i >= 0 && (long) low - i <= 16 * RUDP_MAX_WINDOW; i--){
+        if (sent[i]->seq_ack_number == seq && (matched == NULL || !matched[i]))
+            return i;
+    }
+    return -1;
+}
+
+// Builds the schedule from the packets the sender recorded (data, SYN and probes - the direction we replay),
+// and the ones the receiver recorded. Every arrival is matched to the latest copy of the packet sent long enough
+// before it, copies without an arrival were lost.
+int load_schedule(const char *sender_path, const char *receiver_path){
+    uint64_t sender_count, receiver_count;
+    rudp_trace_event *events = load_trace(sender_path, CLIENT, &sender_count);
+    if (events == NULL){
+        return -1;
+    }
+    rudp_trace_event *arrivals = load_trace(receiver_path, SERVER, &receiver_count);
+    if (arrivals == NULL){
+        free(events);
+        return -1;
+    }
+
+    rudp_trace_event **sent = (rudp_trace_event **) malloc ((max(sender_count, receiver_count) + 1) * sizeof(rudp_trace_event *));     // reused for the ACKs
+    if (sent == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        exit(FAIL);
+    }
+    for (uint64_t i = 0; i < sender_count; i++){
+        if ((events[i].type == RUDP_TRACE_SENT || events[i].type == RUDP_TRACE_RETRANSMIT) && !(events[i].flags & RUDP_TRACE_FLAG_ACK))
+            sent[schedule_length++] = &events[i];
+    }
+    if (schedule_length == 0){
+        fprintf(stderr, "ERROR! %s has no sent packets!\n", sender_path);
+        exit(FAIL);
+    }
+    schedule = (replay_hop *) malloc (schedule_length * sizeof(replay_hop));
+    char *matched = (char *) calloc (schedule_length, 1);
+    if (schedule == NULL || matched == NULL){
+        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+        exit(FAIL);
+    }
+
+    // an arrival belongs to a copy sent at least half the median delay before it - a resend that left
+    // just before the original arrived can't be the one that arrived
+    histogram delays;
+    memset(&delays, 0, sizeof(delays));
+    for (uint64_t i = 0; i < receiver_count; i++){
+        if (arrivals[i].type != RUDP_TRACE_RECEIVED)
+            continue;
+        long copy = latest_send(sent, schedule_length, arrivals[i].seq_ack_number, arrivals[i].time_usec, NULL);
+        if (copy != -1)
+            histogram_record(&delays, arrivals[i].time_usec - sent[copy]->time_usec);
+    }
+    uint64_t min_delay = histogram_percentile(&delays, 50) / 2;
+    if (delays.count == 0){
+        fprintf(stderr, "ERROR! No packet of %s arrived in %s - are they from the same transfer and host?\n", sender_path, receiver_path);
+        exit(FAIL);
+    }
+
+    for (size_t i = 0; i < schedule_length; i++){
+        schedule[i].lost = 1;
+        schedule[i].delay_usec = 0;
+    }
+    size_t delivered = 0;
+    for (uint64_t i = 0; i < receiver_count; i++){
+        if (arrivals[i].type != RUDP_TRACE_RECEIVED)
+            continue;
+        long copy = latest_send(sent, schedule_length, arrivals[i].seq_ack_number, arrivals[i].time_usec - min_delay, matched);
+        if (copy != -1){
+            matched[copy] = 1;
+            schedule[copy].lost = 0;
+            schedule[copy].delay_usec = arrivals[i].time_usec - sent[copy]->time_usec;
+            delivered++;
+        }
+    }
+
+    // ACKs are not resent, only their (median) delay is replayed
+    size_t acks = 0;
+    for (uint64_t i = 0; i < receiver_count; i++){
+        if ((arrivals[i].type == RUDP_TRACE_SENT || arrivals[i].type == RUDP_TRACE_RETRANSMIT) && (arrivals[i].flags & RUDP_TRACE_FLAG_ACK))
+            sent[acks++] = &arrivals[i];
+    }
+    memset(&delays, 0, sizeof(delays));
+    for (uint64_t i = 0; i < sender_count && acks > 0; i++){
+        if (events[i].type != RUDP_TRACE_ACK)
+            continue;
+        long copy = latest_send(sent, acks, events[i].seq_ack_number, events[i].time_usec, NULL);
+        if (copy != -1)
+            histogram_record(&delays, events[i].time_usec - sent[copy]->time_usec);
+    }
+    schedule_ack_delay_usec = histogram_percentile(&delays, 50);
+
+    printf("Loaded %zu packets (%zu lost, matched if %lluus+ old, ACK delay %lluus) from %s and %s\n", schedule_length, schedule_length - delivered,
+           (unsigned long long) min_delay, (unsigned long long) schedule_ack_delay_usec, sender_path, receiver_path);
+    free(matched);
+    free(sent);
+    free(arrivals);
+    free(events);
+    return 0;
+}
+
+void link_push(virtual_link *l, rudp_packet *packet, uint64_t arrival_usec, uint64_t ack_delay_usec){
+    if (l->count == MAX_QUEUED){
+        return;     // the network's queue is full - tail drop
+    }
+    datagram *d = &l->items[l->count++];
+    d->arrival_usec = arrival_usec;
+    d->order = sent_order++;
+    d->ack_delay_usec = ack_delay_usec;
+    d->packet = *packet;
+}
+
+// index of the datagram that arrives first, -1 if the link is empty
+int link_earliest(virtual_link *l){
+    int earliest = -1;
+    for (int i = 0; i < l->count; i++){
+        if (earliest == -1 || l->items[i].arrival_usec < l->items[earliest].arrival_usec
+            || (l->items[i].arrival_usec == l->items[earliest].arrival_usec && l->items[i].order < l->items[earliest].order))
+            earliest = i;
+    }
+    return earliest;
+}
+
+// The receiver got a packet - answer it with an ACK, like rudp_recv() does
+void receiver_deliver(datagram *d){
+    rudp_packet *packet = &d->packet;
+    if (packet->header.flags.ack == 1){
+        return;
+    }
+    if (packet->header.flags.syn == 1){
+        if (!receiver.connected){
+            receiver.connected = 1;
+            receiver.expected = packet->header.seq_ack_number + 1;
+            receiver.capabilities = packet->header.length >= 1 ? (packet->data[0] & RUDP_SUPPORTED_CAPS) : 0;
+        }
+    }
+    else if (packet->header.flags.nul != 1){
+        if (packet->header.checksum != calculate_checksum(packet->data, sizeof(packet->data))){
+            return;     // the sender will resend it
+        }
+        uint16_t seq = packet->header.seq_ack_number;
+        uint16_t distance = seq - receiver.expected;
+        if (distance == 0){
+            receiver.expected++;
+            while (receiver.has[receiver.expected % RUDP_REASSEMBLY_SLOTS] && receiver.seq[receiver.expected % RUDP_REASSEMBLY_SLOTS] == receiver.expected){
+                receiver.has[receiver.expected % RUDP_REASSEMBLY_SLOTS] = 0;
+                receiver.buffered--;
+                receiver.expected++;
+            }
+        }
+        else if (distance < RUDP_REASSEMBLY_SLOTS && !receiver.has[seq % RUDP_REASSEMBLY_SLOTS]){
+            receiver.has[seq % RUDP_REASSEMBLY_SLOTS] = 1;
+            receiver.seq[seq % RUDP_REASSEMBLY_SLOTS] = seq;
+            receiver.buffered++;
+        }
+    }
+
+    rudp_packet ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.header.flags.nul = 1;
+    ack.header.flags.ack = 1;
+    ack.header.seq_ack_number = receiver.expected;
+    ack.header.window = RUDP_REASSEMBLY_SLOTS - receiver.buffered;
+    ack.header.length = 1;
+    ack.data[0] = receiver.capabilities;
+    ack.header.checksum = calculate_checksum(ack.data, sizeof(ack.data));
+
+    uint64_t release[2] = {now + d->ack_delay_usec, now + d->ack_delay_usec};
+    int copies = ack_impair != NULL ? impair_decide(ack_impair, sizeof(ack), now, release) : 1;
+    for (int i = 0; i < copies; i++){
+        link_push(&to_sender, &ack, release[i], 0);
+    }
+}
+
+ssize_t virtual_sendto(int sock, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len){
+    rudp_packet *packet = (rudp_packet *) buf;
+    uint64_t release[2] = {now, now};
+    int copies = 1;
+
+    if (schedule != NULL){
+        replay_hop *hop = &schedule[schedule_next++ % schedule_length];
+        copies = !hop->lost;
+        release[0] = now + hop->delay_usec;
+    }
+    else if (data_impair != NULL){
+        copies = impair_decide(data_impair, len, now, release);
+    }
+    for (int i = 0; i < copies; i++){
+        link_push(&to_receiver, packet, release[i], schedule_ack_delay_usec);
+    }
+
+    now += send_cost_usec;
+    return len;
+}
+
+// Moves the clock forward, delivering packets to the receiver on the way, until an ACK arrives or the deadline passes
+int virtual_wait_readable(int sock, uint64_t timeout_usec){
+    uint64_t deadline = timeout_usec == NEVER ? NEVER : now + timeout_usec + (timeout_usec > 0 ? timer_slack_usec : 0);
+    while (1){
+        int ack = link_earliest(&to_sender);
+        int data = link_earliest(&to_receiver);
+        uint64_t ack_time = ack == -1 ? NEVER : to_sender.items[ack].arrival_usec;
+        uint64_t data_time = data == -1 ? NEVER : to_receiver.items[data].arrival_usec;
+
+        if (ack_time <= now){
+            return 1;
+        }
+        if (ack_time == NEVER && data_time == NEVER && deadline == NEVER){
+            return 0;       // nothing will ever arrive
+        }
+        uint64_t next = min(ack_time, data_time);
+        if (next > deadline){
+            now = deadline;
+            return 0;
+        }
+        now = max(now, next);
+        if (data_time <= ack_time){
+            datagram d = to_receiver.items[data];
+            to_receiver.items[data] = to_receiver.items[--to_receiver.count];
+            receiver_deliver(&d);
+        }
+    }
+}
+
+ssize_t virtual_recvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len){
+    if (virtual_wait_readable(sock, NEVER) == 0){
+        fprintf(stderr, "ERROR! The sender waits for a packet, but the virtual network is empty!\n");
+        exit(FAIL);
+    }
+    int ack = link_earliest(&to_sender);
+    size_t size = min(len, sizeof(rudp_packet));
+    memcpy(buf, &to_sender.items[ack].packet, size);
+    to_sender.items[ack] = to_sender.items[--to_sender.count];
+    if (from != NULL && from_len != NULL && *from_len >= sizeof(struct sockaddr_in)){
+        struct sockaddr_in *addr = (struct sockaddr_in *) from;
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *from_len = sizeof(*addr);
+    }
+    return size;
+}
+
+uint64_t virtual_now_usec(){
+    return now;
+}
@@ -1,20 +1,28 @@
 #include "RUDP_API.h"
+#include "Framing.h"
+#include "Payload.h"
+#include "Hash.h"
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  * Defines:
 */
 #define MIN_FILE_SIZE 2*MB           // 2MB
-#define USAGE "-ip <server_ip> -p <server_port>"
-extern int *b; /* only declaration, b is defined in other file.*/
+#define MAX_RUNS 10000              // the receiver keeps the stats of fewer runs than this
+#define USAGE "-ip <server_ip> -p <server_port> [-compress] [-runs <n>] [-size <bytes>] [-pattern <random|compressible|counter|verify>] [-seed <n>] [-f <file>] [-notune] [-nohash] [-adaptive] [-bulk <MB/s>] [-stripes <n>] [-streams <n>] [-busypoll <usec>] [-cpu <n>] [-timestamps]"
 
 /*
  * Declaring Functions:
 */
-char* util_generate_random_data(unsigned int size);
+char* map_file(const char *path, size_t *size);
+void release_data(char *data, size_t size, int mapped);
 
 /*
  * Functions:
@@ -23,33 +31,134 @@ int main(int argc, char *argv[]){
     uint16_t seq = 0;        // TODO randomize the first seq number
     printf("Starting Sender...\n");
     #ifndef _DEBUG
-    if (argc != 5){
+    if (argc < 5){
         fprintf(stderr, "Usage: %s", USAGE);
         exit(1);
     }
     #endif
     struct sockaddr_in server;
+    int runs = 0;                   // how many times to send the file, 0 - ask the user after every run
+    size_t data_size = MIN_FILE_SIZE+BUFSIZ;      // Generate data bigger than 2MB by default
+    char *file_path = NULL;         // send this file instead of random data
+    payload_pattern pattern = PAYLOAD_RANDOM;       // what the generated data looks like
+    uint64_t seed = PAYLOAD_DEFAULT_SEED;           // the same seed generates the same data
+    int hash = 1;                   // follow every payload with its XXH64, -nohash sends the payload alone
+    int streams = 0;                // split the payload over this many streams, 0 - send it in order on the default stream
+    uint64_t busy_poll = 0;         // spin this long before sleeping for an ACK
+    int cpu = -1;                   // pin the sending thread here
 
     // reset address's memory before using it
     memset(&server, 0, sizeof(server));
     #ifndef _DEBUG
     // Getting info from main's args into ip and port of server
-    for (int i = 1; i < argc; i += 2){
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-compress") == 0){
+            // Offer compression in the handshake
+            rudp_set_compression(1);
+            continue;
+        }
+        if (strcmp(argv[i], "-nohash") == 0){
+            // No integrity trailer
+            hash = 0;
+            continue;
+        }
+        if (strcmp(argv[i], "-timestamps") == 0){
+            // RTT samples from kernel timestamps
+            rudp_set_timestamping(1);
+            continue;
+        }
+        if (strcmp(argv[i], "-adaptive") == 0){
+            // Packet size follows the loss
+            rudp_set_packet_sizing(1);
+            continue;
+        }
+        if (strcmp(argv[i], "-notune") == 0){
+            // Keep the kernel's socket buffer sizes and the default window
+            rudp_set_autotune(0);
+            continue;
+        }
+        if (i + 1 >= argc){
+            fprintf(stderr, "Missing value for %s! Usage: %s", argv[i], USAGE);
+            exit(1);
+        }
         if (strcmp(argv[i], "-ip") == 0){
             // Set server ip
-            if (inet_pton(AF_INET, argv[i+1], &(server.sin_addr)) <= 0){
+            if (inet_pton(AF_INET, argv[++i], &(server.sin_addr)) <= 0){
                 perror("inet_pton");
                 exit(1);
             }
             #ifdef _DEBUG
-            printf("Server IP is set to: %s\n", argv[i+1]);
+            printf("Server IP is set to: %s\n", argv[i]);
             #endif
         }
+        else if (strcmp(argv[i], "-runs") == 0){
+            // Send the file this many times without asking
+            runs = atoi(argv[++i]);
+            if (runs < 1 || runs >= MAX_RUNS){
+                fprintf(stderr, "Runs should be between 1 and %d!\n", MAX_RUNS - 1);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-size") == 0){
+            // Size of the generated file, in bytes
+            data_size = strtoul(argv[++i], NULL, 10);
+            if (data_size < 2){
+                fprintf(stderr, "Size should be at least 2 bytes!\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-pattern") == 0){
+            // Pattern of the generated data
+            if (payload_pattern_parse(argv[++i], &pattern) != 0){
+                fprintf(stderr, "Pattern should be one of: random compressible counter verify\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-seed") == 0){
+            // Seed of the generated data
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-bulk") == 0){
+            // Pace the payload at this rate and repair it from NAK reports (if the receiver accepts)
+            double rate = atof(argv[++i]);
+            if (rate <= 0){
+                fprintf(stderr, "Bulk rate should be a positive amount of MB/s!\n");
+                exit(1);
+            }
+            rudp_set_bulk(rate * MB);
+        }
+        else if (strcmp(argv[i], "-stripes") == 0){
+            // Spread bulk transfers over several UDP flows (and the receiver's cores)
+            if (rudp_set_stripes(atoi(argv[++i])) == -1){
+                fprintf(stderr, "Stripes should be 1 - %d!\n", RUDP_MAX_STRIPES);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-streams") == 0){
+            // Split the payload into parts sent at once, each on a stream of its own
+            streams = atoi(argv[++i]);
+            if (streams < 1 || streams >= RUDP_MAX_STREAMS){
+                fprintf(stderr, "Streams should be 1 - %d!\n", RUDP_MAX_STREAMS - 1);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-busypoll") == 0){
+            // Spin on the socket instead of sleeping, for the lowest latency
+            busy_poll = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-cpu") == 0){
+            // Pin the sending thread to a CPU
+            cpu = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-f") == 0){
+            // Send a file - it is mapped and packetized straight from the mapping
+            file_path = argv[++i];
+        }
         else if (strcmp(argv[i], "-p") == 0){
             // Set port
-            server.sin_port = htons(atoi(argv[i+1]));
+            server.sin_port = htons(atoi(argv[++i]));
             #ifdef _DEBUG
-            printf("Port is set to: %d\n", atoi(argv[i+1]));
+            printf("Port is set to: %d\n", atoi(argv[i]));
             #endif
         }
         else{
@@ -67,140 +176,217 @@ int main(int argc, char *argv[]){
     }
     #endif
     // generate random num as a starting seq number
+    if (rudp_set_busy_poll(busy_poll, cpu) == -1){
+        fprintf(stderr, "Busy polling should spin for 0 - %d usec!\n", RUDP_BUSY_POLL_MAX_USEC);
+        exit(1);
+    }
     srand(time(NULL));   // Initialization, should only be called once.
     // seq = rand();      // Returns a pseudo-random integer between 0 and RAND_MAX.
     seq = 0;
 
     int sock = rudp_socket((struct sockaddr_in*) &server, CLIENT, &seq);
+    int bulk = rudp_get_capabilities(sock) > 0 && (rudp_get_capabilities(sock) & RUDP_CAP_BULK);
 
-    // Generate random data
-    printf("Generating random data, of at least %dMB in size...\n", MIN_FILE_SIZE/MB);
-    char *data = util_generate_random_data(MIN_FILE_SIZE+BUFSIZ);       // Generate data bigger than 2MB
-    if (data == NULL){
-        fprintf(stderr, "ERROR! Failed to allocate memory!\n");
-        exit(FAIL);
+    char *data = NULL;
+    if (file_path != NULL){
+        data = map_file(file_path, &data_size);
+        if (data == NULL){
+            rudp_close(sock);
+            exit(FAIL);
+        }
+        printf("Sending %s, of %.2fMB in size...\n", file_path, data_size / (float)MB);
+    }
+    else {
+        // Generate the data
+        printf("Generating %s data (seed %llu), of %.2fMB in size...\n", payload_pattern_name(pattern), (unsigned long long)seed, data_size / (float)MB);
+        data = payload_generate(data_size, pattern, seed);
+        if (data == NULL){
+            fprintf(stderr, "ERROR! Failed to allocate memory!\n");
+            exit(FAIL);
+        }
+    }
+
+    // the payload is hashed while the first transfer is on the wire
+    hash_job hashing;
+    if (hash){
+        hash_start(&hashing, data, data_size);
     }
 
-    int bytes_sent, total_bytes_sent;
-    int file_size;
-    char action;
+    ssize_t bytes_sent;
+    transfer_frame frame;
+    frame_trailer trailer;
+    uint32_t transfer_id = 0;
+    int action;
+    int run = 0;
 
     do {
         printf("Sending the data...\n");
-        bytes_sent = total_bytes_sent = 0;
 
-        // Send the size of the file so the receiver is prepared to receive all the bytes
-        file_size = strlen(data)+1;
-        bytes_sent = rudp_send(sock, &file_size, sizeof file_size, 0, &server, &seq);
-        if (bytes_sent == -1){
-            perror("send");
-            rudp_close(sock);
-            free(data);
-            exit(1);
+        if (bulk){
+            // The frame header gets a packet of its own, the receiver places the paced payload after it
+            frame_encode(&frame, data_size, ++transfer_id, (hash ? FRAME_FLAG_HASH : 0) | FRAME_FLAG_BULK);
+            bytes_sent = rudp_send(sock, &frame, sizeof frame, 0, &server, &seq);
+            if (bytes_sent > 0)
+                bytes_sent = rudp_send_bulk(sock, data, data_size, &server, &seq);
         }
-        else if (bytes_sent == 0){
-            printf("Connection was closed prior to sending the data!\n");
-            rudp_close(sock);
-            free(data);
-            exit(FAIL);
+        else if (streams > 0){
+            // The frame header gets a packet of its own, then every part of the payload goes out on its own stream,
+            // the parts taking turns - a lost packet only holds back its own part at the receiver
+            frame_encode(&frame, data_size, ++transfer_id,
+                         (hash ? FRAME_FLAG_HASH : 0) | FRAME_FLAG_STREAMS | (uint32_t) streams << FRAME_STREAMS_SHIFT);
+            bytes_sent = rudp_send(sock, &frame, sizeof frame, 0, &server, &seq);
+            size_t part = (data_size + streams - 1) / streams;
+            struct iovec iov[RUDP_MAX_STREAMS];
+            rudp_stream_data parts[RUDP_MAX_STREAMS];
+            for (int s = 0; s < streams; s++){
+                size_t start = (size_t) s * part < data_size ? (size_t) s * part : data_size;
+                iov[s].iov_base = data + start;
+                iov[s].iov_len = data_size - start < part ? data_size - start : part;
+                parts[s].stream = s + 1;
+                parts[s].iov = &iov[s];
+                parts[s].iovcnt = 1;
+            }
+            if (bytes_sent > 0)
+                bytes_sent = rudp_send_streams(sock, parts, streams, &server, &seq);
+        }
+        else {
+            // The frame header tells the receiver how many bytes to expect, it shares the first packet with the data
+            frame_encode(&frame, data_size, ++transfer_id, hash ? FRAME_FLAG_HASH : 0);
+            struct iovec iov[2] = {{&frame, sizeof frame}, {data, data_size}};
+            bytes_sent = rudp_sendv(sock, iov, 2, 0, &server, &seq);
+        }
+        if (bytes_sent > 0 && hash){
+            // the trailer gets a packet of its own, so the payload ends where a packet ends
+            if (run == 0)
+                printf("Payload XXH64: %016llx\n", (unsigned long long)hash_wait(&hashing));
+            trailer_encode(&trailer, hash_wait(&hashing));
+            if (rudp_send(sock, &trailer, sizeof trailer, 0, &server, &seq) <= 0)
+                bytes_sent = -1;
         }
-
-        // Send data
-        bytes_sent = rudp_send(sock, data, file_size, 0, &server, &seq);
         if (bytes_sent == -1){
             perror("send");
             rudp_close(sock);
-            free(data);
+            release_data(data, data_size, file_path != NULL);
             exit(FAIL);
         }
         else if (bytes_sent == 0){
             printf("Connection was closed prior to sending the data!\n");
             rudp_close(sock);
-            free(data);
+            release_data(data, data_size, file_path != NULL);
             exit(FAIL);
         }
 
         
         #ifdef _DEBUG
-        printf("Sent data size: %d bytes.\n", bytes_sent);
+        printf("Sent data size: %zd bytes.\n", bytes_sent);
         #endif
 
         loss_optimization();
 
-        printf("Do you want to send the file again?\n");
-        printf("N - No\nY - Yes\n");
-        // Get chars until one of the following: y,Y,n,N is received
-        while (1){
-            action = getchar();
-            if (action != '\n'){
-                if (action != 'y' && action != 'n' && action != 'Y' && action != 'N' )
-                    printf("Incorrect selection! Enter:\nN - NO\nY - Yes\n");
-                else
-                    break;      // good input was received
+        run++;
+        if (runs > 0){
+            // non interactive - send the file exactly runs times
+            action = run < runs ? 'y' : 'n';
+        }
+        else {
+            printf("Do you want to send the file again?\n");
+            printf("N - No\nY - Yes\n");
+            // Get chars until one of the following: y,Y,n,N is received
+            while (1){
+                action = getchar();
+                if (action == EOF){
+                    action = 'n';       // nobody to ask
+                    break;
+                }
+                if (action != '\n'){
+                    if (action != 'y' && action != 'n' && action != 'Y' && action != 'N' )
+                        printf("Incorrect selection! Enter:\nN - NO\nY - Yes\n");
+                    else
+                        break;      // good input was received
+                }
             }
         }
         // Resend if received "yes"
     } while(action == 'y' || action == 'Y');
 
-    total_bytes_sent = 0;
     printf("Sending an exit message to the receiver...\n");
     /*
-    We notify the Receiver of an EXIT MESSAGE by "preparing him" to receive 0 bytes.
+    We notify the Receiver of an EXIT MESSAGE by sending an empty frame flagged as exit.
     */
-    bytes_sent = rudp_send(sock, &total_bytes_sent, sizeof total_bytes_sent, 0, &server, &seq);     // telling him we have 0 bytes to send
+    frame_encode(&frame, 0, ++transfer_id, FRAME_FLAG_EXIT);
+    bytes_sent = rudp_send(sock, &frame, sizeof frame, 0, &server, &seq);
     if (bytes_sent == -1){
         perror("send");
         rudp_close(sock);
-        free(data);
+        release_data(data, data_size, file_path != NULL);
         exit(FAIL);
     }
     else if (bytes_sent == 0){
         printf("Connection was closed prior to sending the data!\n");
         rudp_close(sock);
-        free(data);
+        release_data(data, data_size, file_path != NULL);
         exit(FAIL);
     }
 
     sleep(1);
-    
+
+    rudp_stats stats;
+    if (rudp_get_stats(sock, &stats) == 0){
+        rudp_print_stats(&stats);
+    }
+
     printf("Closing the RUDP connection...\n");
     rudp_close(sock);
     #ifdef _DEBUG
-    printf("Max tries: %d\n", *b);
     printf("packet loss: %f\n", loss_optimization());
     #endif
     printf("Sender end.\n");
-    free(data);
+    if (hash){
+        hash_wait(&hashing);
+    }
+    release_data(data, data_size, file_path != NULL);
 
     return 0;
 }
 
 
 /*
- * @brief   A random data generator function based on srand() and rand().
- * @param   The size of the data to generate (up to 2^32 bytes).
- * @return  A pointer to the buffer.
+ * @brief   Maps a file to memory, so it is read by the kernel on demand instead of copied to the heap.
+ * @param   size Set to the file's size.
+ * @return  A pointer to the mapping, NULL on failure (the error is printed).
  */
-char* util_generate_random_data(unsigned int size){
-    char *buffer = NULL;
-
-    if (size == 0){
+char* map_file(const char *path, size_t *size){
+    int fd = open(path, O_RDONLY);
+    if (fd == -1){
+        perror("open");
         return NULL;
     }
-
-    buffer = (char*)malloc(size * sizeof(char));
-
-    if (buffer == NULL){
+    struct stat st;
+    if (fstat(fd, &st) == -1){
+        perror("fstat");
+        close(fd);
         return NULL;
     }
-
-    srand(time(NULL));
-
-    for (unsigned int i = 0; i < size-1; i++){
-        // set a random value insidee - make sure the value isn't '\0' that will act as the end of the string
-        while ((*(buffer + i) = ((unsigned int) rand() % 256)) == '\0');
+    if (st.st_size == 0){
+        fprintf(stderr, "ERROR! %s is empty!\n", path);
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if (data == MAP_FAILED){
+        perror("mmap");
+        return NULL;
     }
-    buffer[size-1] = '\0';
+    // packets are made in order - let the kernel read ahead
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return data;
+}
 
-    return buffer;
-}
\ No newline at end of file
+void release_data(char *data, size_t size, int mapped){
+    if (mapped)
+        munmap(data, size);
+    else
+        free(data);
+}
@@ -0,0 +1,117 @@
+#include "RUDP_Trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Functions:
+*/
+static uint64_t trace_now_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+rudp_trace* rudp_trace_create(uint64_t capacity, int role){
+    uint64_t size = 1;
+    while (size < capacity){
+        size <<= 1;     // a power of two, so the index is a mask instead of a division
+    }
+
+    rudp_trace *trace = (rudp_trace *) calloc (1, sizeof(rudp_trace));
+    if (trace == NULL){
+        return NULL;
+    }
+    trace->events = (rudp_trace_event *) calloc (size, sizeof(rudp_trace_event));
+    if (trace->events == NULL){
+        free(trace);
+        return NULL;
+    }
+    trace->mask = size - 1;
+    trace->role = role;
+    trace->start_usec = trace_now_usec();
+    return trace;
+}
+
+void rudp_trace_record(rudp_trace *trace, uint8_t type, uint8_t flags, uint16_t seq_ack_number, uint16_t length, uint16_t window, uint32_t extra){
+    uint64_t head = trace->head;
+    rudp_trace_event *event = &trace->events[head & trace->mask];
+
+    event->time_usec = trace_now_usec();
+    event->extra = extra;
+    event->seq_ack_number = seq_ack_number;
+    event->length = length;
+    event->window = window;
+    event->type = type;
+    event->flags = flags;
+    event->reserved = 0;
+
+    // publish the event only after it is complete
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int rudp_trace_write(rudp_trace *trace, const char *path){
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint64_t capacity = trace->mask + 1;
+    uint64_t count = head < capacity ? head : capacity;
+
+    rudp_trace_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RUDP_TRACE_MAGIC, sizeof(header.magic));
+    header.version = RUDP_TRACE_VERSION;
+    header.event_size = sizeof(rudp_trace_event);
+    header.role = trace->role;
+    header.count = count;
+    header.dropped = head - count;
+    header.start_usec = trace->start_usec;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL){
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    // oldest first - the ring may have wrapped, so write it in (up to) two parts
+    uint64_t first = (head - count) & trace->mask;
+    uint64_t part = count < capacity - first ? count : capacity - first;
+    if (ok && part > 0)
+        ok = fwrite(&trace->events[first], sizeof(rudp_trace_event), part, file) == part;
+    if (ok && count > part)
+        ok = fwrite(trace->events, sizeof(rudp_trace_event), count - part, file) == count - part;
+    if (fclose(file) != 0)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+int rudp_trace_read(const char *path, rudp_trace_file_header *header, rudp_trace_event **events){
+    FILE *file = fopen(path, "rb");
+    if (file == NULL){
+        return -1;
+    }
+    if (fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, RUDP_TRACE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != RUDP_TRACE_VERSION || header->event_size != sizeof(rudp_trace_event)){
+        fclose(file);
+        return -1;
+    }
+    *events = (rudp_trace_event *) malloc ((header->count > 0 ? header->count : 1) * sizeof(rudp_trace_event));
+    if (*events == NULL){
+        fclose(file);
+        return -1;
+    }
+    if (fread(*events, sizeof(rudp_trace_event), header->count, file) != header->count){
+        free(*events);
+        *events = NULL;
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+void rudp_trace_destroy(rudp_trace *trace){
+    if (trace == NULL){
+        return;
+    }
+    free(trace->events);
+    free(trace);
+}
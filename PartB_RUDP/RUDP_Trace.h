@@ -0,0 +1,100 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Packet event tracing for RUDP connections.
+ * Every connection can keep a ring of fixed-size binary events (a packet sent, resent, received, dropped, a timeout...).
+ * Recording an event is a clock read and a 24 byte store - no locks, no formatting and no I/O - so it can stay
+ * on while measuring. The ring keeps the newest events and is written to a file when the connection is closed,
+ * RUDP_TraceDump turns the file into a qlog-like JSON timeline.
+*/
+
+/*
+ * Defines:
+*/
+#define RUDP_TRACE_ENV "RUDP_TRACE"             // path of the trace file, read by rudp_socket()
+#define RUDP_TRACE_DEFAULT_EVENTS 65536         // ring size, rounded up to a power of two
+#define RUDP_TRACE_MAGIC "RUDPTRC1"
+#define RUDP_TRACE_VERSION 1
+
+// Event types
+#define RUDP_TRACE_SENT 1           // a packet was sent for the first time (data, SYN, ACK or probe)
+#define RUDP_TRACE_RETRANSMIT 2     // a packet was sent again, extra = the try number
+#define RUDP_TRACE_RECEIVED 3       // a packet (not an ACK) arrived
+#define RUDP_TRACE_ACK 4            // an ACK arrived, seq = the ack number
+#define RUDP_TRACE_DROP 5           // an arrived packet was thrown away, extra = RUDP_TRACE_DROP_*
+#define RUDP_TRACE_TIMEOUT 6        // no ACK arrived in time, seq = the oldest unacknowledged packet, extra = tries
+
+// Drop reasons
+#define RUDP_TRACE_DROP_CHECKSUM 1
+#define RUDP_TRACE_DROP_DUPLICATE 2
+
+// Header flags, as recorded in rudp_trace_event.flags (same order as the packet header's bitfield)
+#define RUDP_TRACE_FLAG_SYN 0x01
+#define RUDP_TRACE_FLAG_ACK 0x02
+#define RUDP_TRACE_FLAG_EAK 0x04
+#define RUDP_TRACE_FLAG_NUL 0x10
+#define RUDP_TRACE_FLAG_CMP 0x80
+
+/*
+ * Structs:
+*/
+// 24 bytes, written to the file as is (host byte order)
+typedef struct _rudp_trace_event {
+    uint64_t time_usec;     // CLOCK_MONOTONIC
+    uint32_t extra;         // depends on the type, see above
+    uint16_t seq_ack_number;
+    uint16_t length;        // data length from the packet header
+    uint16_t window;        // window from the packet header
+    uint8_t type;           // RUDP_TRACE_*
+    uint8_t flags;          // RUDP_TRACE_FLAG_*
+    uint32_t reserved;
+} rudp_trace_event;
+
+// The file starts with this header, followed by `count` events (oldest first)
+typedef struct _rudp_trace_file_header {
+    char magic[8];          // RUDP_TRACE_MAGIC
+    uint32_t version;       // RUDP_TRACE_VERSION
+    uint32_t event_size;    // sizeof(rudp_trace_event)
+    uint32_t role;          // SERVER or CLIENT, as given to rudp_socket()
+    uint32_t reserved;
+    uint64_t count;         // events in the file
+    uint64_t dropped;       // older events that were overwritten in the ring
+    uint64_t start_usec;    // when tracing started
+} rudp_trace_file_header;
+
+// A single producer ring. head counts every event ever recorded and is published with a release store,
+// so another thread may read a consistent snapshot of the events older than head - capacity.
+typedef struct _rudp_trace {
+    rudp_trace_event *events;
+    uint64_t mask;          // capacity - 1
+    uint64_t head;
+    uint64_t start_usec;
+    int role;
+} rudp_trace;
+
+/*
+ * @brief Allocates a ring of at least the given amount of events.
+ * @return The ring, NULL if allocation failed.
+*/
+rudp_trace* rudp_trace_create(uint64_t capacity, int role);
+
+/*
+ * @brief Records a single event. Must be called by one thread at a time (the connection's owner).
+*/
+void rudp_trace_record(rudp_trace *trace, uint8_t type, uint8_t flags, uint16_t seq_ack_number, uint16_t length, uint16_t window, uint32_t extra);
+
+/*
+ * @brief Writes the events in the ring to a file.
+ * @return 0 on success, -1 on failure (errno is set).
+*/
+int rudp_trace_write(rudp_trace *trace, const char *path);
+
+/*
+ * @brief Reads a trace file written by rudp_trace_write().
+ * @param events Set to a malloc()ed array of header->count events - the caller frees it.
+ * @return 0 on success, -1 if the file can't be read or is not a trace.
+*/
+int rudp_trace_read(const char *path, rudp_trace_file_header *header, rudp_trace_event **events);
+
+void rudp_trace_destroy(rudp_trace *trace);
@@ -0,0 +1,122 @@
+#include "RUDP_API.h"
+#include "RUDP_Trace.h"
+#include <stdio.h>
+
+/*
+ * Converts a trace file written by an RUDP connection (RUDP_TRACE=<file>) into a qlog-like JSON timeline.
+*/
+
+/*
+ * Defines:
+*/
+#define USAGE "<trace_file> [output.json]\n"
+
+/*
+ * Declaring Functions:
+*/
+const char* packet_type(uint8_t flags);
+void print_event(FILE *out, const rudp_trace_event *event, uint64_t start_usec);
+
+/*
+ * Functions:
+*/
+int main(int argc, char *argv[]){
+    if (argc != 2 && argc != 3){
+        fprintf(stderr, "Usage: %s %s", argv[0], USAGE);
+        exit(FAIL);
+    }
+
+    rudp_trace_file_header header;
+    rudp_trace_event *events = NULL;
+    if (rudp_trace_read(argv[1], &header, &events) == -1){
+        fprintf(stderr, "ERROR! %s is not a readable trace file!\n", argv[1]);
+        exit(FAIL);
+    }
+
+    FILE *out = stdout;
+    if (argc == 3){
+        out = fopen(argv[2], "w");
+        if (out == NULL){
+            perror("fopen");
+            free(events);
+            exit(FAIL);
+        }
+    }
+
+    fprintf(out, "{\n  \"qlog_version\": \"0.3\",\n  \"qlog_format\": \"JSON\",\n  \"title\": \"RUDP trace\",\n");
+    fprintf(out, "  \"traces\": [{\n");
+    fprintf(out, "    \"vantage_point\": {\"type\": \"%s\"},\n", header.role == SERVER ? "server" : "client");
+    fprintf(out, "    \"common_fields\": {\"time_format\": \"relative\", \"reference_time\": %.3f},\n", header.start_usec / 1000.0);
+    fprintf(out, "    \"summary\": {\"events\": %llu, \"overwritten_events\": %llu},\n",
+            (unsigned long long)header.count, (unsigned long long)header.dropped);
+    fprintf(out, "    \"events\": [\n");
+    for (uint64_t i = 0; i < header.count; i++){
+        print_event(out, &events[i], header.start_usec);
+        fprintf(out, i + 1 < header.count ? ",\n" : "\n");
+    }
+    fprintf(out, "    ]\n  }]\n}\n");
+
+    if (out != stdout){
+        fclose(out);
+    }
+    free(events);
+    return 0;
+}
+
+// qlog's packet_type for the header flags
+const char* packet_type(uint8_t flags){
+    if ((flags & RUDP_TRACE_FLAG_SYN) && (flags & RUDP_TRACE_FLAG_ACK))
+        return "syn_ack";
+    if ((flags & RUDP_TRACE_FLAG_EAK) && (flags & RUDP_TRACE_FLAG_ACK))
+        return "nak";
+    if (flags & RUDP_TRACE_FLAG_EAK)
+        return "round_probe";
+    if (flags & RUDP_TRACE_FLAG_SYN)
+        return "syn";
+    if (flags & RUDP_TRACE_FLAG_ACK)
+        return "ack";
+    if (flags & RUDP_TRACE_FLAG_NUL)
+        return "probe";
+    return "data";
+}
+
+void print_event(FILE *out, const rudp_trace_event *event, uint64_t start_usec){
+    double time = ((int64_t)(event->time_usec - start_usec)) / 1000.0;       // ms since the trace started
+    const char *type = packet_type(event->flags);
+
+    fprintf(out, "      {\"time\": %.3f, ", time);
+    switch (event->type){
+        case RUDP_TRACE_SENT:
+        case RUDP_TRACE_RETRANSMIT:
+            fprintf(out, "\"name\": \"transport:packet_sent\", \"data\": {\"header\": {\"packet_type\": \"%s\", \"packet_number\": %u}, "
+                    "\"raw\": {\"payload_length\": %u}, \"window\": %u, \"compressed\": %s",
+                    type, event->seq_ack_number, event->length, event->window, (event->flags & RUDP_TRACE_FLAG_CMP) ? "true" : "false");
+            if (event->type == RUDP_TRACE_RETRANSMIT)
+                fprintf(out, ", \"trigger\": \"retransmit_timeout\", \"try\": %u", event->extra);
+            fprintf(out, "}}");
+            break;
+        case RUDP_TRACE_RECEIVED:
+            fprintf(out, "\"name\": \"transport:packet_received\", \"data\": {\"header\": {\"packet_type\": \"%s\", \"packet_number\": %u}, "
+                    "\"raw\": {\"payload_length\": %u}, \"window\": %u}}",
+                    type, event->seq_ack_number, event->length, event->window);
+            break;
+        case RUDP_TRACE_ACK:
+            fprintf(out, "\"name\": \"transport:packet_received\", \"data\": {\"header\": {\"packet_type\": \"%s\"}, "
+                    "\"ack_number\": %u, \"window\": %u}}",
+                    type, event->seq_ack_number, event->window);
+            break;
+        case RUDP_TRACE_DROP:
+            fprintf(out, "\"name\": \"transport:packet_dropped\", \"data\": {\"header\": {\"packet_type\": \"%s\", \"packet_number\": %u}, "
+                    "\"trigger\": \"%s\"}}",
+                    type, event->seq_ack_number, event->extra == RUDP_TRACE_DROP_CHECKSUM ? "invalid_checksum" : "duplicate");
+            break;
+        case RUDP_TRACE_TIMEOUT:
+            fprintf(out, "\"name\": \"recovery:loss_timer_updated\", \"data\": {\"event_type\": \"expired\", "
+                    "\"packet_number\": %u, \"tries\": %u}}",
+                    event->seq_ack_number, event->extra);
+            break;
+        default:
+            fprintf(out, "\"name\": \"rudp:unknown\", \"data\": {\"type\": %u}}", event->type);
+            break;
+    }
+}
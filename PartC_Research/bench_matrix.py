@@ -0,0 +1,286 @@
+"""
+Runs a benchmark matrix of protocol x congestion control algorithm x loss rate x payload size,
+without any user interaction, and writes the results as CSV and JSON.
+
+Every cell of the matrix starts a fresh receiver/sender pair that sends the payload --reps times.
+RUDP's packet loss is simulated in userspace with a fixed seed (RUDP_IMPAIR drops the datagrams before they are sent),
+so the same matrix loses the same packets every time it runs.
+
+TCP needs segments that are really dropped, or Reno and Cubic never see a loss. By default (--tcp-loss netem) the TCP
+cells run over a veth pair with tc netem on both ends, the receiver in a network namespace of its own - this needs
+root (CAP_NET_ADMIN) and the sch_netem module, and netem's drops are not seeded. --tcp-loss emulated uses libimpair.so
+instead, which never drops a segment but holds the sender back for a round trip per lost one: it runs anywhere, but
+measures sleeps, not congestion control. Every row names its loss model (the loss_model column).
+
+Example:
+    sudo python3 bench_matrix.py --protocols tcp,rudp --algos reno,cubic --loss 0,2,5 --sizes 2097152 --reps 10
+"""
+import argparse
+import csv
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+TCP_DIR = os.path.join(ROOT, "PartA_TCP")
+RUDP_DIR = os.path.join(ROOT, "PartB_RUDP")
+
+RUN_LINE = re.compile(r"Run #(\d+) Data: Time=([\d.]+)ms; Speed=([\d.]+)MB/s")
+
+# The veth pair of --tcp-loss netem: the sender's end stays here, the receiver's is moved into NETNS
+NETNS = "bench_matrix"
+HOST_DEV, PEER_DEV = "bench0", "bench1"
+HOST_ADDR, PEER_ADDR = "10.77.0.1", "10.77.0.2"
+
+LOSS_MODELS = {
+    "none": "no impairment",
+    "simulated": "real drops: RUDP_IMPAIR drops datagrams of both peers before they are sent (seeded)",
+    "netem": "real drops: tc netem on both ends of a veth pair (not seeded)",
+    "emulated": "no drops: libimpair.so delays the TCP sender a round trip per lost segment - not a congestion signal",
+}
+
+
+def csv_list(value, cast=str):
+    return [cast(item) for item in value.split(",") if item]
+
+
+def percentile(values, percent):
+    """Linear interpolation between the closest ranks."""
+    if not values:
+        return None
+    ordered = sorted(values)
+    position = (len(ordered) - 1) * percent / 100.0
+    lower = int(position)
+    upper = min(lower + 1, len(ordered) - 1)
+    return ordered[lower] + (ordered[upper] - ordered[lower]) * (position - lower)
+
+
+def summarize(values):
+    if not values:
+        return {"mean": None, "median": None, "p95": None, "p99": None, "min": None, "max": None}
+    return {
+        "mean": statistics.mean(values),
+        "median": statistics.median(values),
+        "p95": percentile(values, 95),
+        "p99": percentile(values, 99),
+        "min": min(values),
+        "max": max(values),
+    }
+
+
+def loss_model(protocol, loss, args):
+    """How the loss (and delay) of a cell is produced, a key of LOSS_MODELS."""
+    if protocol == "tcp" and args.tcp_loss == "netem" and args.netem_ready:
+        return "netem"     # every TCP cell, so the 0% ones cross the same link
+    if loss <= 0 and args.delay <= 0:
+        return "none"
+    return "simulated" if protocol == "rudp" else args.tcp_loss
+
+
+def ip(*command, netns=False, check=True):
+    prefix = ["ip", "netns", "exec", NETNS] if netns else []
+    return subprocess.run(prefix + list(command), check=check, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+
+
+def netem_setup():
+    """Creates the namespace and the veth pair, returns an error message or None."""
+    netem_teardown()
+    try:
+        ip("ip", "netns", "add", NETNS)
+        ip("ip", "link", "add", HOST_DEV, "type", "veth", "peer", "name", PEER_DEV)
+        ip("ip", "link", "set", PEER_DEV, "netns", NETNS)
+        ip("ip", "addr", "add", HOST_ADDR + "/24", "dev", HOST_DEV)
+        ip("ip", "link", "set", HOST_DEV, "up")
+        ip("ip", "addr", "add", PEER_ADDR + "/24", "dev", PEER_DEV, netns=True)
+        ip("ip", "link", "set", PEER_DEV, "up", netns=True)
+        ip("ip", "link", "set", "lo", "up", netns=True)
+        # netem drops whole GSO packets - keep them a single segment, so the loss rate is per segment (best effort)
+        ip("ip", "link", "set", HOST_DEV, "gso_max_segs", "1", check=False)
+        ip("ip", "link", "set", PEER_DEV, "gso_max_segs", "1", netns=True, check=False)
+        netem_apply(0, 0, 0)
+    except (OSError, subprocess.CalledProcessError) as error:
+        netem_teardown()
+        details = getattr(error, "stderr", None) or str(error)
+        return details.strip()
+    return None
+
+
+def netem_apply(loss, delay, seed):
+    """Both directions lose loss percent and are delayed by delay ms."""
+    for netns, dev in ((False, HOST_DEV), (True, PEER_DEV)):
+        spec = ["loss", "%g%%" % loss, "delay", "%gms" % delay, "limit", "100000"]
+        # the seed is newer than netem itself
+        if ip("tc", "qdisc", "replace", "dev", dev, "root", "netem", *spec, "seed", str(seed), netns=netns, check=False).returncode != 0:
+            ip("tc", "qdisc", "replace", "dev", dev, "root", "netem", *spec, netns=netns)
+
+
+def netem_teardown():
+    # the veth pair goes with the namespace
+    subprocess.run(["ip", "netns", "del", NETNS], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def impairment_env(protocol, loss, args):
+    """Environment variables that make both peers lose `loss` percent of their packets (netem needs none)."""
+    env = dict(os.environ)
+    model = loss_model(protocol, loss, args)
+    if model in ("none", "netem"):
+        return env
+    spec = "seed=%d,loss=%g" % (args.seed, loss)
+    if args.delay > 0:
+        spec += ",delay=%g" % args.delay
+    if protocol == "rudp":
+        env["RUDP_IMPAIR"] = spec
+    else:
+        env["IMPAIR"] = spec
+        env["LD_PRELOAD"] = os.path.join(TCP_DIR, "libimpair.so")
+    return env
+
+
+def commands(protocol, algo, port, size, args):
+    if protocol == "tcp":
+        receiver = ["./TCP_Receiver", "-p", str(port), "-algo", algo]
+        sender = ["./TCP_Sender", "-ip", "127.0.0.1", "-p", str(port), "-algo", algo]
+        if loss_model(protocol, 0, args) == "netem":
+            receiver = ["ip", "netns", "exec", NETNS] + receiver
+            sender[2] = PEER_ADDR
+        cwd = TCP_DIR
+    else:
+        receiver = ["./RUDP_Receiver", "-p", str(port)]
+        sender = ["./RUDP_Sender", "-ip", "127.0.0.1", "-p", str(port)]
+        cwd = RUDP_DIR
+    sender += ["-runs", str(args.reps), "-size", str(size)]
+    if args.compress:
+        sender.append("-compress")
+    return receiver, sender, cwd
+
+
+def run_cell(protocol, algo, loss, size, port, args):
+    """Runs one pair of programs, returns the per run times (ms) and speeds (MB/s)."""
+    receiver_cmd, sender_cmd, cwd = commands(protocol, algo, port, size, args)
+    env = impairment_env(protocol, loss, args)
+    if loss_model(protocol, loss, args) == "netem":
+        netem_apply(loss, args.delay, args.seed)
+
+    receiver = subprocess.Popen(receiver_cmd, cwd=cwd, env=env, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT, stdin=subprocess.DEVNULL, text=True)
+    time.sleep(args.startup_delay)
+    sender = subprocess.Popen(sender_cmd, cwd=cwd, env=env, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL, stdin=subprocess.DEVNULL)
+    error = None
+    try:
+        output, _ = receiver.communicate(timeout=args.timeout)
+        sender.wait(timeout=args.timeout)
+    except subprocess.TimeoutExpired:
+        receiver.kill()
+        sender.kill()
+        output, _ = receiver.communicate()
+        error = "timeout"
+
+    times, speeds = [], []
+    for match in RUN_LINE.finditer(output or ""):
+        times.append(float(match.group(2)))
+        speeds.append(float(match.group(3)))
+    if error is None and len(times) != args.reps:
+        error = "expected %d runs, got %d" % (args.reps, len(times))
+    return times, speeds, error
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--protocols", default="tcp,rudp", help="comma separated: tcp,rudp")
+    parser.add_argument("--algos", default="reno,cubic", help="TCP congestion control algorithms (any in tcp_available_congestion_control)")
+    parser.add_argument("--loss", default="0,2,5,10", help="loss rates in percent")
+    parser.add_argument("--sizes", default="2105344", help="payload sizes in bytes")
+    parser.add_argument("--reps", type=int, default=5, help="transfers per cell")
+    parser.add_argument("--delay", type=float, default=0, help="one way delay in ms, added to every cell")
+    parser.add_argument("--seed", type=int, default=1, help="impairment PRNG seed")
+    parser.add_argument("--tcp-loss", choices=["netem", "emulated"], default="netem",
+                        help="how TCP cells lose segments: netem (real drops, needs root) or emulated (libimpair.so delays)")
+    parser.add_argument("--compress", action="store_true", help="offer compression to the receivers")
+    parser.add_argument("--port", type=int, default=6100, help="first port to use, one port per cell")
+    parser.add_argument("--timeout", type=float, default=300, help="seconds before giving up on a cell")
+    parser.add_argument("--startup-delay", type=float, default=0.5, help="seconds to let a receiver start")
+    parser.add_argument("--output", default="bench_results", help="output path without extension")
+    parser.add_argument("--build", action="store_true", help="run make before benchmarking")
+    args = parser.parse_args()
+
+    if args.build:
+        for directory in (TCP_DIR, RUDP_DIR):
+            subprocess.run(["make", "-s"], cwd=directory, check=True)
+
+    protocols = csv_list(args.protocols)
+    args.netem_ready = False
+    if "tcp" in protocols and args.tcp_loss == "netem" and (any(loss > 0 for loss in csv_list(args.loss, float)) or args.delay > 0):
+        error = netem_setup()
+        if error is not None:
+            print("ERROR! TCP loss needs a veth pair with tc netem (root and sch_netem): %s" % error, file=sys.stderr)
+            print("Run as root, leave TCP out, or pass --tcp-loss emulated for libimpair.so's delays (no real drops).", file=sys.stderr)
+            return 2
+        args.netem_ready = True
+    cells = []
+    for protocol in protocols:
+        # congestion control is a TCP thing
+        algos = csv_list(args.algos) if protocol == "tcp" else ["-"]
+        for algo in algos:
+            for loss in csv_list(args.loss, float):
+                for size in csv_list(args.sizes, int):
+                    cells.append((protocol, algo, loss, size))
+
+    results = []
+    port = args.port
+    try:
+        for index, (protocol, algo, loss, size) in enumerate(cells, 1):
+            model = loss_model(protocol, loss, args)
+            print("[%d/%d] %s %s loss=%g%% (%s) size=%d" % (index, len(cells), protocol, algo, loss, model, size), flush=True)
+            times, speeds, error = run_cell(protocol, algo, loss, size, port, args)
+            port += 1
+            results.append(cell_result(protocol, algo, loss, model, size, times, speeds, error))
+    finally:
+        if args.netem_ready:
+            netem_teardown()
+
+    with open(args.output + ".json", "w") as file:
+        json.dump({"seed": args.seed, "reps": args.reps, "delay_ms": args.delay, "tcp_loss": args.tcp_loss,
+                   "loss_models": LOSS_MODELS, "results": results}, file, indent=2)
+
+    stats = ["mean", "median", "p95", "p99", "min", "max"]
+    with open(args.output + ".csv", "w", newline="") as file:
+        writer = csv.writer(file)
+        writer.writerow(["protocol", "algo", "loss", "loss_model", "size", "runs", "error"]
+                        + ["speed_%s" % stat for stat in stats] + ["time_%s" % stat for stat in stats])
+        for result in results:
+            writer.writerow([result["protocol"], result["algo"], result["loss"], result["loss_model"], result["size"], result["runs"],
+                             result["error"] or ""]
+                            + [result["speed_mbps"][stat] for stat in stats] + [result["time_ms"][stat] for stat in stats])
+
+    print("Results written to %s.csv and %s.json" % (args.output, args.output))
+    return 1 if any(result["error"] for result in results) else 0
+
+
+def cell_result(protocol, algo, loss, model, size, times, speeds, error):
+    result = {
+        "protocol": protocol,
+        "algo": algo,
+        "loss": loss,
+        "loss_model": model,
+        "size": size,
+        "runs": len(times),
+        "error": error,
+        "time_ms": summarize(times),
+        "speed_mbps": summarize(speeds),
+        "raw_time_ms": times,
+        "raw_speed_mbps": speeds,
+    }
+    if error:
+        print("    error: %s" % error, flush=True)
+    else:
+        print("    median %.2fMB/s, p95 time %.2fms" % (result["speed_mbps"]["median"], result["time_ms"]["p95"]), flush=True)
+    return result
+
+
+if __name__ == "__main__":
+    sys.exit(main())